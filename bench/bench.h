@@ -0,0 +1,48 @@
+#ifndef STARCALLER_BENCH_H
+#define STARCALLER_BENCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Runs the operation being measured `iterations` times in a row
+typedef void (*bench_function_t)(void *, size_t);
+
+/// Times the function over many samples, each a batch of iterations sized to
+/// take long enough to time reliably, and prints one JSON object per line:
+///
+///   {"name": ..., "iterations": ..., "ns_per_op": ..., "allocs_per_op": ...,
+///    "p50_ns": ..., "p99_ns": ..., "p999_ns": ...}
+///
+/// Percentiles are over the per-op time of each sample. Does nothing if the
+/// name does not start with the filter given on the command line.
+void bench_run(const char *, bench_function_t, void *);
+
+/// Whether a benchmark by that name, or prefix of it, would run at all, so
+/// suites can skip their setup
+bool bench_is_selected(const char *);
+
+/// Heap allocations made through malloc() and friends since startup, counted
+/// by wrapping them at link time (-Wl,--wrap). Allocations made from inside
+/// libc, such as strdup()'s, go uncounted.
+uint64_t bench_allocations(void);
+
+/// Keeps the compiler from optimizing away a result
+#define BENCH_USE(value) __asm__ volatile("" : : "g"(value) : "memory")
+
+void bench_parser(void);
+void bench_router(void);
+void bench_writer(void);
+void bench_threadpool(void);
+void bench_timer_wheel(void);
+
+void *__wrap_malloc(size_t);
+void *__wrap_calloc(size_t, size_t);
+void *__wrap_realloc(void *, size_t);
+void *__wrap_aligned_alloc(size_t, size_t);
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+void *__real_aligned_alloc(size_t, size_t);
+
+#endif
@@ -0,0 +1,135 @@
+#include "bench.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "logger.h"
+
+/// Samples taken of every benchmark, enough for a meaningful p99.9
+#define BENCH_SAMPLES 2000
+/// Shortest a sample may take, so the clock's overhead stays negligible
+#define BENCH_MIN_SAMPLE_NS 20000
+#define BENCH_MAX_BATCH (1u << 20)
+
+static _Atomic uint64_t allocations = 0;
+static const char *filter = "";
+
+static uint64_t now_ns(void);
+static int compare_doubles(const void *, const void *);
+
+int main(int argc, char **argv)
+{
+        if (argc > 1)
+                filter = argv[1];
+
+        // the server's own logging would only measure stderr
+        log_set_level(LOG_LEVEL_ERROR);
+
+        bench_parser();
+        bench_router();
+        bench_writer();
+        bench_threadpool();
+        bench_timer_wheel();
+        return 0;
+}
+
+bool bench_is_selected(const char *name)
+{
+        size_t name_length = strlen(name);
+        size_t filter_length = strlen(filter);
+        size_t common = name_length < filter_length ? name_length : filter_length;
+
+        return strncmp(name, filter, common) == 0;
+}
+
+void bench_run(const char *name, bench_function_t function, void *state)
+{
+        if (strncmp(name, filter, strlen(filter)) != 0)
+                return;
+
+        // warm up caches and branch predictors while finding a batch size
+        // which takes long enough to time, the very first call being too
+        // cold to say anything about that
+        function(state, 1);
+
+        size_t batch = 1;
+        while (batch < BENCH_MAX_BATCH) {
+                uint64_t start = now_ns();
+                function(state, batch);
+                if (now_ns() - start >= BENCH_MIN_SAMPLE_NS)
+                        break;
+                batch *= 2;
+        }
+
+        static double samples[BENCH_SAMPLES];
+        uint64_t allocations_before = bench_allocations();
+        uint64_t total_ns = 0;
+
+        for (size_t i = 0; i < BENCH_SAMPLES; ++i) {
+                uint64_t start = now_ns();
+                function(state, batch);
+                uint64_t elapsed = now_ns() - start;
+
+                total_ns += elapsed;
+                samples[i] = (double)elapsed / (double)batch;
+        }
+
+        uint64_t iterations = (uint64_t)batch * BENCH_SAMPLES;
+        uint64_t allocated = bench_allocations() - allocations_before;
+
+        qsort(samples, BENCH_SAMPLES, sizeof(samples[0]), compare_doubles);
+
+        printf("{\"name\": \"%s\", \"iterations\": %lu, \"ns_per_op\": %.2f, "
+               "\"allocs_per_op\": %.3f, \"p50_ns\": %.2f, \"p99_ns\": %.2f, "
+               "\"p999_ns\": %.2f}\n",
+               name, iterations, (double)total_ns / (double)iterations,
+               (double)allocated / (double)iterations, samples[BENCH_SAMPLES / 2],
+               samples[BENCH_SAMPLES * 99 / 100], samples[BENCH_SAMPLES * 999 / 1000]);
+        fflush(stdout);
+}
+
+uint64_t bench_allocations(void)
+{
+        return atomic_load_explicit(&allocations, memory_order_relaxed);
+}
+
+void *__wrap_malloc(size_t size)
+{
+        atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+        return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+        atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+        return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size)
+{
+        atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+        return __real_realloc(pointer, size);
+}
+
+void *__wrap_aligned_alloc(size_t alignment, size_t size)
+{
+        atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+        return __real_aligned_alloc(alignment, size);
+}
+
+static uint64_t now_ns(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+        double x = *(const double *)a;
+        double y = *(const double *)b;
+        return (x > y) - (x < y);
+}
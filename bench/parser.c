@@ -0,0 +1,106 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http.h"
+#include "parser.h"
+
+#define PARSER_BODY_LENGTH 8192
+
+typedef struct {
+        const char *request;
+        size_t length;
+        /// Parsing NUL-terminates fields in place, so every iteration starts
+        /// from a fresh copy, much like a read() into the connection's buffer
+        char *buffer;
+} parser_state_t;
+
+static void parse(void *, size_t);
+
+static const char SMALL_REQUEST[] = "GET /users/42 HTTP/1.1\r\n"
+                                    "Host: localhost:8080\r\n"
+                                    "User-Agent: curl/8.5.0\r\n"
+                                    "Accept: */*\r\n"
+                                    "\r\n";
+
+static const char HEADER_HEAVY_REQUEST[] =
+        "GET /static/css/app.3f9c2b.css?v=20240611 HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Connection: keep-alive\r\n"
+        "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", "
+        "\"Not-A.Brand\";v=\"99\"\r\n"
+        "sec-ch-ua-mobile: ?0\r\n"
+        "sec-ch-ua-platform: \"Linux\"\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+        "Chrome/124.0.0.0 Safari/537.36\r\n"
+        "Accept: text/css,*/*;q=0.1\r\n"
+        "Sec-Fetch-Site: same-origin\r\n"
+        "Sec-Fetch-Mode: no-cors\r\n"
+        "Sec-Fetch-Dest: style\r\n"
+        "Referer: https://www.example.com/account/settings/profile\r\n"
+        "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+        "Accept-Language: en-US,en;q=0.9,bg;q=0.8\r\n"
+        "Cookie: session=6f1c0e2a9b7d4c3f8e5a1b2c3d4e5f60; csrftoken=Zx81kQ2LmN9pR4sT7uV0wY3z; "
+        "_ga=GA1.1.1234567890.1700000000; theme=dark; locale=en-US\r\n"
+        "If-None-Match: \"5f2b-18c4a7e3d10\"\r\n"
+        "If-Modified-Since: Tue, 11 Jun 2024 09:12:44 GMT\r\n"
+        "Cache-Control: max-age=0\r\n"
+        "Priority: u=0, i\r\n"
+        "\r\n";
+
+void bench_parser(void)
+{
+        if (!bench_is_selected("parser/"))
+                return;
+
+        char *large = malloc(sizeof(SMALL_REQUEST) + 128 + PARSER_BODY_LENGTH);
+        char *buffer = malloc(sizeof(HEADER_HEAVY_REQUEST) + 128 + PARSER_BODY_LENGTH);
+        if (!large || !buffer) {
+                free(large);
+                free(buffer);
+                return;
+        }
+
+        int head = sprintf(large,
+                           "POST /upload HTTP/1.1\r\n"
+                           "Host: localhost:8080\r\n"
+                           "Content-Type: application/octet-stream\r\n"
+                           "Content-Length: %d\r\n"
+                           "\r\n",
+                           PARSER_BODY_LENGTH);
+        memset(large + head, 'x', PARSER_BODY_LENGTH);
+
+        parser_state_t small = { SMALL_REQUEST, sizeof(SMALL_REQUEST) - 1, buffer };
+        parser_state_t header_heavy = { HEADER_HEAVY_REQUEST, sizeof(HEADER_HEAVY_REQUEST) - 1,
+                                        buffer };
+        parser_state_t large_body = { large, (size_t)head + PARSER_BODY_LENGTH, buffer };
+
+        bench_run("parser/small", parse, &small);
+        bench_run("parser/header_heavy", parse, &header_heavy);
+        bench_run("parser/large_body", parse, &large_body);
+
+        free(large);
+        free(buffer);
+}
+
+static void parse(void *raw_state, size_t iterations)
+{
+        parser_state_t *state = raw_state;
+        http_parser_t parser;
+        http_request_t request;
+
+        for (size_t i = 0; i < iterations; ++i) {
+                memcpy(state->buffer, state->request, state->length);
+
+                http_parser_init(&parser);
+                if (http_parser_execute(&parser, state->buffer, state->length) !=
+                    HTTP_PARSE_COMPLETE)
+                        abort();
+
+                http_parser_finish(&parser, &request, state->buffer);
+                BENCH_USE(request.header_count);
+        }
+}
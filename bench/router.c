@@ -0,0 +1,128 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http.h"
+#include "utils.h"
+
+/// Paths looked up round-robin, a mix of hits on every kind of route, 405s
+/// and 404s
+#define ROUTER_LOOKUPS 64
+
+typedef struct {
+        http_router_t *router;
+        http_request_t requests[ROUTER_LOOKUPS];
+        char paths[ROUTER_LOOKUPS][64];
+} router_state_t;
+
+static void lookup(void *, size_t);
+static http_response_t *handler(const http_request_t *);
+/// Registers `count` routes, a third each static, with a parameter and with
+/// a wildcard, the way a REST API's would look
+static int add_routes(http_router_t *, size_t);
+
+void bench_router(void)
+{
+        static const size_t ROUTE_COUNTS[] = { 10, 100, 1000 };
+
+        for (size_t i = 0; i < sizeof(ROUTE_COUNTS) / sizeof(ROUTE_COUNTS[0]); ++i) {
+                char name[64];
+                snprintf(name, sizeof(name), "router/%zu_routes", ROUTE_COUNTS[i]);
+                if (!bench_is_selected(name))
+                        continue;
+
+                router_state_t *state = calloc(1, sizeof(router_state_t));
+                if (!state)
+                        return;
+
+                state->router = http_router_new();
+                if (!state->router || add_routes(state->router, ROUTE_COUNTS[i]) != 0) {
+                        http_router_free(state->router);
+                        free(state);
+                        return;
+                }
+
+                size_t resources = ROUTE_COUNTS[i] / 3 + 1;
+                for (size_t j = 0; j < ROUTER_LOOKUPS; ++j) {
+                        http_request_t *request = &state->requests[j];
+                        size_t resource = (j * 7919) % resources;
+                        request->method = HTTP_GET;
+
+                        switch (j % 5) {
+                        case 0:
+                                snprintf(state->paths[j], sizeof(state->paths[j]),
+                                         "/api/v1/resource%zu", resource);
+                                break;
+                        case 1:
+                                snprintf(state->paths[j], sizeof(state->paths[j]),
+                                         "/api/v1/resource%zu/%zu", resource, j * 31);
+                                break;
+                        case 2:
+                                snprintf(state->paths[j], sizeof(state->paths[j]),
+                                         "/files%zu/assets/img/logo.png", resource);
+                                break;
+                        case 3:
+                                snprintf(state->paths[j], sizeof(state->paths[j]),
+                                         "/api/v1/resource%zu", resource);
+                                request->method = HTTP_DELETE;
+                                break;
+                        default:
+                                snprintf(state->paths[j], sizeof(state->paths[j]),
+                                         "/api/v2/missing%zu", resource);
+                                break;
+                        }
+
+                        request->path = state->paths[j];
+                        request->path_length = strlen(state->paths[j]);
+                }
+
+                bench_run(name, lookup, state);
+
+                http_router_free(state->router);
+                free(state);
+        }
+}
+
+static void lookup(void *raw_state, size_t iterations)
+{
+        router_state_t *state = raw_state;
+
+        for (size_t i = 0; i < iterations; ++i) {
+                http_route_match_t match = http_router_get_handler(
+                        state->router, &state->requests[i % ROUTER_LOOKUPS]);
+                BENCH_USE(match.handler);
+        }
+}
+
+static http_response_t *handler(__attribute__((unused)) const http_request_t *request)
+{
+        return NULL;
+}
+
+static int add_routes(http_router_t *router, size_t count)
+{
+        char pattern[64];
+
+        for (size_t i = 0; i < count; ++i) {
+                size_t resource = i / 3;
+
+                switch (i % 3) {
+                case 0:
+                        snprintf(pattern, sizeof(pattern), "/api/v1/resource%zu", resource);
+                        break;
+                case 1:
+                        snprintf(pattern, sizeof(pattern), "/api/v1/resource%zu/:id", resource);
+                        break;
+                default:
+                        snprintf(pattern, sizeof(pattern), "/files%zu/*path", resource);
+                        break;
+                }
+
+                if (http_router_add_route(router, HTTP_GET, pattern, handler) != 0)
+                        return -1;
+        }
+
+        return 0;
+}
@@ -0,0 +1,68 @@
+#include "bench.h"
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "threadpool.h"
+
+typedef struct {
+        threadpool_t *pool;
+        _Atomic size_t completed;
+} threadpool_state_t;
+
+/// Submits the batch from a single producer, like an event loop would, and
+/// waits for all of it, so ns/op is the inverse of sustained throughput
+static void execute(void *, size_t);
+static void task(void *);
+
+void bench_threadpool(void)
+{
+        static const size_t WORKER_COUNTS[] = { 1, 2, 4, 8 };
+        static const struct {
+                threadpool_policy_t policy;
+                const char *name;
+        } POLICIES[] = {
+                { THREADPOOL_POLICY_FIFO, "fifo" },
+                { THREADPOOL_POLICY_WORK_STEALING, "work_stealing" },
+        };
+
+        for (size_t p = 0; p < sizeof(POLICIES) / sizeof(POLICIES[0]); ++p) {
+                for (size_t w = 0; w < sizeof(WORKER_COUNTS) / sizeof(WORKER_COUNTS[0]); ++w) {
+                        char name[64];
+                        snprintf(name, sizeof(name), "threadpool/%s/%zu_workers",
+                                 POLICIES[p].name, WORKER_COUNTS[w]);
+                        if (!bench_is_selected(name))
+                                continue;
+
+                        threadpool_state_t state;
+                        atomic_init(&state.completed, 0);
+                        state.pool = threadpool_create(WORKER_COUNTS[w], POLICIES[p].policy, NULL);
+                        if (!state.pool)
+                                return;
+
+                        bench_run(name, execute, &state);
+                        threadpool_free(state.pool);
+                }
+        }
+}
+
+static void execute(void *raw_state, size_t iterations)
+{
+        threadpool_state_t *state = raw_state;
+        atomic_store_explicit(&state->completed, 0, memory_order_relaxed);
+
+        for (size_t i = 0; i < iterations; ++i) {
+                while (threadpool_execute(state->pool, task, state) != 0)
+                        sched_yield();
+        }
+
+        while (atomic_load_explicit(&state->completed, memory_order_acquire) < iterations)
+                sched_yield();
+}
+
+static void task(void *raw_state)
+{
+        threadpool_state_t *state = raw_state;
+        atomic_fetch_add_explicit(&state->completed, 1, memory_order_release);
+}
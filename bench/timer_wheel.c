@@ -0,0 +1,81 @@
+#include "bench.h"
+
+#include <stdlib.h>
+
+#include "timer_wheel.h"
+
+/// Timers kept pending, about what a busy event loop holds
+#define TIMER_WHEEL_PENDING 4096
+/// Header timeout, the deadline a fresh connection is armed with
+#define TIMER_WHEEL_DEADLINE_MS 10000
+/// Longer than the wheel spans, which is how long a loop may sleep with no
+/// timers armed
+#define TIMER_WHEEL_IDLE_MS (5ULL * 3600 * 1000)
+
+typedef struct {
+        timer_wheel_t wheel;
+        timer_wheel_timer_t timers[TIMER_WHEEL_PENDING];
+        uint64_t now;
+} timer_wheel_state_t;
+
+/// Arms a timer the way the loop does for a returned connection: catching
+/// up with the clock, scheduling the deadline, and cancelling it once the
+/// connection is ready again
+static void rearm(void *, size_t);
+
+/// Aborts unless a deadline armed on a wheel which has been idle for longer
+/// than it spans expires when due, and no sooner
+static void check_idle_gap(void);
+
+void bench_timer_wheel(void)
+{
+        if (!bench_is_selected("timer_wheel/"))
+                return;
+
+        check_idle_gap();
+
+        timer_wheel_state_t *state = malloc(sizeof(timer_wheel_state_t));
+        if (!state)
+                return;
+
+        state->now = 0;
+        timer_wheel_init(&state->wheel, state->now);
+        for (size_t i = 0; i < TIMER_WHEEL_PENDING; ++i) {
+                timer_wheel_timer_init(&state->timers[i]);
+                timer_wheel_schedule(&state->wheel, &state->timers[i],
+                                     TIMER_WHEEL_DEADLINE_MS + i);
+        }
+
+        bench_run("timer_wheel/rearm", rearm, state);
+        free(state);
+}
+
+static void rearm(void *raw_state, size_t iterations)
+{
+        timer_wheel_state_t *state = raw_state;
+
+        for (size_t i = 0; i < iterations; ++i) {
+                timer_wheel_timer_t *timer = &state->timers[i % TIMER_WHEEL_PENDING];
+
+                timer_wheel_cancel(&state->wheel, timer);
+                timer_wheel_advance(&state->wheel, state->now);
+                timer_wheel_schedule(&state->wheel, timer, state->now + TIMER_WHEEL_DEADLINE_MS);
+        }
+}
+
+static void check_idle_gap(void)
+{
+        timer_wheel_t wheel;
+        timer_wheel_timer_t timer;
+        timer_wheel_init(&wheel, 0);
+        timer_wheel_timer_init(&timer);
+
+        uint64_t now = TIMER_WHEEL_IDLE_MS;
+        timer_wheel_advance(&wheel, now);
+        timer_wheel_schedule(&wheel, &timer, now + TIMER_WHEEL_DEADLINE_MS);
+
+        if (timer_wheel_pop_expired(&wheel, now + TIMER_WHEEL_DEADLINE_MS - 1) != NULL)
+                abort();
+        if (timer_wheel_pop_expired(&wheel, now + TIMER_WHEEL_DEADLINE_MS) != &timer)
+                abort();
+}
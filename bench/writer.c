@@ -0,0 +1,109 @@
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "http.h"
+#include "utils.h"
+
+#define WRITER_PIPELINE_DEPTH 16
+#define WRITER_LARGE_BODY_LENGTH 65536
+
+typedef struct {
+        int fd;
+        const http_response_t *responses[WRITER_PIPELINE_DEPTH];
+        http_response_meta_t meta[WRITER_PIPELINE_DEPTH];
+        size_t count;
+} writer_state_t;
+
+static void write_responses(void *, size_t);
+/// Reads and discards everything written, as a fast client would
+static void *drain(void *);
+
+void bench_writer(void)
+{
+        if (!bench_is_selected("writer/"))
+                return;
+
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+                return;
+
+        pthread_t drainer;
+        if (pthread_create(&drainer, NULL, drain, &fds[1]) != 0) {
+                close(fds[0]);
+                close(fds[1]);
+                return;
+        }
+
+        static char SMALL_BODY[] = "{\"id\": 42, \"name\": \"Kaldorei\"}";
+        static char CONTENT_TYPE[] = "Content-Type: application/json";
+        static char CACHE_CONTROL[] = "Cache-Control: no-store";
+        char *headers[] = { CONTENT_TYPE, CACHE_CONTROL, NULL };
+        char *large_body = malloc(WRITER_LARGE_BODY_LENGTH);
+        if (large_body)
+                memset(large_body, 'x', WRITER_LARGE_BODY_LENGTH);
+
+        http_response_t small = {
+                .status_code = HTTP_OK,
+                .body = SMALL_BODY,
+                .body_length = sizeof(SMALL_BODY) - 1,
+                .headers = headers,
+                .arena = NULL,
+        };
+        http_response_t large = {
+                .status_code = HTTP_OK,
+                .body = large_body,
+                .body_length = large_body ? WRITER_LARGE_BODY_LENGTH : 0,
+                .headers = NULL,
+                .arena = NULL,
+        };
+
+        writer_state_t state = { .fd = fds[0], .count = 1 };
+        for (size_t i = 0; i < WRITER_PIPELINE_DEPTH; ++i) {
+                state.responses[i] = &small;
+                state.meta[i].keep_alive = true;
+                state.meta[i].allow = NULL;
+                state.meta[i].is_head = false;
+        }
+
+        bench_run("writer/small", write_responses, &state);
+
+        state.count = WRITER_PIPELINE_DEPTH;
+        bench_run("writer/pipelined_16", write_responses, &state);
+
+        state.responses[0] = &large;
+        state.count = 1;
+        bench_run("writer/large_body", write_responses, &state);
+
+        shutdown(fds[0], SHUT_WR);
+        pthread_join(drainer, NULL);
+        close(fds[0]);
+        close(fds[1]);
+        free(large_body);
+}
+
+static void write_responses(void *raw_state, size_t iterations)
+{
+        writer_state_t *state = raw_state;
+
+        for (size_t i = 0; i < iterations; ++i) {
+                if (write_http_responses(state->fd, state->responses, state->meta, state->count,
+                                         -1) < 0)
+                        abort();
+        }
+}
+
+static void *drain(void *raw_fd)
+{
+        int fd = *(int *)raw_fd;
+        static char buffer[1 << 16];
+
+        while (read(fd, buffer, sizeof(buffer)) > 0)
+                ;
+
+        return NULL;
+}
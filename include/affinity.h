@@ -0,0 +1,39 @@
+#ifndef STARCALLER_AFFINITY_H
+#define STARCALLER_AFFINITY_H
+
+#include <stddef.h>
+
+typedef enum {
+        /// Threads run wherever the kernel schedules them
+        CPU_AFFINITY_NONE,
+        /// Thread `i` of a group is pinned to the `i`-th CPU the process may
+        /// run on (wrapping around), starting after the group's offset
+        CPU_AFFINITY_SPREAD,
+        /// Thread `i` of a group is pinned to `cpus[i % cpu_count]`
+        CPU_AFFINITY_LIST,
+} cpu_affinity_mode_t;
+
+/// Placement for a group of threads. With CPU_AFFINITY_LIST, `cpus` must stay
+/// valid for as long as threads are being started with it.
+typedef struct {
+        cpu_affinity_mode_t mode;
+        const int *cpus;
+        size_t cpu_count;
+} cpu_affinity_t;
+
+/// Pins the calling thread as the given thread index of its group. The offset
+/// shifts where CPU_AFFINITY_SPREAD starts, so that several groups spread
+/// over the machine do not pile up on the same CPUs.
+///
+/// Memory the thread first touches after this is placed on its NUMA node by
+/// the kernel's default policy, so per-thread state should be allocated and
+/// initialized by the thread itself, afterwards.
+///
+/// Returns the following status:
+///  0 - the thread was pinned, or the mode is CPU_AFFINITY_NONE
+/// -1 - invalid arguments
+/// -2 - no CPU is available for the thread
+/// -3 - the kernel rejected the CPU
+int cpu_affinity_apply(const cpu_affinity_t *, size_t, size_t);
+
+#endif
@@ -1,10 +1,17 @@
 #ifndef STARCALLER_HTTP_H
 #define STARCALLER_HTTP_H
 
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "threadpool.h"
 
+// BSD libcs provide this through <sys/cdefs.h>, glibc does not
+#ifndef __unused
+#define __unused __attribute__((unused))
+#endif
+
 typedef enum {
         HTTP_GET,
         HTTP_POST,
@@ -20,23 +27,85 @@ typedef enum {
 
 #define HTTP_METHOD_COUNT _HTTP_UNKNOWN
 
+#define HTTP_MAX_HEADERS 32
+
+/// Header names and values point into the connection's receive buffer and are
+/// NUL-terminated in place, so they stay valid until the response is written
+typedef struct {
+        const char *name;
+        size_t name_length;
+        const char *value;
+        size_t value_length;
+} http_header_t;
+
+#define HTTP_MAX_PARAMS 8
+
+/// A path parameter captured by the router. The name is owned by the router,
+/// the value is a view into the request path and is not NUL-terminated.
+typedef struct {
+        const char *name;
+        size_t name_length;
+        const char *value;
+        size_t value_length;
+} http_param_t;
+
+typedef struct _HttpArena http_arena_t;
+typedef struct _HttpMetrics http_metrics_t;
+
+/// All strings are views into the connection's receive buffer. The request
+/// line fields are NUL-terminated in place. The body is not, since the next
+/// pipelined request may follow it directly, so use `body_length`; one which
+/// does not fit into the buffer (or comes in chunks) is collected on the heap
+/// instead, up to `max_body_size`.
 typedef struct {
         http_method_t method;
         char *method_str;
+        size_t method_length;
         char *path;
+        size_t path_length;
         char *version;
-        char **headers;
+        size_t version_length;
+        http_header_t headers[HTTP_MAX_HEADERS];
+        size_t header_count;
+        http_param_t params[HTTP_MAX_PARAMS];
+        size_t param_count;
+        /// NULL for a streaming route, whose body handler has been handed the
+        /// `body_length` bytes of it by the time the route's handler runs
         char *body;
+        size_t body_length;
+        /// Scratch memory for the handler, see `http_request_alloc()`
+        http_arena_t *arena;
+        /// Left to a streaming route's body handler, for whatever it keeps
+        /// between calls; NULL until it sets it. Best taken from `arena`, as
+        /// an upload cut short never reaches the route's handler.
+        void *body_state;
 } http_request_t;
 
 typedef struct {
         size_t status_code;
         char *body;
+        /// Bytes of `body` to send, which need not be NUL-terminated
+        size_t body_length;
         char **headers;
+        /// Arena the response was allocated from, if any. A body or headers
+        /// allocated from the same arena are released along with it, ones
+        /// from malloc() are still freed.
+        http_arena_t *arena;
 } http_response_t;
 
+/// Called from a handler, allocates the response and a copy of the body from
+/// the request's arena, and from the heap otherwise
 http_response_t *create_response(size_t, const char *);
 
+/// Allocates from the request's arena. The memory is released all at once
+/// after the response has been written, so it may back the response's body
+/// and headers. Returns NULL when out of memory.
+void *http_request_alloc(const http_request_t *, size_t);
+const char *http_request_get_header(const http_request_t *, const char *);
+/// Returns the value of the named path parameter (`:name`, or `*name` / `*`
+/// for a trailing wildcard) and stores its length, or NULL if there is none
+const char *http_request_get_param(const http_request_t *, const char *, size_t *);
+
 typedef enum http_status_code {
         HTTP_OK = 200,
         HTTP_CREATED = 201,
@@ -46,6 +115,9 @@ typedef enum http_status_code {
         HTTP_UNAUTHORIZED = 401,
         HTTP_FORBIDDEN = 403,
         HTTP_NOT_FOUND = 404,
+        HTTP_METHOD_NOT_ALLOWED = 405,
+        HTTP_PAYLOAD_TOO_LARGE = 413,
+        HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE = 431,
         HTTP_INTERNAL_SERVER_ERROR = 500,
         HTTP_NOT_IMPLEMENTED = 501,
         HTTP_BAD_GATEWAY = 502,
@@ -54,35 +126,175 @@ typedef enum http_status_code {
 
 typedef http_response_t *(*http_handler_t)(const http_request_t *);
 
-typedef struct {
-        char *path;
-        http_handler_t handler;
-} url_route_entry_t;
+/// Receives the body of a request to a streaming route as it arrives, one run
+/// of decoded bytes at a time, so it never has to be held in full. Runs on a
+/// worker, with the request's head and arena ready. Returning non-zero stops
+/// the upload: the route's handler still runs, and the connection is closed
+/// after its response.
+typedef int (*http_body_handler_t)(http_request_t *, const char *, size_t);
 
-typedef struct {
-        url_route_entry_t *routes;
-        size_t count;
-        size_t capacity;
-} url_router_t;
+/// Node of a compressed radix tree over route patterns, shared by all methods.
+/// Static children are keyed by the first byte of their label, which is unique
+/// among siblings. A `:name` segment continues in `param_child`, a trailing
+/// `*name` ends in `wildcard_child`.
+typedef struct _HttpRouteNode {
+        char *label;
+        size_t label_length;
+
+        struct _HttpRouteNode **children;
+        size_t child_count;
+
+        struct _HttpRouteNode *param_child;
+        struct _HttpRouteNode *wildcard_child;
+        /// Name of the parameter captured when entering this node
+        char *param_name;
+        size_t param_name_length;
+
+        /// Handlers of the route ending at this node, indexed by method, with
+        /// a bit set in `methods` for each one which is present
+        http_handler_t handlers[HTTP_METHOD_COUNT];
+        /// Set for the methods whose route streams its request bodies
+        http_body_handler_t body_handlers[HTTP_METHOD_COUNT];
+        unsigned int methods;
+        /// Index of each of those routes in the router's `route_names`
+        size_t route_ids[HTTP_METHOD_COUNT];
+        /// Value of the `Allow` header sent when the route is requested with
+        /// any other method, kept up to date as handlers are added
+        char *allow;
+} http_route_node_t;
 
 typedef struct {
-        url_router_t methods[_HTTP_UNKNOWN];
+        http_route_node_t *root;
         http_handler_t not_found_handler;
         http_handler_t method_not_allowed_handler;
+
+        /// "METHOD /pattern" of every route, indexed by route id, which keys
+        /// the metrics. The first ones stand for requests matching no route.
+        char **route_names;
+        size_t route_count;
 } http_router_t;
 
+typedef enum {
+        /// Readiness through epoll, with plain read() and writev() calls
+        SERVER_IO_BACKEND_EPOLL,
+        /// Accepts, receives, sends and closes submitted through io_uring, in
+        /// batches of one syscall per loop iteration. Falls back to epoll on
+        /// kernels without it (before 5.19).
+        SERVER_IO_BACKEND_IO_URING,
+} server_io_backend_t;
+
+#define SERVER_DEFAULT_KEEP_ALIVE_TIMEOUT_MS 5000
+#define SERVER_DEFAULT_HEADER_TIMEOUT_MS 10000
+#define SERVER_DEFAULT_BODY_TIMEOUT_MS 30000
+#define SERVER_DEFAULT_WRITE_TIMEOUT_MS 30000
+#define SERVER_DEFAULT_MAX_KEEP_ALIVE_REQUESTS 1000
+#define SERVER_DEFAULT_MAX_QUEUED_REQUESTS 4096
+#define SERVER_DEFAULT_MAX_QUEUE_WAIT_MS 1000
+#define SERVER_DEFAULT_RETRY_AFTER_S 1
+#define SERVER_DEFAULT_MAX_BODY_SIZE (1024 * 1024)
+
 typedef struct {
         size_t threads;
+        /// How the worker threads pick up requests, FIFO by default
+        threadpool_policy_t scheduling_policy;
+        /// Event loops accepting and reading connections, each on a thread of
+        /// its own with its own SO_REUSEPORT listener, so the kernel spreads
+        /// connections over them. 0 or 1 runs a single loop on the thread
+        /// calling `server_start()`.
+        size_t io_threads;
+        /// How the event loops do their socket I/O, epoll by default
+        server_io_backend_t io_backend;
+        /// Where worker and event loop threads run. Auto-spread places the
+        /// event loops on the CPUs after the workers'.
+        cpu_affinity_t worker_affinity;
+        cpu_affinity_t io_affinity;
         size_t max_pending_requests;
 
+        /// How long (in milliseconds) an idle persistent connection is kept
+        /// open. 0 selects SERVER_DEFAULT_KEEP_ALIVE_TIMEOUT_MS.
+        unsigned int keep_alive_timeout_ms;
+        /// How long (in milliseconds) a client has to send a whole request
+        /// head, counted from the connection being accepted or its first byte
+        /// arriving, so trickling it in slowly does not buy more time. 0
+        /// selects SERVER_DEFAULT_HEADER_TIMEOUT_MS.
+        unsigned int header_timeout_ms;
+        /// How long (in milliseconds) a client has to send a request body,
+        /// counted from the end of its head. 0 selects
+        /// SERVER_DEFAULT_BODY_TIMEOUT_MS.
+        unsigned int body_timeout_ms;
+        /// How long (in milliseconds) sending a batch of responses may stall
+        /// on a client which is not reading them. 0 selects
+        /// SERVER_DEFAULT_WRITE_TIMEOUT_MS.
+        unsigned int write_timeout_ms;
+        /// Requests served over one connection before it is closed. 0 selects
+        /// SERVER_DEFAULT_MAX_KEEP_ALIVE_REQUESTS, 1 disables keep-alive.
+        size_t max_keep_alive_requests;
+
+        /// Requests waiting for a worker, above which new ones are answered
+        /// with 503 right away. 0 selects SERVER_DEFAULT_MAX_QUEUED_REQUESTS.
+        size_t max_queued_requests;
+        /// How long (in milliseconds) a request may wait for a worker before
+        /// it is answered with 503 instead of being handled. 0 selects
+        /// SERVER_DEFAULT_MAX_QUEUE_WAIT_MS.
+        unsigned int max_queue_wait_ms;
+        /// Seconds sent in `Retry-After` with a 503. 0 selects
+        /// SERVER_DEFAULT_RETRY_AFTER_S.
+        unsigned int retry_after_s;
+
+        /// Largest request body (in bytes) collected for a handler, above
+        /// which the request is answered with 413 and the connection closed.
+        /// Streaming routes are not limited. 0 selects
+        /// SERVER_DEFAULT_MAX_BODY_SIZE.
+        size_t max_body_size;
+
+        /// Path of a built-in GET route serving per-route latency histograms
+        /// and counters in Prometheus text format. NULL disables the route,
+        /// along with recording any of it.
+        const char *metrics_path;
+
         unsigned short port;
         unsigned int address;
 } server_config_t;
 
+/// Counters for tuning the load shedding limits
+typedef struct {
+        /// Requests handed to a worker
+        uint64_t requests_accepted;
+        /// Requests answered with 503 because too many were already queued
+        uint64_t requests_shed_queue_full;
+        /// Requests answered with 503 because they waited too long
+        uint64_t requests_shed_queue_wait;
+        /// Requests currently waiting for a worker
+        uint64_t requests_queued;
+} server_stats_t;
+
 typedef struct {
         threadpool_t *threadpool;
 
+        size_t io_threads;
+        server_io_backend_t io_backend;
+        cpu_affinity_t io_affinity;
         size_t max_pending_requests;
+        unsigned int keep_alive_timeout_ms;
+        unsigned int header_timeout_ms;
+        unsigned int body_timeout_ms;
+        unsigned int write_timeout_ms;
+        size_t max_keep_alive_requests;
+
+        size_t max_queued_requests;
+        unsigned int max_queue_wait_ms;
+        size_t max_body_size;
+        /// Shared by every shed request, built once with its `Retry-After`
+        http_response_t shed_response;
+        char *shed_headers[2];
+
+        _Atomic size_t requests_queued;
+        _Atomic uint64_t requests_accepted;
+        _Atomic uint64_t requests_shed_queue_full;
+        _Atomic uint64_t requests_shed_queue_wait;
+
+        /// NULL unless `metrics_path` was configured
+        http_metrics_t *metrics;
 
         unsigned short port;
         unsigned int address;
@@ -92,7 +304,13 @@ typedef struct {
 
 server_t *server_new(server_config_t);
 int server_add_route(server_t *, http_method_t, const char *, http_handler_t);
+/// Adds a route whose request bodies are handed to the body handler as they
+/// arrive, before the route's handler runs
+int server_add_streaming_route(server_t *, http_method_t, const char *, http_body_handler_t,
+                               http_handler_t);
 void server_start(server_t *);
 void server_free(server_t *);
 
+server_stats_t server_get_stats(server_t *);
+
 #endif
@@ -1,11 +1,65 @@
 #ifndef STARCALLER_LOGGER_H
 #define STARCALLER_LOGGER_H
 
-void log_trace(const char *, ...) __attribute__((format(printf, 1, 2)));
-void log_debug(const char *, ...) __attribute__((format(printf, 1, 2)));
-void log_info(const char *, ...) __attribute__((format(printf, 1, 2)));
-void log_warn(const char *, ...) __attribute__((format(printf, 1, 2)));
-void log_error(const char *, ...) __attribute__((format(printf, 1, 2)));
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+        LOG_LEVEL_TRACE,
+        LOG_LEVEL_DEBUG,
+        LOG_LEVEL_INFO,
+        LOG_LEVEL_WARN,
+        LOG_LEVEL_ERROR,
+        LOG_LEVEL_FATAL,
+} log_level_t;
+
+/// Calls below this level are compiled out entirely, arguments included. May
+/// be overridden with e.g. -DLOG_COMPILE_LEVEL=LOG_LEVEL_WARN.
+#ifndef LOG_COMPILE_LEVEL
+#ifdef NDEBUG
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#else
+#define LOG_COMPILE_LEVEL LOG_LEVEL_TRACE
+#endif
+#endif
+
+/// Calls below this level are skipped at runtime, before their arguments are
+/// evaluated or anything is formatted. Use `log_set_level()` to change it.
+extern _Atomic int log_runtime_level;
+
+static inline bool log_is_enabled(log_level_t level)
+{
+        return (int)level >= atomic_load_explicit(&log_runtime_level, memory_order_relaxed);
+}
+
+void log_set_level(log_level_t);
+log_level_t log_get_level(void);
+
+#define LOG_AT(level, ...)                                                          \
+        do {                                                                        \
+                if ((level) >= LOG_COMPILE_LEVEL && log_is_enabled(level))          \
+                        log_message((level), __VA_ARGS__);                          \
+        } while (0)
+
+#define log_trace(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+#define log_debug(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+/// Lines are formatted on the calling thread and queued to a background writer
+/// thread, so logging never blocks on stderr. A thread which logs faster than
+/// the writer can keep up with loses lines instead of stalling, and the writer
+/// reports how many. Prefer the level macros above, which filter first.
+void log_message(log_level_t, const char *, ...) __attribute__((format(printf, 2, 3)));
+/// Always logged, regardless of either level, then exits
 void log_fatal(int, const char *, ...) __attribute__((format(printf, 2, 3)));
 
+/// Waits, for at most about a second, until every line logged so far has been
+/// written. Called on exit and by `log_fatal()`.
+void log_flush(void);
+/// Lines dropped so far because their thread's buffer was full
+uint64_t log_dropped(void);
+
 #endif
@@ -3,24 +3,93 @@
 
 #include <pthread.h>
 
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
-typedef struct _ThreadpoolTask {
-        void (*function)(void *);
+#include "affinity.h"
+
+#define THREADPOOL_CACHE_LINE_SIZE 64
+
+/// Must be a power of two
+#define THREADPOOL_QUEUE_CAPACITY 16384
+/// Must be a power of two
+#define THREADPOOL_DEQUE_CAPACITY 1024
+
+typedef enum {
+        /// Every task goes through the shared queue, in submission order
+        THREADPOOL_POLICY_FIFO,
+        /// Workers prefer the tasks they submitted themselves, taking from the
+        /// shared queue or stealing from others only when out of their own
+        THREADPOOL_POLICY_WORK_STEALING,
+} threadpool_policy_t;
+
+typedef void (*threadpool_function_t)(void *);
+
+typedef struct {
+        threadpool_function_t function;
         void *arg;
-        struct _ThreadpoolTask *next;
 } threadpool_task_t;
 
+/// A cell is free for the producer at position `p` when its sequence equals
+/// `p`, and holds a task for the consumer at position `p` when it equals `p + 1`
+typedef struct {
+        _Atomic size_t sequence;
+        threadpool_task_t task;
+} threadpool_cell_t;
+
+/// Bounded multi-producer multi-consumer ring, after Dmitry Vyukov's design.
+/// Producers and consumers each claim a position with a single CAS and never
+/// wait on one another. The two positions live on separate cache lines, so
+/// enqueueing and dequeueing threads do not invalidate each other's.
 typedef struct {
-        threadpool_task_t *head;
-        threadpool_task_t *tail;
+        _Alignas(THREADPOOL_CACHE_LINE_SIZE) _Atomic size_t enqueue_position;
+        _Alignas(THREADPOOL_CACHE_LINE_SIZE) _Atomic size_t dequeue_position;
+        _Alignas(THREADPOOL_CACHE_LINE_SIZE) threadpool_cell_t *cells;
+        size_t mask;
 } threadpool_queue_t;
 
 typedef struct {
+        _Atomic(threadpool_function_t) function;
+        _Atomic(void *) arg;
+} threadpool_deque_cell_t;
+
+/// Bounded Chase-Lev deque, in the C11 formulation by Lê et al. Only the
+/// owning worker pushes and pops, at the bottom; any other worker may steal
+/// from the top.
+typedef struct {
+        _Alignas(THREADPOOL_CACHE_LINE_SIZE) _Atomic int64_t top;
+        _Alignas(THREADPOOL_CACHE_LINE_SIZE) _Atomic int64_t bottom;
+        _Alignas(THREADPOOL_CACHE_LINE_SIZE) threadpool_deque_cell_t *cells;
+        int64_t mask;
+} threadpool_deque_t;
+
+struct _ThreadpoolScheduler;
+
+typedef struct {
+        threadpool_deque_t deque;
+        struct _ThreadpoolScheduler *scheduler;
+        size_t index;
+        /// State of the generator picking victims to steal from
+        uint32_t random_state;
+} threadpool_worker_t;
+
+typedef struct _ThreadpoolScheduler {
+        threadpool_policy_t policy;
+        cpu_affinity_t affinity;
+        /// Tasks submitted from outside the pool, and all tasks under FIFO
         threadpool_queue_t task_queue;
-        pthread_mutex_t mutex;
-        pthread_cond_t notify;
-        bool is_terminated;
+
+        threadpool_worker_t *workers;
+        size_t worker_count;
+
+        /// Futex word idle workers sleep on, bumped whenever they need waking
+        _Alignas(THREADPOOL_CACHE_LINE_SIZE) _Atomic uint32_t wake_epoch;
+        /// Workers which are about to sleep or sleeping, so producers only
+        /// issue the wake syscall when somebody actually waits for it
+        _Atomic uint32_t sleeper_count;
+        _Atomic bool is_terminated;
 } threadpool_scheduler_t;
 
 typedef struct {
@@ -30,9 +99,19 @@ typedef struct {
         threadpool_scheduler_t *scheduler;
 } threadpool_t;
 
-threadpool_t *threadpool_create(size_t);
+/// Workers are pinned according to the affinity, or left alone when it is NULL
+threadpool_t *threadpool_create(size_t, threadpool_policy_t, const cpu_affinity_t *);
 void threadpool_free(threadpool_t *);
 
-void threadpool_execute(threadpool_t *, void (*)(void *), void *);
+/// Returns the following status:
+///  0 - the task was queued
+/// -1 - invalid arguments
+/// -2 - the queue is full, the task was not queued
+int threadpool_execute(threadpool_t *, threadpool_function_t, void *);
+
+/// Same as `threadpool_execute()`, but when called from one of the pool's own
+/// workers under THREADPOOL_POLICY_WORK_STEALING, the task goes onto that
+/// worker's deque, so it most likely runs on the same thread, on warm caches
+int threadpool_execute_local(threadpool_t *, threadpool_function_t, void *);
 
 #endif
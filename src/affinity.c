@@ -0,0 +1,84 @@
+#include "affinity.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+
+#include "logger.h"
+
+/// Returns the `index`-th CPU set in the mask, wrapping around, or -1 if the
+/// mask is empty
+static int nth_allowed_cpu(const cpu_set_t *, size_t);
+
+int cpu_affinity_apply(const cpu_affinity_t *affinity, size_t index, size_t offset)
+{
+        if (!affinity) {
+                log_trace("Invalid arguments to cpu_affinity_apply");
+                return -1;
+        }
+
+        int cpu = -1;
+
+        switch (affinity->mode) {
+        case CPU_AFFINITY_NONE:
+                return 0;
+
+        case CPU_AFFINITY_SPREAD: {
+                // threads inherit the mask of their creator, which still holds
+                // everything the process was allowed as long as groups are
+                // started before their creator pins itself
+                cpu_set_t allowed;
+                if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+                        log_error("Failed to get CPU affinity: %s", strerror(errno));
+                        return -3;
+                }
+                cpu = nth_allowed_cpu(&allowed, offset + index);
+                break;
+        }
+
+        case CPU_AFFINITY_LIST:
+                if (!affinity->cpus || 0 == affinity->cpu_count) {
+                        log_trace("CPU affinity list is empty");
+                        return -1;
+                }
+                cpu = affinity->cpus[index % affinity->cpu_count];
+                break;
+
+        default:
+                log_trace("Invalid CPU affinity mode: %u", affinity->mode);
+                return -1;
+        }
+
+        if (cpu < 0 || cpu >= CPU_SETSIZE) {
+                log_error("No CPU available for thread %lu", index);
+                return -2;
+        }
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET((size_t)cpu, &set);
+
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+                log_error("Failed to pin thread %lu to CPU %d: %s", index, cpu, strerror(errno));
+                return -3;
+        }
+
+        return 0;
+}
+
+static int nth_allowed_cpu(const cpu_set_t *allowed, size_t index)
+{
+        int count = CPU_COUNT(allowed);
+        if (count <= 0)
+                return -1;
+
+        size_t wanted = index % (size_t)count;
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (!CPU_ISSET((size_t)cpu, allowed))
+                        continue;
+                if (0 == wanted--)
+                        return cpu;
+        }
+
+        return -1;
+}
@@ -0,0 +1,139 @@
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "logger.h"
+
+static _Thread_local http_arena_t *arena_pool = NULL;
+static _Thread_local size_t arena_pool_size = 0;
+static _Thread_local http_arena_t *current_arena = NULL;
+
+static http_arena_block_t *http_arena_block_new(size_t);
+
+/// Frees every block but the oldest, and empties that one
+static void http_arena_reset(http_arena_t *);
+
+http_arena_t *http_arena_acquire(void)
+{
+        http_arena_t *arena = arena_pool;
+        if (arena) {
+                arena_pool = arena->next_free;
+                arena_pool_size--;
+                arena->next_free = NULL;
+                return arena;
+        }
+
+        arena = malloc(sizeof(http_arena_t));
+        if (!arena) {
+                log_trace("Failed allocating request arena");
+                return NULL;
+        }
+
+        arena->blocks = http_arena_block_new(HTTP_ARENA_BLOCK_SIZE);
+        if (!arena->blocks) {
+                free(arena);
+                return NULL;
+        }
+        arena->next_free = NULL;
+
+        return arena;
+}
+
+void http_arena_release(http_arena_t *arena)
+{
+        if (!arena)
+                return;
+
+        if (arena_pool_size >= HTTP_ARENA_POOL_SIZE) {
+                while (arena->blocks) {
+                        http_arena_block_t *next = arena->blocks->next;
+                        free(arena->blocks);
+                        arena->blocks = next;
+                }
+                free(arena);
+                return;
+        }
+
+        http_arena_reset(arena);
+        arena->next_free = arena_pool;
+        arena_pool = arena;
+        arena_pool_size++;
+}
+
+void *http_arena_alloc(http_arena_t *arena, size_t size)
+{
+        if (!arena)
+                return NULL;
+
+        const size_t ALIGNMENT = _Alignof(max_align_t);
+        if (size > SIZE_MAX - ALIGNMENT)
+                return NULL;
+        size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+        http_arena_block_t *block = arena->blocks;
+        if (block->capacity - block->used < size) {
+                // oversized allocations get a block of their own
+                size_t capacity = size > HTTP_ARENA_BLOCK_SIZE ? size : HTTP_ARENA_BLOCK_SIZE;
+                block = http_arena_block_new(capacity);
+                if (!block)
+                        return NULL;
+
+                block->next = arena->blocks;
+                arena->blocks = block;
+        }
+
+        void *memory = block->data + block->used;
+        block->used += size;
+        return memory;
+}
+
+bool http_arena_owns(const http_arena_t *arena, const void *pointer)
+{
+        if (!arena || !pointer)
+                return false;
+
+        uintptr_t address = (uintptr_t)pointer;
+        for (const http_arena_block_t *block = arena->blocks; block; block = block->next) {
+                uintptr_t start = (uintptr_t)block->data;
+                if (address >= start && address < start + block->used)
+                        return true;
+        }
+
+        return false;
+}
+
+void http_arena_set_current(http_arena_t *arena)
+{
+        current_arena = arena;
+}
+
+http_arena_t *http_arena_current(void)
+{
+        return current_arena;
+}
+
+static http_arena_block_t *http_arena_block_new(size_t capacity)
+{
+        http_arena_block_t *block = malloc(sizeof(http_arena_block_t) + capacity);
+        if (!block) {
+                log_trace("Failed allocating request arena block");
+                return NULL;
+        }
+
+        block->next = NULL;
+        block->capacity = capacity;
+        block->used = 0;
+        return block;
+}
+
+static void http_arena_reset(http_arena_t *arena)
+{
+        while (arena->blocks->next) {
+                http_arena_block_t *next = arena->blocks->next;
+                free(arena->blocks);
+                arena->blocks = next;
+        }
+
+        arena->blocks->used = 0;
+}
@@ -0,0 +1,47 @@
+#ifndef STARCALLER_HTTP_ARENA_H
+#define STARCALLER_HTTP_ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "http.h"
+
+/// Size of the block every arena starts with, enough for a typical response
+#define HTTP_ARENA_BLOCK_SIZE 16384
+/// Idle arenas each thread keeps around for reuse
+#define HTTP_ARENA_POOL_SIZE 64
+
+typedef struct _HttpArenaBlock {
+        struct _HttpArenaBlock *next;
+        size_t capacity;
+        size_t used;
+        _Alignas(max_align_t) unsigned char data[];
+} http_arena_block_t;
+
+/// Bump allocator backing everything allocated while handling one request.
+/// Blocks are chained newest first; the oldest one is kept across resets.
+struct _HttpArena {
+        http_arena_block_t *blocks;
+        /// Link in the owning thread's pool while the arena is idle
+        struct _HttpArena *next_free;
+};
+
+/// Takes an arena from the calling thread's pool, or creates one
+http_arena_t *http_arena_acquire(void);
+
+/// Resets the arena and gives it to the calling thread's pool, which need not
+/// be the one it was acquired from
+void http_arena_release(http_arena_t *);
+
+/// Returns memory aligned for any type, or NULL
+void *http_arena_alloc(http_arena_t *, size_t);
+
+/// Whether the pointer lies in memory handed out by the arena
+bool http_arena_owns(const http_arena_t *, const void *);
+
+/// The arena of the request being handled on this thread, which
+/// `create_response()` allocates from
+void http_arena_set_current(http_arena_t *);
+http_arena_t *http_arena_current(void);
+
+#endif
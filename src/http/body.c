@@ -0,0 +1,185 @@
+#include "parser.h"
+
+#include <stdint.h>
+
+#include "logger.h"
+
+/// Value of a hex digit, or -1 if the byte is not one
+static int hex_value(char);
+
+/// Hands up to `remaining` of the bytes to the sink, returning how many it
+/// took, or -2 if the sink stopped decoding
+static ssize_t decode_data(http_body_decoder_t *, const char *, size_t, http_body_sink_t, void *);
+
+void http_body_decoder_init(http_body_decoder_t *decoder, const http_parser_t *parser)
+{
+        decoder->is_chunked = parser->is_chunked;
+        decoder->state = parser->is_chunked ? HTTP_CHUNK_SIZE : HTTP_CHUNK_DATA;
+        decoder->remaining = parser->is_chunked ? 0 : parser->content_length;
+        decoder->size_digits = 0;
+        decoder->length = 0;
+
+        if (!decoder->is_chunked && 0 == decoder->remaining)
+                decoder->state = HTTP_CHUNK_DONE;
+}
+
+bool http_body_decoder_is_done(const http_body_decoder_t *decoder)
+{
+        return decoder->state == HTTP_CHUNK_DONE;
+}
+
+// The chunk framing is taken a byte at a time, which is cheap next to the
+// data in between, handed to the sink a run at a time. Trailer fields are
+// skipped, so nothing but the size of the current chunk is ever kept.
+ssize_t http_body_decode(http_body_decoder_t *decoder, const char *data, size_t length,
+                         http_body_sink_t sink, void *context)
+{
+        size_t position = 0;
+
+        while (position < length && decoder->state != HTTP_CHUNK_DONE) {
+                char current = data[position];
+
+                switch (decoder->state) {
+                case HTTP_CHUNK_SIZE: {
+                        int digit = hex_value(current);
+                        if (digit >= 0) {
+                                if (decoder->remaining > (SIZE_MAX >> 4)) {
+                                        log_trace("Invalid chunked body: chunk size out of range");
+                                        return -1;
+                                }
+                                decoder->remaining = (decoder->remaining << 4) | (size_t)digit;
+                                decoder->size_digits++;
+                                position++;
+                                break;
+                        }
+
+                        if (0 == decoder->size_digits ||
+                            (current != '\r' && current != ';' && current != ' ' &&
+                             current != '\t')) {
+                                log_trace("Invalid chunked body: malformed chunk size");
+                                return -1;
+                        }
+
+                        decoder->state = current == '\r' ? HTTP_CHUNK_SIZE_LF
+                                                         : HTTP_CHUNK_EXTENSION;
+                        position++;
+                        break;
+                }
+
+                case HTTP_CHUNK_EXTENSION:
+                        if (current == '\r')
+                                decoder->state = HTTP_CHUNK_SIZE_LF;
+                        else if (current == '\n')
+                                goto bare_lf;
+                        position++;
+                        break;
+
+                case HTTP_CHUNK_SIZE_LF:
+                        if (current != '\n')
+                                goto bare_cr;
+
+                        decoder->state = decoder->remaining > 0 ? HTTP_CHUNK_DATA
+                                                                : HTTP_CHUNK_TRAILER_START;
+                        position++;
+                        break;
+
+                case HTTP_CHUNK_DATA: {
+                        ssize_t taken =
+                                decode_data(decoder, data + position, length - position, sink,
+                                            context);
+                        if (taken < 0)
+                                return taken;
+
+                        position += (size_t)taken;
+                        if (decoder->remaining > 0)
+                                break;
+
+                        decoder->state = decoder->is_chunked ? HTTP_CHUNK_DATA_CR
+                                                             : HTTP_CHUNK_DONE;
+                        break;
+                }
+
+                case HTTP_CHUNK_DATA_CR:
+                        if (current != '\r') {
+                                log_trace("Invalid chunked body: chunk longer than its size");
+                                return -1;
+                        }
+                        decoder->state = HTTP_CHUNK_DATA_LF;
+                        position++;
+                        break;
+
+                case HTTP_CHUNK_DATA_LF:
+                        if (current != '\n')
+                                goto bare_cr;
+
+                        decoder->state = HTTP_CHUNK_SIZE;
+                        decoder->size_digits = 0;
+                        position++;
+                        break;
+
+                case HTTP_CHUNK_TRAILER_START:
+                        if (current == '\n')
+                                goto bare_lf;
+
+                        decoder->state = current == '\r' ? HTTP_CHUNK_END_LF : HTTP_CHUNK_TRAILER;
+                        position++;
+                        break;
+
+                case HTTP_CHUNK_TRAILER:
+                        if (current == '\r')
+                                decoder->state = HTTP_CHUNK_TRAILER_LF;
+                        else if (current == '\n')
+                                goto bare_lf;
+                        position++;
+                        break;
+
+                case HTTP_CHUNK_TRAILER_LF:
+                case HTTP_CHUNK_END_LF:
+                        if (current != '\n')
+                                goto bare_cr;
+
+                        decoder->state = decoder->state == HTTP_CHUNK_END_LF
+                                                 ? HTTP_CHUNK_DONE
+                                                 : HTTP_CHUNK_TRAILER_START;
+                        position++;
+                        break;
+
+                case HTTP_CHUNK_DONE:
+                default:
+                        return -1;
+                }
+        }
+
+        return (ssize_t)position;
+
+bare_cr:
+        log_trace("Invalid chunked body: bare CR");
+        return -1;
+
+bare_lf:
+        log_trace("Invalid chunked body: bare LF");
+        return -1;
+}
+
+static ssize_t decode_data(http_body_decoder_t *decoder, const char *data, size_t length,
+                           http_body_sink_t sink, void *context)
+{
+        size_t taken = length < decoder->remaining ? length : decoder->remaining;
+        if (sink(context, data, taken) < 0)
+                return -2;
+
+        decoder->remaining -= taken;
+        decoder->length += taken;
+        return (ssize_t)taken;
+}
+
+static int hex_value(char digit)
+{
+        if (digit >= '0' && digit <= '9')
+                return digit - '0';
+        if (digit >= 'a' && digit <= 'f')
+                return digit - 'a' + 10;
+        if (digit >= 'A' && digit <= 'F')
+                return digit - 'A' + 10;
+        return -1;
+}
@@ -0,0 +1,242 @@
+#ifndef STARCALLER_HTTP_CONNECTION_H
+#define STARCALLER_HTTP_CONNECTION_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "http.h"
+#include "parser.h"
+#include "timer_wheel.h"
+#include "uring.h"
+#include "utils.h"
+
+#define CONNECTION_BUFFER_SIZE 16384
+#define CONNECTION_PIPELINE_DEPTH 16
+
+struct _EventLoop;
+struct _HttpConnection;
+
+/// What the loop is waiting on a connection for, each with its own limit
+typedef enum {
+        CONNECTION_PHASE_NONE,
+        /// Kept alive with nothing buffered (`keep_alive_timeout_ms`)
+        CONNECTION_PHASE_IDLE,
+        /// Receiving a request head (`header_timeout_ms`)
+        CONNECTION_PHASE_HEADERS,
+        /// Receiving a request body (`body_timeout_ms`)
+        CONNECTION_PHASE_BODY,
+        /// Sending responses (`write_timeout_ms`)
+        CONNECTION_PHASE_WRITE,
+} connection_phase_t;
+
+/// Everything a worker needs to handle one pipelined request. The slot itself
+/// is the task's argument, so dispatching a request allocates nothing.
+typedef struct {
+        struct _HttpConnection *connection;
+        http_handler_t handler;
+        /// Set on streaming routes, which get the body a piece at a time
+        http_body_handler_t body_handler;
+        /// Id of the matched route, which the request's metrics are kept under
+        size_t route;
+        http_request_t request;
+        /// Backs the request's allocations until its response is written
+        http_arena_t *arena;
+        /// A body too large to stay in the connection's buffer, collected on
+        /// the heap (`body_capacity` bytes) until the response is written
+        char *body;
+        size_t body_capacity;
+
+        /// When (in nanoseconds) the request was handed to the thread pool,
+        /// for shedding the ones which waited too long
+        uint64_t queued_at;
+
+        http_response_t *response;
+        http_response_meta_t meta;
+        bool is_ready;
+        /// The response is the server's shared 503, which is never freed
+        bool is_shed;
+} http_pipeline_slot_t;
+
+/// A batch of responses a worker has prepared for the event loop to send,
+/// when the loop does the sending itself (SERVER_IO_BACKEND_IO_URING), or the
+/// rest of one the socket did not take at once (SERVER_IO_BACKEND_EPOLL). It
+/// stays put until the send completes, as the kernel reads from it meanwhile.
+typedef struct {
+        char heads[RESPONSE_HEAD_BUFFER_SIZE];
+        struct iovec iov[RESPONSE_MAX_IOVECS];
+        struct msghdr message;
+        /// Responses in the batch, counted from the first unwritten slot
+        size_t count;
+        /// The connection is closed right behind the batch
+        bool closes;
+        bool failed;
+} http_send_t;
+
+typedef struct _HttpConnection {
+        int fd;
+        struct _EventLoop *loop;
+
+        size_t length;
+        /// State of the request at the front of the buffer (or, while a batch
+        /// is being dispatched, of the one currently being parsed)
+        http_parser_t parser;
+        /// Bytes taken up by the requests currently being handled, which are
+        /// dropped from the front of the buffer once all of them are answered
+        size_t consumed;
+        size_t requests_served;
+        bool keep_alive;
+
+        /// The body of the request in the first slot is being decoded out of
+        /// the buffer as it arrives, behind the head of the request
+        http_body_decoder_t body;
+        bool is_receiving_body;
+
+        /// Pipelined requests are handled in parallel, but answered in order.
+        /// Responses are parked in their slot until every earlier one has been
+        /// written; whichever worker completes the next slot in line becomes
+        /// the writer (`is_writing`) and flushes as many as are ready.
+        pthread_mutex_t pipeline_lock;
+        http_pipeline_slot_t pipeline[CONNECTION_PIPELINE_DEPTH];
+        size_t pipeline_length;
+        size_t pipeline_written;
+        bool is_writing;
+        bool write_failed;
+
+        /// Link in the loop's stack of connections handed back by workers
+        struct _HttpConnection *next_returned;
+
+        /// Set up front on loops which send responses themselves, and on epoll
+        /// loops once a batch first finds the socket full
+        http_send_t *send;
+        /// Handed back with `send` holding a batch, rather than for more data
+        bool is_sending;
+        /// Operations the loop has in flight on the connection, which has to
+        /// outlive all of them (SERVER_IO_BACKEND_IO_URING only)
+        unsigned int pending_operations;
+        bool is_closing;
+
+        /// The deadline is set when a phase begins and is not pushed back by
+        /// data trickling in, so a slow client cannot hold on to a connection
+        /// by sending a byte at a time
+        connection_phase_t phase;
+        uint64_t deadline;
+        /// Pending in the loop's timer wheel while the loop waits on the
+        /// connection
+        timer_wheel_timer_t timer;
+
+        char buffer[CONNECTION_BUFFER_SIZE];
+} http_connection_t;
+
+typedef struct _EventLoop {
+        /// The backend the loop ended up with, which is epoll whenever the
+        /// configured one is not available
+        server_io_backend_t backend;
+        int epoll_fd;
+        uring_t uring;
+        /// Where the io_uring backend reads the wake-up eventfd into
+        uint64_t wake_count;
+
+        int listen_fd;
+        int wake_fd;
+
+        /// Connections which workers have finished with. Workers push, the loop
+        /// drains the whole stack at once, so a plain Treiber stack is enough.
+        _Atomic(http_connection_t *) returned;
+
+        /// Deadlines of the connections the loop is waiting on, in milliseconds
+        timer_wheel_t timers;
+
+        server_t *server;
+        /// Index of this loop among the server's shards
+        size_t shard;
+} event_loop_t;
+
+int event_loop_init(event_loop_t *, server_t *, int);
+void event_loop_run(event_loop_t *);
+void event_loop_free(event_loop_t *);
+
+/// Hands a connection back to its loop, to be re-armed once everything
+/// buffered on it has been answered, or to send the batch in its `send`. Safe
+/// to call from any thread.
+void event_loop_return(http_connection_t *);
+
+/// Prepares as many of the responses as fit into the connection's `send` and
+/// hands it to the loop, which calls `server_pipeline_sent()` on a worker once
+/// they are out. `closes` is whether the connection is closed after the last
+/// of them. Returns the number of responses taken or a negative value on
+/// failure, in which case nothing is sent.
+ssize_t event_loop_send(http_connection_t *, const http_response_t *const *,
+                        const http_response_meta_t *, size_t, bool);
+
+/// Writes the responses straight from the calling worker, as far as the socket
+/// takes them without blocking (SERVER_IO_BACKEND_EPOLL). Whatever does not
+/// go out is parked in the connection's `send` and handed to the loop, which
+/// finishes it once the socket is writable, within `write_timeout_ms`, and
+/// then calls `server_pipeline_sent()` on a worker.
+/// Returns the following status:
+///  >0 - the number of responses written in full
+///   0 - the rest of the batch has been handed to the loop
+///  <0 - nothing more can be written, as for `http_responses_prepare()` or
+///       -3 on a socket error
+ssize_t event_loop_write(http_connection_t *, const http_response_t *const *,
+                         const http_response_meta_t *, size_t);
+
+/// Allocates a connection for a freshly accepted descriptor
+http_connection_t *connection_new(event_loop_t *, int);
+
+/// Parses what is buffered on a connection the calling thread owns, past the
+/// requests already answered. Complete requests are dispatched, otherwise the
+/// connection goes back to its loop to wait for more data (or is closed).
+void connection_process(http_connection_t *);
+
+void connection_close(http_connection_t *);
+
+/// Starts the given phase on a connection, along with its deadline, unless
+/// the connection is in it already
+void connection_set_phase(http_connection_t *, connection_phase_t);
+const char *connection_phase_name(connection_phase_t);
+
+/// Schedules the connection's deadline in its loop's timer wheel, or takes it
+/// out again. Loop thread only.
+void event_loop_timer_arm(event_loop_t *, http_connection_t *);
+void event_loop_timer_disarm(event_loop_t *, http_connection_t *);
+/// Milliseconds until the timer wheel next needs turning, or -1 if nothing is
+/// scheduled
+int event_loop_next_timeout(const event_loop_t *);
+/// Unlinks a connection whose deadline has passed, or returns NULL
+http_connection_t *event_loop_pop_expired(event_loop_t *);
+
+/// Milliseconds on the monotonic clock
+uint64_t event_loop_now_ms(void);
+/// Nanoseconds on the monotonic clock
+uint64_t event_loop_now_ns(void);
+
+/// Called by `connection_process()` once the connection's parser has completed
+/// the request at the front of its buffer. Every complete request in the buffer (up to
+/// CONNECTION_PIPELINE_DEPTH) is dispatched, and ownership of the connection
+/// passes to the callee until all of them have been answered.
+void server_dispatch_requests(server_t *, http_connection_t *);
+
+/// Called by `connection_process()` when the body of the request at the front
+/// of the buffer is too large for the buffer, or is chunked, to take in what
+/// has arrived of it. Returns the following status:
+///  0 - more of the body is needed, the connection stays with the caller
+///  1 - the request has been dispatched, or the connection closed
+int server_receive_body(server_t *, http_connection_t *);
+
+/// Called on a worker once the batch handed to `event_loop_send()` has been
+/// sent, or has failed to, to carry on writing the connection's responses
+void server_pipeline_sent(http_connection_t *);
+
+/// The io_uring backend, see event_loop_uring.c. Init returns -1 when the
+/// kernel lacks io_uring or one of the features used.
+int uring_loop_init(event_loop_t *);
+void uring_loop_run(event_loop_t *);
+void uring_loop_free(event_loop_t *);
+
+#endif
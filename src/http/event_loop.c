@@ -0,0 +1,684 @@
+#include "connection.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "arena.h"
+#include "logger.h"
+#include "metrics.h"
+#include "threadpool.h"
+#include "utils.h"
+
+#define MAX_EVENTS 256
+
+static const char CONTINUE_RESPONSE[] = "HTTP/1.1 100 Continue\r\n\r\n";
+/// Sent as is to a client whose head does not fit into the buffer, right
+/// before the connection is closed
+static const char HEADERS_TOO_LARGE_RESPONSE[] = "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+                                                 "Content-Length: 31\r\n"
+                                                 "Content-Type: text/html; charset=utf-8\r\n"
+                                                 "Connection: close\r\n"
+                                                 "\r\n"
+                                                 "Request Header Fields Too Large";
+
+static const uint32_t CLIENT_EVENTS = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+/// Armed instead of CLIENT_EVENTS while a batch waits for room in the socket
+static const uint32_t CLIENT_WRITE_EVENTS = EPOLLOUT | EPOLLET | EPOLLONESHOT;
+
+static void accept_connections(event_loop_t *);
+static void handle_ready(event_loop_t *, http_connection_t *);
+static void handle_returned(event_loop_t *);
+
+/// Runs on a worker, reading whatever the socket holds and parsing it, so
+/// the loop's thread does nothing but accept and watch for readiness
+static void worker_read_connection(void *);
+/// Runs on a worker once the socket has room for more of a parked batch
+static void worker_write_connection(void *);
+static void worker_pipeline_sent(void *);
+
+/// Copies what is left of a batch into the connection's `send`, allocating
+/// it on first use, and hands the connection to the loop to finish it.
+/// Returns -1 if it could not be allocated.
+static int park_send(http_connection_t *, const char *, const struct iovec *, size_t, size_t);
+
+/// Returns the following status:
+///  0 - the socket is drained (or the buffer is full)
+/// -1 - the peer closed the connection or a socket error occurred
+static int read_available(http_connection_t *);
+
+static int rearm_connection(http_connection_t *, uint32_t);
+
+static void expire_connections(event_loop_t *);
+
+static http_connection_t *connection_from_timer(timer_wheel_timer_t *);
+
+/// Limit (in milliseconds) the server sets on the given phase
+static uint64_t phase_timeout(const server_t *, connection_phase_t);
+
+int event_loop_init(event_loop_t *loop, server_t *server, int listen_fd)
+{
+        if (!loop || !server || listen_fd < 0) {
+                log_trace("Invalid arguments to event_loop_init");
+                return -1;
+        }
+
+        loop->server = server;
+        loop->listen_fd = listen_fd;
+        timer_wheel_init(&loop->timers, event_loop_now_ms());
+        atomic_init(&loop->returned, NULL);
+        loop->backend = SERVER_IO_BACKEND_EPOLL;
+        loop->epoll_fd = -1;
+
+        if (server->io_backend == SERVER_IO_BACKEND_IO_URING) {
+                if (uring_loop_init(loop) == 0) {
+                        loop->backend = SERVER_IO_BACKEND_IO_URING;
+                        return 0;
+                }
+                log_warn("io_uring is not available, falling back to epoll");
+        }
+
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epoll_fd < 0) {
+                log_error("Failed to create epoll instance: %s", strerror(errno));
+                return -2;
+        }
+
+        loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop->wake_fd < 0) {
+                log_error("Failed to create wake-up eventfd: %s", strerror(errno));
+                goto error_epoll;
+        }
+
+        // the listener and the wake-up descriptor are tagged with pointers into
+        // the loop itself, so they can be told apart from client connections
+        // without a lookup
+        struct epoll_event event = { .events = EPOLLIN | EPOLLET, .data.ptr = &loop->listen_fd };
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) < 0) {
+                log_error("Failed to register listening socket: %s", strerror(errno));
+                goto error_wake_fd;
+        }
+
+        event.data.ptr = &loop->wake_fd;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &event) < 0) {
+                log_error("Failed to register wake-up eventfd: %s", strerror(errno));
+                goto error_wake_fd;
+        }
+
+        return 0;
+
+error_wake_fd:
+        close(loop->wake_fd);
+
+error_epoll:
+        close(loop->epoll_fd);
+        return -3;
+}
+
+void event_loop_run(event_loop_t *loop)
+{
+        if (loop->backend == SERVER_IO_BACKEND_IO_URING) {
+                uring_loop_run(loop);
+                return;
+        }
+
+        struct epoll_event events[MAX_EVENTS];
+
+        while (1) {
+                int ready = epoll_wait(loop->epoll_fd, events, MAX_EVENTS,
+                                       event_loop_next_timeout(loop));
+                if (ready < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        log_error("epoll_wait failed: %s", strerror(errno));
+                        return;
+                }
+
+                for (int i = 0; i < ready; ++i) {
+                        void *tag = events[i].data.ptr;
+
+                        if (tag == &loop->listen_fd)
+                                accept_connections(loop);
+                        else if (tag == &loop->wake_fd)
+                                handle_returned(loop);
+                        else
+                                handle_ready(loop, tag);
+                }
+
+                expire_connections(loop);
+        }
+}
+
+void event_loop_free(event_loop_t *loop)
+{
+        if (!loop) {
+                log_trace("Trying to free a NULL event loop");
+                return;
+        }
+
+        // every connection the loop waits on has a deadline, so draining the
+        // wheel finds all of them
+        timer_wheel_timer_t *timer;
+        while ((timer = timer_wheel_pop_expired(&loop->timers, UINT64_MAX)))
+                connection_close(connection_from_timer(timer));
+
+        if (loop->backend == SERVER_IO_BACKEND_IO_URING)
+                uring_loop_free(loop);
+        else
+                close(loop->epoll_fd);
+
+        close(loop->wake_fd);
+        loop->wake_fd = -1;
+        loop->epoll_fd = -1;
+}
+
+void event_loop_return(http_connection_t *connection)
+{
+        event_loop_t *loop = connection->loop;
+
+        http_connection_t *head = atomic_load_explicit(&loop->returned, memory_order_relaxed);
+        do {
+                connection->next_returned = head;
+        } while (!atomic_compare_exchange_weak_explicit(&loop->returned, &head, connection,
+                                                        memory_order_release,
+                                                        memory_order_relaxed));
+
+        // only the push onto an empty stack needs to wake the loop, any later
+        // push is picked up by the same drain
+        if (head != NULL)
+                return;
+
+        uint64_t one = 1;
+        if (write(loop->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+                log_error("Failed to wake event loop: %s", strerror(errno));
+}
+
+void connection_close(http_connection_t *connection)
+{
+        if (!connection) {
+                log_trace("Trying to close a NULL connection");
+                return;
+        }
+
+        // closing the descriptor also removes it from the epoll interest list;
+        // a close linked behind the last send may have done it already
+        if (connection->fd >= 0)
+                close(connection->fd);
+
+        // a body cut short holds on to what its request had been given
+        if (connection->is_receiving_body) {
+                free(connection->pipeline[0].body);
+                http_arena_release(connection->pipeline[0].arena);
+        }
+
+        pthread_mutex_destroy(&connection->pipeline_lock);
+        free(connection->send);
+        free(connection);
+}
+
+http_connection_t *connection_new(event_loop_t *loop, int fd)
+{
+        http_connection_t *connection = malloc(sizeof(http_connection_t));
+        if (!connection) {
+                log_error("Failed allocating client connection");
+                return NULL;
+        }
+
+        connection->send = NULL;
+        if (loop->backend == SERVER_IO_BACKEND_IO_URING) {
+                connection->send = malloc(sizeof(http_send_t));
+                if (!connection->send) {
+                        log_error("Failed allocating client connection");
+                        free(connection);
+                        return NULL;
+                }
+        }
+
+        connection->fd = fd;
+        connection->loop = loop;
+        connection->length = 0;
+        connection->consumed = 0;
+        http_parser_init(&connection->parser);
+        connection->requests_served = 0;
+        connection->keep_alive = false;
+        connection->is_receiving_body = false;
+        connection->next_returned = NULL;
+        connection->is_sending = false;
+        connection->pending_operations = 0;
+        connection->is_closing = false;
+        connection->phase = CONNECTION_PHASE_NONE;
+        timer_wheel_timer_init(&connection->timer);
+        pthread_mutex_init(&connection->pipeline_lock, NULL);
+
+        return connection;
+}
+
+static void accept_connections(event_loop_t *loop)
+{
+        while (1) {
+                struct sockaddr_in client_addr;
+                socklen_t client_len = sizeof(client_addr);
+
+                int client_fd = accept4(loop->listen_fd, (struct sockaddr *)&client_addr,
+                                        &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (client_fd < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED)
+                                continue;
+                        if (errno != EAGAIN && errno != EWOULDBLOCK)
+                                log_error("Failed to accept client connection: %s",
+                                          strerror(errno));
+                        return;
+                }
+
+                http_connection_t *connection = connection_new(loop, client_fd);
+                if (!connection) {
+                        close(client_fd);
+                        continue;
+                }
+
+                struct epoll_event event = { .events = CLIENT_EVENTS, .data.ptr = connection };
+                if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) < 0) {
+                        log_error("Failed to register client connection: %s", strerror(errno));
+                        connection_close(connection);
+                        continue;
+                }
+
+                // the head has to be in by the deadline set at accept, however
+                // slowly it trickles in
+                connection_set_phase(connection, CONNECTION_PHASE_HEADERS);
+                event_loop_timer_arm(loop, connection);
+
+                log_debug("Client connected from %s:%d (fd: %d)", inet_ntoa(client_addr.sin_addr),
+                          ntohs(client_addr.sin_port), client_fd);
+        }
+}
+
+static void handle_ready(event_loop_t *loop, http_connection_t *connection)
+{
+        event_loop_timer_disarm(loop, connection);
+
+        // the descriptor stays disarmed until the connection is handed back,
+        // so the worker owns it exclusively; with the queue full, the loop
+        // thread does the work itself, which holds off accepting more
+        threadpool_function_t task =
+                connection->is_sending ? worker_write_connection : worker_read_connection;
+        if (threadpool_execute(loop->server->threadpool, task, connection) != 0)
+                task(connection);
+}
+
+static void handle_returned(event_loop_t *loop)
+{
+        uint64_t count;
+        if (read(loop->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                log_error("Failed to read wake-up eventfd: %s", strerror(errno));
+
+        http_connection_t *connection =
+                atomic_exchange_explicit(&loop->returned, NULL, memory_order_acquire);
+
+        while (connection) {
+                http_connection_t *next = connection->next_returned;
+
+                uint32_t events = connection->is_sending ? CLIENT_WRITE_EVENTS : CLIENT_EVENTS;
+                if (rearm_connection(connection, events) < 0)
+                        connection_close(connection);
+                else
+                        event_loop_timer_arm(loop, connection);
+
+                connection = next;
+        }
+}
+
+static void worker_read_connection(void *raw_connection)
+{
+        http_connection_t *connection = (http_connection_t *)raw_connection;
+
+        if (read_available(connection) < 0) {
+                log_debug("Client connection closed (fd: %d)", connection->fd);
+                connection_close(connection);
+                return;
+        }
+
+        connection_process(connection);
+}
+
+ssize_t event_loop_write(http_connection_t *connection, const http_response_t *const *responses,
+                         const http_response_meta_t *meta, size_t count)
+{
+        char heads[RESPONSE_HEAD_BUFFER_SIZE];
+        struct iovec iov[RESPONSE_MAX_IOVECS];
+        size_t iov_count = 0;
+
+        ssize_t prepared = http_responses_prepare(heads, iov, &iov_count, responses, meta, count);
+        if (prepared < 0)
+                return prepared;
+
+        struct iovec *pending = iov;
+        if (http_iov_write(connection->fd, &pending, &iov_count) < 0)
+                return -3;
+
+        if (0 == iov_count)
+                return prepared;
+
+        if (park_send(connection, heads, pending, iov_count, (size_t)prepared) < 0)
+                return -1;
+        return 0;
+}
+
+static int park_send(http_connection_t *connection, const char *heads, const struct iovec *iov,
+                     size_t iov_count, size_t count)
+{
+        if (!connection->send) {
+                connection->send = malloc(sizeof(http_send_t));
+                if (!connection->send) {
+                        log_error("Failed allocating pending responses");
+                        return -1;
+                }
+        }
+
+        // the heads were serialized on the worker's stack, so they move along
+        // with the iovecs pointing into them; the bodies stay where they are
+        http_send_t *send = connection->send;
+        memcpy(send->heads, heads, RESPONSE_HEAD_BUFFER_SIZE);
+        for (size_t i = 0; i < iov_count; ++i) {
+                send->iov[i] = iov[i];
+
+                const char *base = (const char *)iov[i].iov_base;
+                if (base >= heads && base < heads + RESPONSE_HEAD_BUFFER_SIZE)
+                        send->iov[i].iov_base = send->heads + (base - heads);
+        }
+
+        memset(&send->message, 0, sizeof(struct msghdr));
+        send->message.msg_iov = send->iov;
+        send->message.msg_iovlen = iov_count;
+        send->count = count;
+        send->closes = false;
+        send->failed = false;
+
+        // every batch gets the whole limit, however many went out before it
+        connection->phase = CONNECTION_PHASE_NONE;
+        connection_set_phase(connection, CONNECTION_PHASE_WRITE);
+        connection->is_sending = true;
+        event_loop_return(connection);
+        return 0;
+}
+
+static void worker_write_connection(void *raw_connection)
+{
+        http_connection_t *connection = (http_connection_t *)raw_connection;
+        http_send_t *send = connection->send;
+
+        struct iovec *pending = send->message.msg_iov;
+        size_t iov_count = send->message.msg_iovlen;
+        if (http_iov_write(connection->fd, &pending, &iov_count) < 0) {
+                send->failed = true;
+                iov_count = 0;
+        }
+
+        // the deadline set when the batch was parked still stands
+        if (iov_count > 0) {
+                send->message.msg_iov = pending;
+                send->message.msg_iovlen = iov_count;
+                event_loop_return(connection);
+                return;
+        }
+
+        connection->is_sending = false;
+        server_pipeline_sent(connection);
+}
+
+static void worker_pipeline_sent(void *raw_connection)
+{
+        server_pipeline_sent((http_connection_t *)raw_connection);
+}
+
+void connection_process(http_connection_t *connection)
+{
+        server_t *server = connection->loop->server;
+
+        // drop the requests which have just been answered, whatever follows
+        // them is the start of the next one
+        if (connection->consumed > 0) {
+                connection->length -= connection->consumed;
+                memmove(connection->buffer, connection->buffer + connection->consumed,
+                        connection->length);
+                connection->buffer[connection->length] = '\0';
+                connection->consumed = 0;
+        }
+
+        http_parser_t *parser = &connection->parser;
+
+        // while a body is being received, the buffer holds nothing past the
+        // head but the body's latest bytes, which are no business of the parser
+        if (!connection->is_receiving_body) {
+                http_parse_status_t status =
+                        http_parser_execute(parser, connection->buffer, connection->length);
+                if (status == HTTP_PARSE_ERROR) {
+                        log_error("Malformed request, dropping client (fd: %d)", connection->fd);
+                        if (server->metrics)
+                                http_metrics_record_parse_failure(server->metrics);
+                        connection_close(connection);
+                        return;
+                }
+
+                if (status == HTTP_PARSE_COMPLETE) {
+                        connection->phase = CONNECTION_PHASE_NONE;
+                        server_dispatch_requests(server, connection);
+                        return;
+                }
+        }
+
+        // a body which cannot fit into the buffer alongside its head is taken
+        // out of it as it arrives
+        if (connection->is_receiving_body ||
+            (parser->state == HTTP_PARSER_BODY &&
+             (parser->is_chunked ||
+              parser->content_length > CONNECTION_BUFFER_SIZE - 1 - parser->head_length))) {
+                connection->phase = CONNECTION_PHASE_NONE;
+                if (server_receive_body(server, connection) != 0)
+                        return;
+                connection_set_phase(connection, CONNECTION_PHASE_BODY);
+        }
+
+        // the client holds the body back until told to go ahead, which is only
+        // done once the head has been accepted
+        if (parser->state == HTTP_PARSER_BODY && parser->expects_continue) {
+                parser->expects_continue = false;
+                if (send(connection->fd, CONTINUE_RESPONSE, sizeof(CONTINUE_RESPONSE) - 1,
+                         MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+                        log_debug("Failed sending 100 Continue (fd: %d): %s", connection->fd,
+                                  strerror(errno));
+        }
+
+        if (connection->length >= CONNECTION_BUFFER_SIZE - 1) {
+                log_error("Request exceeds %d bytes, dropping client", CONNECTION_BUFFER_SIZE - 1);
+                // best effort, the client is gone either way
+                if (send(connection->fd, HEADERS_TOO_LARGE_RESPONSE,
+                         sizeof(HEADERS_TOO_LARGE_RESPONSE) - 1, MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+                        log_debug("Failed sending 431 (fd: %d): %s", connection->fd,
+                                  strerror(errno));
+                connection_close(connection);
+                return;
+        }
+
+        // a connection which has been answered and has nothing more buffered
+        // is idle, a partial request keeps the deadline its phase started with
+        if (connection->length == 0 && connection->requests_served > 0)
+                connection_set_phase(connection, CONNECTION_PHASE_IDLE);
+        else if (connection->parser.state == HTTP_PARSER_BODY)
+                connection_set_phase(connection, CONNECTION_PHASE_BODY);
+        else
+                connection_set_phase(connection, CONNECTION_PHASE_HEADERS);
+
+        // only the loop may touch the epoll set and the timer wheel, so waiting
+        // for the rest of the request starts once it has the connection back
+        event_loop_return(connection);
+}
+
+static int read_available(http_connection_t *connection)
+{
+        while (connection->length < CONNECTION_BUFFER_SIZE - 1) {
+                ssize_t bytes_read = read(connection->fd, connection->buffer + connection->length,
+                                          CONNECTION_BUFFER_SIZE - 1 - connection->length);
+                if (bytes_read == 0)
+                        return -1;
+
+                if (bytes_read < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                break;
+                        return -1;
+                }
+
+                connection->length += (size_t)bytes_read;
+        }
+
+        connection->buffer[connection->length] = '\0';
+        return 0;
+}
+
+static int rearm_connection(http_connection_t *connection, uint32_t events)
+{
+        struct epoll_event event = { .events = events, .data.ptr = connection };
+        if (epoll_ctl(connection->loop->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event) < 0) {
+                log_error("Failed to re-arm client connection: %s", strerror(errno));
+                return -1;
+        }
+        return 0;
+}
+
+void connection_set_phase(http_connection_t *connection, connection_phase_t phase)
+{
+        if (connection->phase == phase)
+                return;
+
+        connection->phase = phase;
+        connection->deadline = event_loop_now_ms() + phase_timeout(connection->loop->server, phase);
+}
+
+void event_loop_timer_arm(event_loop_t *loop, http_connection_t *connection)
+{
+        // the wheel is not turned while the loop sleeps without a timeout, and
+        // a deadline measured from a tick hours back would be clamped to one
+        // which has already passed
+        timer_wheel_advance(&loop->timers, event_loop_now_ms());
+        timer_wheel_schedule(&loop->timers, &connection->timer, connection->deadline);
+}
+
+void event_loop_timer_disarm(event_loop_t *loop, http_connection_t *connection)
+{
+        timer_wheel_cancel(&loop->timers, &connection->timer);
+}
+
+http_connection_t *event_loop_pop_expired(event_loop_t *loop)
+{
+        timer_wheel_timer_t *timer = timer_wheel_pop_expired(&loop->timers, event_loop_now_ms());
+        if (!timer)
+                return NULL;
+
+        return connection_from_timer(timer);
+}
+
+// The wheel only needs turning when a slot with timers in it comes round, so
+// the loop sleeps through however many empty ticks there are in between.
+int event_loop_next_timeout(const event_loop_t *loop)
+{
+        uint64_t next = timer_wheel_next_tick(&loop->timers);
+        if (next == UINT64_MAX)
+                return -1;
+
+        uint64_t now = event_loop_now_ms();
+        if (next <= now)
+                return 0;
+
+        return next - now > INT_MAX ? INT_MAX : (int)(next - now);
+}
+
+const char *connection_phase_name(connection_phase_t phase)
+{
+        switch (phase) {
+        case CONNECTION_PHASE_IDLE:
+                return "idle";
+        case CONNECTION_PHASE_HEADERS:
+                return "header";
+        case CONNECTION_PHASE_BODY:
+                return "body";
+        case CONNECTION_PHASE_WRITE:
+                return "write";
+        case CONNECTION_PHASE_NONE:
+        default:
+                return "unknown";
+        }
+}
+
+static void expire_connections(event_loop_t *loop)
+{
+        http_connection_t *connection;
+        while ((connection = event_loop_pop_expired(loop))) {
+                log_debug("Closing connection after %s timeout (fd: %d)",
+                          connection_phase_name(connection->phase), connection->fd);
+
+                if (connection->phase != CONNECTION_PHASE_WRITE) {
+                        connection_close(connection);
+                        continue;
+                }
+
+                // the parked batch fails like any other, and the worker it is
+                // handed to closes the connection once the pipeline drains;
+                // until then, the socket must not report ready to the loop
+                if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL) < 0)
+                        log_error("Failed to remove client connection: %s", strerror(errno));
+
+                connection->send->failed = true;
+                connection->is_sending = false;
+                if (threadpool_execute(loop->server->threadpool, worker_pipeline_sent,
+                                       connection) != 0)
+                        server_pipeline_sent(connection);
+        }
+}
+
+static http_connection_t *connection_from_timer(timer_wheel_timer_t *timer)
+{
+        return (http_connection_t *)((char *)timer - offsetof(http_connection_t, timer));
+}
+
+static uint64_t phase_timeout(const server_t *server, connection_phase_t phase)
+{
+        switch (phase) {
+        case CONNECTION_PHASE_IDLE:
+                return server->keep_alive_timeout_ms;
+        case CONNECTION_PHASE_HEADERS:
+                return server->header_timeout_ms;
+        case CONNECTION_PHASE_BODY:
+                return server->body_timeout_ms;
+        case CONNECTION_PHASE_WRITE:
+                return server->write_timeout_ms;
+        case CONNECTION_PHASE_NONE:
+        default:
+                return 0;
+        }
+}
+
+uint64_t event_loop_now_ms(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+uint64_t event_loop_now_ns(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
@@ -0,0 +1,522 @@
+#include "connection.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "logger.h"
+#include "threadpool.h"
+
+/// Completions are told apart by their user data. The listener and the
+/// wake-up eventfd have fixed tags, everything else carries the connection's
+/// address with the operation in its low bits, which malloc() leaves clear.
+#define URING_TAG_ACCEPT 1
+#define URING_TAG_ACCEPT_RETRY 2
+#define URING_TAG_WAKE 3
+#define URING_OPERATION_MASK ((uint64_t)7)
+
+/// How long accepting pauses after an error which retrying right away would
+/// only repeat, such as running out of descriptors
+#define URING_ACCEPT_RETRY_MS 10
+
+typedef enum {
+        URING_OPERATION_RECV = 1,
+        URING_OPERATION_SEND,
+        URING_OPERATION_CLOSE,
+        URING_OPERATION_CANCEL,
+} uring_operation_t;
+
+static uint64_t operation_tag(const http_connection_t *, uring_operation_t);
+
+/// Arms a multishot accept, right away or behind a short timeout
+static void submit_accept(event_loop_t *, bool);
+static void submit_wake_read(event_loop_t *);
+static void submit_recv(event_loop_t *, http_connection_t *);
+/// Sends the batch in the connection's `send`, linked to a close of the
+/// descriptor when the connection ends with it
+static void submit_send(event_loop_t *, http_connection_t *);
+/// Cancels the connection's operation of the given kind
+static void submit_cancel(event_loop_t *, http_connection_t *, uring_operation_t);
+
+static void handle_completion(event_loop_t *, const struct io_uring_cqe *);
+static void handle_accept(event_loop_t *, const struct io_uring_cqe *);
+static void handle_returned(event_loop_t *);
+static void handle_recv(event_loop_t *, http_connection_t *, const struct io_uring_cqe *);
+static void handle_send(http_connection_t *, int);
+static void handle_close(http_connection_t *, int);
+
+/// Accounts for a completed operation, once the last one is in, finishing
+/// whatever was waiting for it: closing the connection or the current send
+static void operation_done(event_loop_t *, http_connection_t *);
+/// Closes the connection once nothing is in flight on it anymore
+static void connection_abort(http_connection_t *);
+
+static void expire_connections(event_loop_t *);
+
+static void worker_process_connection(void *);
+static void worker_pipeline_sent(void *);
+
+int uring_loop_init(event_loop_t *loop)
+{
+        if (uring_init(&loop->uring) != 0)
+                return -1;
+
+        // the eventfd is read through the ring, which waits on a blocking one
+        // for as long as it takes
+        loop->wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (loop->wake_fd < 0) {
+                log_error("Failed to create wake-up eventfd: %s", strerror(errno));
+                uring_free(&loop->uring);
+                return -1;
+        }
+
+        submit_accept(loop, false);
+        submit_wake_read(loop);
+        return 0;
+}
+
+void uring_loop_run(event_loop_t *loop)
+{
+        uring_t *ring = &loop->uring;
+
+        while (1) {
+                // submitting and waiting is the one syscall per iteration, no
+                // matter how many connections were served in it
+                if (uring_submit_and_wait(ring, event_loop_next_timeout(loop)) < 0)
+                        return;
+
+                struct io_uring_cqe *cqe;
+                while ((cqe = uring_peek_cqe(ring))) {
+                        struct io_uring_cqe completion = *cqe;
+                        uring_cqe_seen(ring);
+                        handle_completion(loop, &completion);
+                }
+
+                expire_connections(loop);
+        }
+}
+
+void uring_loop_free(event_loop_t *loop)
+{
+        if (!loop) {
+                log_trace("Trying to free a NULL io_uring event loop");
+                return;
+        }
+
+        uring_free(&loop->uring);
+}
+
+ssize_t event_loop_send(http_connection_t *connection, const http_response_t *const *responses,
+                        const http_response_meta_t *meta, size_t count, bool closes)
+{
+        http_send_t *send = connection->send;
+        if (!send) {
+                log_trace("Connection is not sent through its event loop");
+                return -1;
+        }
+
+        size_t iov_count = 0;
+        ssize_t prepared =
+                http_responses_prepare(send->heads, send->iov, &iov_count, responses, meta, count);
+        if (prepared < 0)
+                return prepared;
+
+        memset(&send->message, 0, sizeof(struct msghdr));
+        send->message.msg_iov = send->iov;
+        send->message.msg_iovlen = iov_count;
+        send->count = (size_t)prepared;
+        send->closes = closes && (size_t)prepared == count;
+        send->failed = false;
+
+        connection->is_sending = true;
+        event_loop_return(connection);
+        return prepared;
+}
+
+static uint64_t operation_tag(const http_connection_t *connection, uring_operation_t operation)
+{
+        return (uint64_t)(uintptr_t)connection | (uint64_t)operation;
+}
+
+static void submit_accept(event_loop_t *loop, bool is_delayed)
+{
+        static const struct __kernel_timespec RETRY_DELAY = {
+                .tv_sec = 0,
+                .tv_nsec = URING_ACCEPT_RETRY_MS * 1000000,
+        };
+
+        if (uring_reserve(&loop->uring, 2) < 0)
+                log_fatal(EXIT_FAILURE, "Failed to arm accepting on the io_uring");
+
+        // the timeout running out counts as success, so the accept linked
+        // behind it is not cancelled
+        if (is_delayed) {
+                struct io_uring_sqe *sqe = uring_get_sqe(&loop->uring);
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->fd = -1;
+                sqe->addr = (uintptr_t)&RETRY_DELAY;
+                sqe->len = 1;
+                sqe->timeout_flags = IORING_TIMEOUT_ETIME_SUCCESS;
+                sqe->flags = IOSQE_IO_LINK;
+                sqe->user_data = URING_TAG_ACCEPT_RETRY;
+        }
+
+        struct io_uring_sqe *sqe = uring_get_sqe(&loop->uring);
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = loop->listen_fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = URING_TAG_ACCEPT;
+}
+
+static void submit_wake_read(event_loop_t *loop)
+{
+        struct io_uring_sqe *sqe = uring_get_sqe(&loop->uring);
+        if (!sqe)
+                log_fatal(EXIT_FAILURE, "Failed to arm the wake-up eventfd on the io_uring");
+
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = loop->wake_fd;
+        sqe->addr = (uintptr_t)&loop->wake_count;
+        sqe->len = sizeof(loop->wake_count);
+        sqe->off = (uint64_t)-1;
+        sqe->user_data = URING_TAG_WAKE;
+}
+
+static void submit_recv(event_loop_t *loop, http_connection_t *connection)
+{
+        struct io_uring_sqe *sqe = uring_get_sqe(&loop->uring);
+        if (!sqe) {
+                connection_abort(connection);
+                return;
+        }
+
+        // never more than the connection's buffer has room for, since the
+        // data is copied there to be parsed in place
+        size_t room = CONNECTION_BUFFER_SIZE - 1 - connection->length;
+
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = connection->fd;
+        sqe->len = (uint32_t)(room < URING_BUFFER_SIZE ? room : URING_BUFFER_SIZE);
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        sqe->user_data = operation_tag(connection, URING_OPERATION_RECV);
+        connection->pending_operations++;
+
+        event_loop_timer_arm(loop, connection);
+}
+
+static void submit_send(event_loop_t *loop, http_connection_t *connection)
+{
+        http_send_t *send = connection->send;
+
+        // the send and the close behind it have to go to the kernel together,
+        // or they would not be linked
+        if (uring_reserve(&loop->uring, 2) < 0) {
+                send->failed = true;
+                connection->pending_operations++;
+                operation_done(loop, connection);
+                return;
+        }
+
+        struct io_uring_sqe *sqe = uring_get_sqe(&loop->uring);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = connection->fd;
+        sqe->addr = (uintptr_t)&send->message;
+        sqe->len = 1;
+        // on stream sockets, the kernel keeps sending until everything is out
+        // rather than completing with a short count
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data = operation_tag(connection, URING_OPERATION_SEND);
+        connection->pending_operations++;
+
+        event_loop_timer_arm(loop, connection);
+
+        if (!send->closes)
+                return;
+
+        // a failed send breaks the link and cancels the close, leaving the
+        // descriptor to be closed along with the connection
+        sqe->flags = IOSQE_IO_LINK;
+
+        sqe = uring_get_sqe(&loop->uring);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = connection->fd;
+        sqe->user_data = operation_tag(connection, URING_OPERATION_CLOSE);
+        connection->pending_operations++;
+}
+
+static void submit_cancel(event_loop_t *loop, http_connection_t *connection,
+                          uring_operation_t operation)
+{
+        // shutting the socket down completes the operation just as well, only
+        // at the cost of a syscall of its own
+        struct io_uring_sqe *sqe = uring_get_sqe(&loop->uring);
+        if (!sqe) {
+                shutdown(connection->fd, SHUT_RDWR);
+                return;
+        }
+
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = operation_tag(connection, operation);
+        sqe->user_data = operation_tag(connection, URING_OPERATION_CANCEL);
+        connection->pending_operations++;
+}
+
+static void handle_completion(event_loop_t *loop, const struct io_uring_cqe *cqe)
+{
+        switch (cqe->user_data) {
+        case URING_TAG_ACCEPT:
+                handle_accept(loop, cqe);
+                return;
+        case URING_TAG_ACCEPT_RETRY:
+                return;
+        case URING_TAG_WAKE:
+                handle_returned(loop);
+                return;
+        default:
+                break;
+        }
+
+        http_connection_t *connection =
+                (http_connection_t *)(uintptr_t)(cqe->user_data & ~URING_OPERATION_MASK);
+        uring_operation_t operation = (uring_operation_t)(cqe->user_data & URING_OPERATION_MASK);
+
+        switch (operation) {
+        case URING_OPERATION_RECV:
+                handle_recv(loop, connection, cqe);
+                return;
+        case URING_OPERATION_SEND:
+                handle_send(connection, cqe->res);
+                break;
+        case URING_OPERATION_CLOSE:
+                handle_close(connection, cqe->res);
+                break;
+        case URING_OPERATION_CANCEL:
+                break;
+        default:
+                log_error("Unknown io_uring completion %llu", cqe->user_data);
+                return;
+        }
+
+        operation_done(loop, connection);
+}
+
+static void handle_accept(event_loop_t *loop, const struct io_uring_cqe *cqe)
+{
+        // the multishot accept stays armed for as long as the kernel says so
+        if (cqe->res < 0) {
+                int error = -cqe->res;
+                bool is_transient = error == EINTR || error == ECONNABORTED || error == EAGAIN;
+                if (!is_transient)
+                        log_error("Failed to accept client connection: %s", strerror(error));
+
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                        submit_accept(loop, !is_transient);
+                return;
+        }
+
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+                submit_accept(loop, false);
+
+        int client_fd = cqe->res;
+        http_connection_t *connection = connection_new(loop, client_fd);
+        if (!connection) {
+                close(client_fd);
+                return;
+        }
+
+        log_debug("Client connected (fd: %d)", client_fd);
+        connection_set_phase(connection, CONNECTION_PHASE_HEADERS);
+        submit_recv(loop, connection);
+}
+
+static void handle_returned(event_loop_t *loop)
+{
+        submit_wake_read(loop);
+
+        http_connection_t *connection =
+                atomic_exchange_explicit(&loop->returned, NULL, memory_order_acquire);
+
+        while (connection) {
+                http_connection_t *next = connection->next_returned;
+
+                if (connection->is_sending) {
+                        // every batch gets the whole limit, however many
+                        // went out before it
+                        connection->is_sending = false;
+                        connection->phase = CONNECTION_PHASE_NONE;
+                        connection_set_phase(connection, CONNECTION_PHASE_WRITE);
+                        submit_send(loop, connection);
+                } else {
+                        submit_recv(loop, connection);
+                }
+
+                connection = next;
+        }
+}
+
+static void handle_recv(event_loop_t *loop, http_connection_t *connection,
+                        const struct io_uring_cqe *cqe)
+{
+        connection->pending_operations--;
+
+        bool has_buffer = cqe->flags & IORING_CQE_F_BUFFER;
+        uint16_t buffer_id = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+        // expired while the data was on its way, which goes the same way as
+        // on the epoll backend
+        if (connection->is_closing) {
+                if (has_buffer)
+                        uring_buffer_recycle(&loop->uring, buffer_id);
+                connection_abort(connection);
+                return;
+        }
+
+        event_loop_timer_disarm(loop, connection);
+
+        // every buffer was taken by the completions reaped in this batch,
+        // which have handed theirs back by the time this one is resubmitted
+        if (cqe->res == -ENOBUFS) {
+                submit_recv(loop, connection);
+                return;
+        }
+
+        if (cqe->res <= 0 || !has_buffer) {
+                log_debug("Client connection closed (fd: %d)", connection->fd);
+                connection_abort(connection);
+                return;
+        }
+
+        size_t received = (size_t)cqe->res;
+        memcpy(connection->buffer + connection->length, uring_buffer(&loop->uring, buffer_id),
+               received);
+        connection->length += received;
+        connection->buffer[connection->length] = '\0';
+        uring_buffer_recycle(&loop->uring, buffer_id);
+
+        // like reading until EAGAIN, whatever is already queued on the socket
+        // is collected before a worker looks at the request
+        if ((cqe->flags & IORING_CQE_F_SOCK_NONEMPTY) &&
+            connection->length < CONNECTION_BUFFER_SIZE - 1) {
+                submit_recv(loop, connection);
+                return;
+        }
+
+        // with the queue full, the loop thread does the work itself, which
+        // holds off accepting more
+        if (threadpool_execute(loop->server->threadpool, worker_process_connection, connection) !=
+            0)
+                connection_process(connection);
+}
+
+static void handle_send(http_connection_t *connection, int res)
+{
+        http_send_t *send = connection->send;
+
+        if (res < 0) {
+                if (!send->failed)
+                        log_debug("Failed sending response to client: %s", strerror(-res));
+                send->failed = true;
+                return;
+        }
+
+        // skip over whatever has been sent, possibly stopping in the middle of
+        // an iovec; a kernel which does not retry short sends leaves the rest
+        // to be sent again
+        size_t remaining = (size_t)res;
+        struct msghdr *message = &send->message;
+        while (message->msg_iovlen > 0 && remaining >= message->msg_iov->iov_len) {
+                remaining -= message->msg_iov->iov_len;
+                message->msg_iov++;
+                message->msg_iovlen--;
+        }
+
+        if (message->msg_iovlen > 0) {
+                message->msg_iov->iov_base = (char *)message->msg_iov->iov_base + remaining;
+                message->msg_iov->iov_len -= remaining;
+
+                if (0 == res)
+                        send->failed = true;
+        }
+}
+
+static void handle_close(http_connection_t *connection, int res)
+{
+        // cancelled along with a failed send, the descriptor is still open
+        if (res == -ECANCELED)
+                return;
+
+        if (res < 0)
+                log_debug("Failed closing client connection: %s", strerror(-res));
+        connection->fd = -1;
+}
+
+static void operation_done(event_loop_t *loop, http_connection_t *connection)
+{
+        connection->pending_operations--;
+        if (connection->pending_operations > 0)
+                return;
+
+        if (connection->is_closing) {
+                connection_abort(connection);
+                return;
+        }
+
+        http_send_t *send = connection->send;
+        if (!send->failed && send->message.msg_iovlen > 0 && connection->fd >= 0) {
+                submit_send(loop, connection);
+                return;
+        }
+
+        event_loop_timer_disarm(loop, connection);
+        if (threadpool_execute(loop->server->threadpool, worker_pipeline_sent, connection) != 0)
+                server_pipeline_sent(connection);
+}
+
+static void connection_abort(http_connection_t *connection)
+{
+        event_loop_timer_disarm(connection->loop, connection);
+        connection->is_closing = true;
+        if (connection->pending_operations > 0)
+                return;
+
+        connection_close(connection);
+}
+
+static void expire_connections(event_loop_t *loop)
+{
+        http_connection_t *connection;
+        while ((connection = event_loop_pop_expired(loop))) {
+                log_debug("Closing connection after %s timeout (fd: %d)",
+                          connection_phase_name(connection->phase), connection->fd);
+
+                // a cancelled send fails like any other, and the worker it is
+                // handed to closes the connection; one cut short after sending
+                // part of the batch must not be resubmitted
+                if (connection->phase == CONNECTION_PHASE_WRITE) {
+                        connection->send->failed = true;
+                        submit_cancel(loop, connection, URING_OPERATION_SEND);
+                        continue;
+                }
+
+                // the recv still holds on to the descriptor, the connection is
+                // closed once it has been cancelled
+                connection->is_closing = true;
+                submit_cancel(loop, connection, URING_OPERATION_RECV);
+        }
+}
+
+static void worker_process_connection(void *raw_connection)
+{
+        connection_process((http_connection_t *)raw_connection);
+}
+
+static void worker_pipeline_sent(void *raw_connection)
+{
+        server_pipeline_sent((http_connection_t *)raw_connection);
+}
@@ -0,0 +1,428 @@
+#include "metrics.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+
+#define HTTP_HISTOGRAM_SUB_COUNT (1 << HTTP_HISTOGRAM_SUB_BITS)
+/// Longer route names are cut short in the labels
+#define HTTP_METRICS_MAX_LABELS_LENGTH 512
+
+typedef struct {
+        char *data;
+        size_t length;
+        size_t capacity;
+        bool failed;
+} metrics_writer_t;
+
+/// Returns the calling thread's shard of the metrics, creating it on first use
+static http_metrics_shard_t *metrics_shard(http_metrics_t *);
+
+static void counter_add(_Atomic uint64_t *, uint64_t);
+static void histogram_record(http_histogram_t *, uint64_t);
+static size_t histogram_bucket(uint64_t);
+/// Adds the histogram's buckets, sum and count to the given totals
+static void histogram_merge(const http_histogram_t *, uint64_t *, uint64_t *, uint64_t *);
+
+static void write_format(metrics_writer_t *, const char *, ...)
+        __attribute__((format(printf, 2, 3)));
+/// Writes the cumulative buckets, sum and count of a merged histogram, with
+/// values in seconds as Prometheus expects. The labels are either empty or
+/// end in a comma.
+static void write_histogram(metrics_writer_t *, const char *, const char *, const uint64_t *,
+                            uint64_t, uint64_t);
+/// Formats `route="...",` and, for a status class, `code="...",` with the
+/// route escaped as a label value
+static void format_labels(char *, size_t, const char *, size_t);
+
+static _Thread_local const http_metrics_t *current_metrics = NULL;
+static _Thread_local http_metrics_shard_t *current_shard = NULL;
+
+http_metrics_t *http_metrics_new(const http_router_t *router)
+{
+        http_metrics_t *metrics = malloc(sizeof(http_metrics_t));
+        if (!metrics) {
+                log_trace("Failed allocating metrics");
+                return NULL;
+        }
+
+        metrics->router = router;
+        atomic_init(&metrics->shards, NULL);
+        return metrics;
+}
+
+void http_metrics_free(http_metrics_t *metrics)
+{
+        if (!metrics)
+                return;
+
+        http_metrics_shard_t *shard = atomic_load(&metrics->shards);
+        while (shard) {
+                http_metrics_shard_t *next = shard->next;
+                free(shard);
+                shard = next;
+        }
+
+        free(metrics);
+}
+
+void http_metrics_record_response(http_metrics_t *metrics, size_t route, size_t status_code,
+                                  uint64_t latency_ns, size_t bytes_out)
+{
+        http_metrics_shard_t *shard = metrics_shard(metrics);
+        if (!shard || route >= shard->route_count)
+                return;
+
+        size_t status_class = status_code / 100;
+        if (status_class >= HTTP_METRICS_STATUS_CLASSES)
+                status_class = 0;
+
+        http_route_metrics_t *route_metrics = &shard->routes[route];
+        histogram_record(&route_metrics->latency[status_class], latency_ns);
+        counter_add(&route_metrics->bytes_out, bytes_out);
+}
+
+void http_metrics_record_request(http_metrics_t *metrics, size_t route, size_t bytes_in)
+{
+        http_metrics_shard_t *shard = metrics_shard(metrics);
+        if (!shard || route >= shard->route_count)
+                return;
+
+        counter_add(&shard->routes[route].bytes_in, bytes_in);
+}
+
+void http_metrics_record_queue_wait(http_metrics_t *metrics, uint64_t wait_ns)
+{
+        http_metrics_shard_t *shard = metrics_shard(metrics);
+        if (shard)
+                histogram_record(&shard->queue_wait, wait_ns);
+}
+
+void http_metrics_record_parse_failure(http_metrics_t *metrics)
+{
+        http_metrics_shard_t *shard = metrics_shard(metrics);
+        if (shard)
+                counter_add(&shard->parse_failures, 1);
+}
+
+static http_metrics_shard_t *metrics_shard(http_metrics_t *metrics)
+{
+        if (current_metrics == metrics)
+                return current_shard;
+
+        // a thread serving more than one server may already have a shard here
+        pthread_t self = pthread_self();
+        http_metrics_shard_t *head = atomic_load_explicit(&metrics->shards, memory_order_acquire);
+        http_metrics_shard_t *shard = head;
+        while (shard && !pthread_equal(shard->thread, self))
+                shard = shard->next;
+
+        if (!shard) {
+                size_t route_count = metrics->router->route_count;
+                shard = calloc(1, sizeof(http_metrics_shard_t) +
+                                          route_count * sizeof(http_route_metrics_t));
+                if (!shard) {
+                        log_trace("Failed allocating metrics shard");
+                        return NULL;
+                }
+
+                shard->thread = self;
+                shard->route_count = route_count;
+
+                do {
+                        shard->next = head;
+                } while (!atomic_compare_exchange_weak_explicit(
+                        &metrics->shards, &head, shard, memory_order_release,
+                        memory_order_relaxed));
+        }
+
+        current_metrics = metrics;
+        current_shard = shard;
+        return shard;
+}
+
+static void counter_add(_Atomic uint64_t *counter, uint64_t value)
+{
+        // only the owning thread writes, readers merely need untorn values,
+        // so there is no need for a locked read-modify-write
+        atomic_store_explicit(counter,
+                              atomic_load_explicit(counter, memory_order_relaxed) + value,
+                              memory_order_relaxed);
+}
+
+static void histogram_record(http_histogram_t *histogram, uint64_t value)
+{
+        counter_add(&histogram->buckets[histogram_bucket(value)], 1);
+        counter_add(&histogram->sum, value);
+        counter_add(&histogram->count, 1);
+}
+
+static size_t histogram_bucket(uint64_t value)
+{
+        if (value < (UINT64_C(1) << HTTP_HISTOGRAM_MIN_SHIFT))
+                return 0;
+
+        unsigned int exponent = 63 - (unsigned int)__builtin_clzll(value);
+        if (exponent >= HTTP_HISTOGRAM_MAX_SHIFT)
+                return HTTP_HISTOGRAM_BUCKETS - 1;
+
+        size_t sub_bucket = (size_t)(value >> (exponent - HTTP_HISTOGRAM_SUB_BITS)) &
+                            (HTTP_HISTOGRAM_SUB_COUNT - 1);
+        return 1 + (exponent - HTTP_HISTOGRAM_MIN_SHIFT) * HTTP_HISTOGRAM_SUB_COUNT + sub_bucket;
+}
+
+static void histogram_merge(const http_histogram_t *histogram, uint64_t *buckets, uint64_t *sum,
+                            uint64_t *count)
+{
+        // the counters are read one by one while the owner keeps recording,
+        // so a merged histogram may be off by the odd in-flight value
+        *count += atomic_load_explicit(&histogram->count, memory_order_relaxed);
+        *sum += atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+        for (size_t i = 0; i < HTTP_HISTOGRAM_BUCKETS; ++i)
+                buckets[i] += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+}
+
+char *http_metrics_render(const http_metrics_t *metrics, const server_stats_t *stats,
+                          size_t *length)
+{
+        if (!metrics || !stats || !length)
+                return NULL;
+
+        metrics_writer_t writer = { .data = NULL, .length = 0, .capacity = 0, .failed = false };
+        const http_router_t *router = metrics->router;
+        http_metrics_shard_t *first = atomic_load_explicit(&metrics->shards, memory_order_acquire);
+
+        uint64_t buckets[HTTP_HISTOGRAM_BUCKETS];
+
+        write_format(&writer, "# HELP starcaller_requests_total Requests handled, by route and "
+                              "status class\n"
+                              "# TYPE starcaller_requests_total counter\n");
+        for (size_t route = 0; route < router->route_count; ++route) {
+                for (size_t status_class = 0; status_class < HTTP_METRICS_STATUS_CLASSES;
+                     ++status_class) {
+                        uint64_t count = 0;
+                        for (http_metrics_shard_t *shard = first; shard; shard = shard->next) {
+                                if (route < shard->route_count)
+                                        count += atomic_load_explicit(
+                                                &shard->routes[route].latency[status_class].count,
+                                                memory_order_relaxed);
+                        }
+
+                        if (0 == count)
+                                continue;
+
+                        char labels[HTTP_METRICS_MAX_LABELS_LENGTH];
+                        format_labels(labels, sizeof(labels), router->route_names[route],
+                                      status_class);
+                        write_format(&writer, "starcaller_requests_total{%.*s} %lu\n",
+                                     (int)strlen(labels) - 1, labels, count);
+                }
+        }
+
+        write_format(&writer, "# HELP starcaller_request_duration_seconds Time spent in the "
+                              "handler, by route and status class\n"
+                              "# TYPE starcaller_request_duration_seconds histogram\n");
+        for (size_t route = 0; route < router->route_count; ++route) {
+                for (size_t status_class = 0; status_class < HTTP_METRICS_STATUS_CLASSES;
+                     ++status_class) {
+                        uint64_t count = 0;
+                        uint64_t sum = 0;
+                        memset(buckets, 0, sizeof(buckets));
+
+                        for (http_metrics_shard_t *shard = first; shard; shard = shard->next) {
+                                if (route < shard->route_count)
+                                        histogram_merge(&shard->routes[route].latency[status_class],
+                                                        buckets, &sum, &count);
+                        }
+
+                        if (0 == count)
+                                continue;
+
+                        char labels[HTTP_METRICS_MAX_LABELS_LENGTH];
+                        format_labels(labels, sizeof(labels), router->route_names[route],
+                                      status_class);
+                        write_histogram(&writer, "starcaller_request_duration_seconds", labels,
+                                        buckets, sum, count);
+                }
+        }
+
+        write_format(&writer, "# HELP starcaller_request_bytes_total Bytes of parsed requests, "
+                              "by route\n"
+                              "# TYPE starcaller_request_bytes_total counter\n");
+        for (size_t route = 0; route < router->route_count; ++route) {
+                uint64_t bytes_in = 0;
+                for (http_metrics_shard_t *shard = first; shard; shard = shard->next) {
+                        if (route < shard->route_count)
+                                bytes_in += atomic_load_explicit(&shard->routes[route].bytes_in,
+                                                                 memory_order_relaxed);
+                }
+
+                char labels[HTTP_METRICS_MAX_LABELS_LENGTH];
+                format_labels(labels, sizeof(labels), router->route_names[route],
+                              HTTP_METRICS_STATUS_CLASSES);
+                write_format(&writer, "starcaller_request_bytes_total{%.*s} %lu\n",
+                             (int)strlen(labels) - 1, labels, bytes_in);
+        }
+
+        write_format(&writer, "# HELP starcaller_response_body_bytes_total Bytes of response "
+                              "bodies, by route\n"
+                              "# TYPE starcaller_response_body_bytes_total counter\n");
+        for (size_t route = 0; route < router->route_count; ++route) {
+                uint64_t bytes_out = 0;
+                for (http_metrics_shard_t *shard = first; shard; shard = shard->next) {
+                        if (route < shard->route_count)
+                                bytes_out += atomic_load_explicit(&shard->routes[route].bytes_out,
+                                                                  memory_order_relaxed);
+                }
+
+                char labels[HTTP_METRICS_MAX_LABELS_LENGTH];
+                format_labels(labels, sizeof(labels), router->route_names[route],
+                              HTTP_METRICS_STATUS_CLASSES);
+                write_format(&writer, "starcaller_response_body_bytes_total{%.*s} %lu\n",
+                             (int)strlen(labels) - 1, labels, bytes_out);
+        }
+
+        uint64_t parse_failures = 0;
+        uint64_t wait_count = 0;
+        uint64_t wait_sum = 0;
+        memset(buckets, 0, sizeof(buckets));
+        for (http_metrics_shard_t *shard = first; shard; shard = shard->next) {
+                parse_failures +=
+                        atomic_load_explicit(&shard->parse_failures, memory_order_relaxed);
+                histogram_merge(&shard->queue_wait, buckets, &wait_sum, &wait_count);
+        }
+
+        write_format(&writer, "# HELP starcaller_parse_failures_total Requests which could not "
+                              "be parsed\n"
+                              "# TYPE starcaller_parse_failures_total counter\n"
+                              "starcaller_parse_failures_total %lu\n",
+                     parse_failures);
+
+        write_format(&writer, "# HELP starcaller_queue_wait_seconds Time requests spent waiting "
+                              "for a worker\n"
+                              "# TYPE starcaller_queue_wait_seconds histogram\n");
+        write_histogram(&writer, "starcaller_queue_wait_seconds", "", buckets, wait_sum,
+                        wait_count);
+
+        write_format(&writer, "# HELP starcaller_requests_shed_total Requests answered with 503 "
+                              "instead of being handled\n"
+                              "# TYPE starcaller_requests_shed_total counter\n"
+                              "starcaller_requests_shed_total{reason=\"queue_full\"} %lu\n"
+                              "starcaller_requests_shed_total{reason=\"queue_wait\"} %lu\n",
+                     stats->requests_shed_queue_full, stats->requests_shed_queue_wait);
+
+        write_format(&writer, "# HELP starcaller_requests_queued Requests waiting for a worker\n"
+                              "# TYPE starcaller_requests_queued gauge\n"
+                              "starcaller_requests_queued %lu\n",
+                     stats->requests_queued);
+
+        if (writer.failed) {
+                log_trace("Failed allocating metrics output");
+                free(writer.data);
+                return NULL;
+        }
+
+        *length = writer.length;
+        return writer.data;
+}
+
+static void write_histogram(metrics_writer_t *writer, const char *name, const char *labels,
+                            const uint64_t *buckets, uint64_t sum, uint64_t count)
+{
+        // Prometheus buckets are cumulative, so only every power of two is
+        // reported rather than each of the finer internal buckets
+        uint64_t cumulative = buckets[0];
+        for (unsigned int exponent = HTTP_HISTOGRAM_MIN_SHIFT;
+             exponent <= HTTP_HISTOGRAM_MAX_SHIFT; ++exponent) {
+                write_format(writer, "%s_bucket{%sle=\"%.12g\"} %lu\n", name, labels,
+                             (double)(UINT64_C(1) << exponent) / 1e9, cumulative);
+
+                if (exponent == HTTP_HISTOGRAM_MAX_SHIFT)
+                        break;
+
+                size_t first = 1 + (exponent - HTTP_HISTOGRAM_MIN_SHIFT) * HTTP_HISTOGRAM_SUB_COUNT;
+                for (size_t i = first; i < first + HTTP_HISTOGRAM_SUB_COUNT; ++i)
+                        cumulative += buckets[i];
+        }
+        write_format(writer, "%s_bucket{%sle=\"+Inf\"} %lu\n", name, labels, count);
+
+        // without the trailing comma, or the braces altogether
+        int labels_length = (int)strlen(labels) - 1;
+        if (labels_length > 0) {
+                write_format(writer, "%s_sum{%.*s} %.9f\n", name, labels_length, labels,
+                             (double)sum / 1e9);
+                write_format(writer, "%s_count{%.*s} %lu\n", name, labels_length, labels, count);
+        } else {
+                write_format(writer, "%s_sum %.9f\n", name, (double)sum / 1e9);
+                write_format(writer, "%s_count %lu\n", name, count);
+        }
+}
+
+static void format_labels(char *labels, size_t capacity, const char *route, size_t status_class)
+{
+        // room for the closing quote and comma, the code label and the NUL
+        const size_t reserved = sizeof("\",code=\"other\",");
+        size_t length = 0;
+
+        memcpy(labels, "route=\"", 7);
+        length += 7;
+        for (const char *c = route; *c && length + 2 < capacity - reserved; ++c) {
+                if (*c == '\\' || *c == '"') {
+                        labels[length++] = '\\';
+                        labels[length++] = *c;
+                } else if (*c == '\n') {
+                        labels[length++] = '\\';
+                        labels[length++] = 'n';
+                } else {
+                        labels[length++] = *c;
+                }
+        }
+
+        if (status_class >= HTTP_METRICS_STATUS_CLASSES)
+                snprintf(labels + length, capacity - length, "\",");
+        else if (status_class > 0)
+                snprintf(labels + length, capacity - length, "\",code=\"%zuxx\",", status_class);
+        else
+                snprintf(labels + length, capacity - length, "\",code=\"other\",");
+}
+
+static void write_format(metrics_writer_t *writer, const char *format, ...)
+{
+        if (writer->failed)
+                return;
+
+        while (true) {
+                va_list args;
+                va_start(args, format);
+                size_t available = writer->capacity - writer->length;
+                int written = vsnprintf(writer->data ? writer->data + writer->length : NULL,
+                                        available, format, args);
+                va_end(args);
+
+                if (written < 0) {
+                        writer->failed = true;
+                        return;
+                }
+
+                if ((size_t)written < available) {
+                        writer->length += (size_t)written;
+                        return;
+                }
+
+                size_t capacity = writer->capacity ? writer->capacity * 2 : 16384;
+                while (capacity - writer->length <= (size_t)written)
+                        capacity *= 2;
+
+                char *data = realloc(writer->data, capacity);
+                if (!data) {
+                        writer->failed = true;
+                        return;
+                }
+                writer->data = data;
+                writer->capacity = capacity;
+        }
+}
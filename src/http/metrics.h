@@ -0,0 +1,74 @@
+#ifndef STARCALLER_HTTP_METRICS_H
+#define STARCALLER_HTTP_METRICS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "http.h"
+
+/// Latencies below 2^MIN_SHIFT nanoseconds share the first bucket, ones of
+/// 2^MAX_SHIFT and above share the last
+#define HTTP_HISTOGRAM_MIN_SHIFT 8
+#define HTTP_HISTOGRAM_MAX_SHIFT 35
+/// Every power of two is split into 2^SUB_BITS buckets, which bounds the
+/// error of a recorded value to 1 / 2^SUB_BITS
+#define HTTP_HISTOGRAM_SUB_BITS 2
+#define HTTP_HISTOGRAM_BUCKETS                                                      \
+        (2 + (HTTP_HISTOGRAM_MAX_SHIFT - HTTP_HISTOGRAM_MIN_SHIFT)                  \
+                     * (1 << HTTP_HISTOGRAM_SUB_BITS))
+
+/// Responses are counted by status class, 1xx to 5xx, with anything else at 0
+#define HTTP_METRICS_STATUS_CLASSES 6
+
+/// Log-linear histogram of nanosecond values, after HdrHistogram. Every
+/// counter has a single writer, so recording is a plain load and store.
+typedef struct {
+        _Atomic uint64_t count;
+        _Atomic uint64_t sum;
+        _Atomic uint64_t buckets[HTTP_HISTOGRAM_BUCKETS];
+} http_histogram_t;
+
+typedef struct {
+        _Atomic uint64_t bytes_in;
+        _Atomic uint64_t bytes_out;
+        /// Handler latency, by status class
+        http_histogram_t latency[HTTP_METRICS_STATUS_CLASSES];
+} http_route_metrics_t;
+
+/// The counters one thread records into, merged with the other threads' only
+/// when the metrics are read
+typedef struct _HttpMetricsShard {
+        struct _HttpMetricsShard *next;
+        pthread_t thread;
+
+        _Atomic uint64_t parse_failures;
+        http_histogram_t queue_wait;
+
+        /// Routes known when the shard was created, later ones go unrecorded
+        size_t route_count;
+        http_route_metrics_t routes[];
+} http_metrics_shard_t;
+
+struct _HttpMetrics {
+        const http_router_t *router;
+        /// Only ever pushed to, each thread's shard lives as long as the metrics
+        _Atomic(http_metrics_shard_t *) shards;
+};
+
+http_metrics_t *http_metrics_new(const http_router_t *);
+void http_metrics_free(http_metrics_t *);
+
+/// Counts a handled request, with how long its handler took
+void http_metrics_record_response(http_metrics_t *, size_t, size_t, uint64_t, size_t);
+/// Counts the bytes of a parsed request against its route
+void http_metrics_record_request(http_metrics_t *, size_t, size_t);
+void http_metrics_record_queue_wait(http_metrics_t *, uint64_t);
+void http_metrics_record_parse_failure(http_metrics_t *);
+
+/// Merges every thread's counters into Prometheus text format. Returns a
+/// malloc()'d string and stores its length, or returns NULL.
+char *http_metrics_render(const http_metrics_t *, const server_stats_t *, size_t *);
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef STARCALLER_HTTP_PARSER_H
+#define STARCALLER_HTTP_PARSER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "http.h"
+
+typedef enum {
+        HTTP_PARSE_ERROR = -1,
+        HTTP_PARSE_NEED_MORE = 0,
+        HTTP_PARSE_COMPLETE = 1,
+} http_parse_status_t;
+
+typedef enum {
+        HTTP_PARSER_METHOD,
+        HTTP_PARSER_PATH,
+        HTTP_PARSER_VERSION,
+        HTTP_PARSER_REQUEST_LINE_LF,
+        HTTP_PARSER_HEADER_START,
+        HTTP_PARSER_HEADER_NAME,
+        HTTP_PARSER_HEADER_VALUE_START,
+        HTTP_PARSER_HEADER_VALUE,
+        HTTP_PARSER_HEADER_LF,
+        HTTP_PARSER_HEAD_END_LF,
+        HTTP_PARSER_BODY,
+        HTTP_PARSER_DONE,
+} http_parser_state_t;
+
+/// Offsets are relative to the start of the request rather than pointers, so
+/// a partially parsed request survives its buffer being moved
+typedef struct {
+        uint32_t start;
+        uint32_t length;
+} http_span_t;
+
+typedef struct {
+        http_span_t name;
+        http_span_t value;
+} http_header_span_t;
+
+typedef struct {
+        http_parser_state_t state;
+        /// Offset of the first byte which has not been looked at yet
+        size_t position;
+        /// Offset of the start of the token currently being scanned
+        size_t token_start;
+
+        http_span_t method;
+        http_span_t path;
+        http_span_t version;
+        http_header_span_t headers[HTTP_MAX_HEADERS];
+        size_t header_count;
+
+        size_t head_length;
+        size_t content_length;
+        bool has_content_length;
+        /// The body comes in chunks (`Transfer-Encoding: chunked`), which the
+        /// parser leaves to an `http_body_decoder_t`
+        bool is_chunked;
+        /// The client waits for a `100 Continue` before sending the body
+        bool expects_continue;
+} http_parser_t;
+
+typedef enum {
+        HTTP_CHUNK_SIZE,
+        HTTP_CHUNK_EXTENSION,
+        HTTP_CHUNK_SIZE_LF,
+        HTTP_CHUNK_DATA,
+        HTTP_CHUNK_DATA_CR,
+        HTTP_CHUNK_DATA_LF,
+        HTTP_CHUNK_TRAILER_START,
+        HTTP_CHUNK_TRAILER,
+        HTTP_CHUNK_TRAILER_LF,
+        HTTP_CHUNK_END_LF,
+        HTTP_CHUNK_DONE,
+} http_chunk_state_t;
+
+/// Takes the framing off a body which arrives in pieces, either the
+/// Content-Length bytes following the head or a chunked one, without ever
+/// holding on to any of it
+typedef struct {
+        bool is_chunked;
+        http_chunk_state_t state;
+        /// Bytes still to come of a Content-Length body, or of the current chunk
+        size_t remaining;
+        /// Digits of the chunk size read so far
+        size_t size_digits;
+        /// Body bytes decoded so far
+        size_t length;
+} http_body_decoder_t;
+
+/// Receives each run of decoded body bytes. A negative return stops decoding.
+typedef int (*http_body_sink_t)(void *, const char *, size_t);
+
+#define HTTP_SCAN_SET_SIZE 4
+
+/// Returns the first byte in [start, end) equal to any of the
+/// HTTP_SCAN_SET_SIZE bytes in the set (repeat bytes to match fewer), or NULL.
+/// Uses AVX2 or SSE4.2 when the CPU has them, picked once at runtime.
+const char *http_scan_find(const char *, const char *, const char *);
+
+/// Name of the scanning implementation in use, for diagnostics
+const char *http_scan_implementation(void);
+
+void http_parser_init(http_parser_t *);
+
+/// Continues parsing the request which starts at `data`, of which `length`
+/// bytes have been received so far. Bytes before the parser's position are
+/// never looked at again, and calling this on a complete request is a no-op.
+http_parse_status_t http_parser_execute(http_parser_t *, const char *, size_t);
+
+/// Fills in the request from a completely parsed one (or, for a body which is
+/// not in `data`, from one whose head is), pointing its fields into `data` and
+/// NUL-terminating them in place
+void http_parser_finish(const http_parser_t *, http_request_t *, char *);
+
+/// Starts decoding the body of the request whose head the parser has just
+/// completed
+void http_body_decoder_init(http_body_decoder_t *, const http_parser_t *);
+
+/// Decodes as much of the body as the bytes hold, handing its contents to the
+/// sink. Stops right after the end of the body, so anything behind it is left
+/// for the next request. Returns the number of bytes used, -1 for malformed
+/// chunk framing or -2 if the sink stopped decoding.
+ssize_t http_body_decode(http_body_decoder_t *, const char *, size_t, http_body_sink_t, void *);
+
+/// Whether the whole body has been decoded
+bool http_body_decoder_is_done(const http_body_decoder_t *);
+
+#endif
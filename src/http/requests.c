@@ -1,183 +1,369 @@
+#include "parser.h"
 
-#include "http.h"
-
-#include <stdlib.h>
 #include <string.h>
 
 #include "logger.h"
 #include "utils.h"
 
+// Each scan stops at the token's delimiter, but also at bytes which may never
+// appear inside that token, so validating them costs nothing extra
+static const char REQUEST_TOKEN_DELIMITERS[HTTP_SCAN_SET_SIZE] = { ' ', '\r', '\n', '\0' };
+static const char LINE_END_DELIMITERS[HTTP_SCAN_SET_SIZE] = { '\r', '\n', '\0', '\r' };
+static const char HEADER_NAME_DELIMITERS[HTTP_SCAN_SET_SIZE] = { ':', '\r', '\n', ' ' };
+
 /// Returns the following status:
-/// NULL - any failure
-/// ptr - pointer to the end of the request line
-static const char *parse_request_line(http_request_t *, const char *);
-
-/// Contrary to the common C standard - this function returns the following
-/// status codes:
-///     0 - failed to allocate headers array
-/// n < 0 - failed to allocate n-th header
-/// n > 0 - successfully parsed and allocated n headers
-static long parse_headers(char **, const char *);
-static unsigned count_headers_between(const char *, const char *);
-
-http_request_t *parse_http_request(const char *raw_request)
+///  0 - the header was recorded
+/// -1 - too many headers, or an invalid Content-Length or Transfer-Encoding
+static int finish_header(http_parser_t *, const char *, size_t);
+static int parse_content_length(http_parser_t *, const char *, http_span_t);
+/// Only `chunked` is understood; any other coding would leave the body in a
+/// form the handler cannot make sense of
+static int parse_transfer_encoding(http_parser_t *, const char *, http_span_t);
+
+static bool span_equals(const char *, http_span_t, const char *, size_t);
+
+static char *terminate_span(char *, http_span_t);
+static http_span_t make_span(size_t, size_t);
+
+void http_parser_init(http_parser_t *parser)
 {
-        if (!raw_request) {
-                log_trace("Received NULL HTTP request string");
-                return NULL;
-        }
+        parser->state = HTTP_PARSER_METHOD;
+        parser->position = 0;
+        parser->token_start = 0;
+        parser->header_count = 0;
+        parser->head_length = 0;
+        parser->content_length = 0;
+        parser->has_content_length = false;
+        parser->is_chunked = false;
+        parser->expects_continue = false;
+}
 
-        http_request_t *request = malloc(sizeof(http_request_t));
-        if (!request) {
-                log_trace("Failed to allocate memory for HTTP request");
-                return NULL;
-        }
+http_parse_status_t http_parser_execute(http_parser_t *parser, const char *data, size_t length)
+{
+        const char *end = data + length;
+
+        while (parser->position < length) {
+                const char *current = data + parser->position;
+                const char *found = NULL;
+
+                switch (parser->state) {
+                case HTTP_PARSER_METHOD:
+                case HTTP_PARSER_PATH:
+                        found = http_scan_find(current, end, REQUEST_TOKEN_DELIMITERS);
+                        if (!found) {
+                                parser->position = length;
+                                return HTTP_PARSE_NEED_MORE;
+                        }
+
+                        if (*found != ' ' || found == data + parser->token_start) {
+                                log_trace("Invalid HTTP request: malformed request line");
+                                return HTTP_PARSE_ERROR;
+                        }
+
+                        if (parser->state == HTTP_PARSER_METHOD) {
+                                parser->method = make_span(parser->token_start,
+                                                           (size_t)(found - data));
+                                parser->state = HTTP_PARSER_PATH;
+                        } else {
+                                parser->path = make_span(parser->token_start,
+                                                         (size_t)(found - data));
+                                parser->state = HTTP_PARSER_VERSION;
+                        }
+
+                        parser->position = (size_t)(found - data) + 1;
+                        parser->token_start = parser->position;
+                        break;
+
+                case HTTP_PARSER_VERSION:
+                        found = http_scan_find(current, end, LINE_END_DELIMITERS);
+                        if (!found) {
+                                parser->position = length;
+                                return HTTP_PARSE_NEED_MORE;
+                        }
+
+                        if (*found != '\r') {
+                                log_trace("Invalid HTTP request: malformed request line");
+                                return HTTP_PARSE_ERROR;
+                        }
+
+                        parser->version = make_span(parser->token_start, (size_t)(found - data));
+                        if (parser->version.length < 5 ||
+                            strncmp(data + parser->version.start, "HTTP/", 5) != 0) {
+                                log_trace("Invalid HTTP request: malformed version");
+                                return HTTP_PARSE_ERROR;
+                        }
+
+                        parser->position = (size_t)(found - data) + 1;
+                        parser->state = HTTP_PARSER_REQUEST_LINE_LF;
+                        break;
+
+                case HTTP_PARSER_REQUEST_LINE_LF:
+                case HTTP_PARSER_HEADER_LF:
+                        if (*current != '\n') {
+                                log_trace("Invalid HTTP request: bare CR");
+                                return HTTP_PARSE_ERROR;
+                        }
+
+                        parser->position++;
+                        parser->state = HTTP_PARSER_HEADER_START;
+                        break;
+
+                case HTTP_PARSER_HEADER_START:
+                        if (*current == '\r') {
+                                parser->position++;
+                                parser->state = HTTP_PARSER_HEAD_END_LF;
+                                break;
+                        }
+
+                        if (parser->header_count >= HTTP_MAX_HEADERS) {
+                                log_trace("Invalid HTTP request: more than %d headers",
+                                          HTTP_MAX_HEADERS);
+                                return HTTP_PARSE_ERROR;
+                        }
+
+                        parser->token_start = parser->position;
+                        parser->state = HTTP_PARSER_HEADER_NAME;
+                        break;
+
+                case HTTP_PARSER_HEADER_NAME:
+                        found = http_scan_find(current, end, HEADER_NAME_DELIMITERS);
+                        if (!found) {
+                                parser->position = length;
+                                return HTTP_PARSE_NEED_MORE;
+                        }
+
+                        if (*found != ':' || found == data + parser->token_start) {
+                                log_trace("Invalid HTTP request: malformed header line");
+                                return HTTP_PARSE_ERROR;
+                        }
+
+                        parser->headers[parser->header_count].name =
+                                make_span(parser->token_start, (size_t)(found - data));
+                        parser->position = (size_t)(found - data) + 1;
+                        parser->state = HTTP_PARSER_HEADER_VALUE_START;
+                        break;
+
+                case HTTP_PARSER_HEADER_VALUE_START:
+                        if (*current == ' ' || *current == '\t') {
+                                parser->position++;
+                                break;
+                        }
+
+                        parser->token_start = parser->position;
+                        parser->state = HTTP_PARSER_HEADER_VALUE;
+                        break;
 
-        const char *request_line_end = parse_request_line(request, raw_request);
-        if (!request_line_end)
-                goto free_request;
+                case HTTP_PARSER_HEADER_VALUE:
+                        found = http_scan_find(current, end, LINE_END_DELIMITERS);
+                        if (!found) {
+                                parser->position = length;
+                                return HTTP_PARSE_NEED_MORE;
+                        }
 
-        const char *headers_start = request_line_end + 2;
-        long headers_parsed = parse_headers(request->headers, headers_start);
-        if (0 == headers_parsed)
-                goto free_request_metafields;
+                        if (*found != '\r') {
+                                log_trace("Invalid HTTP request: bare LF or NUL in header value");
+                                return HTTP_PARSE_ERROR;
+                        }
+
+                        if (finish_header(parser, data, (size_t)(found - data)) < 0)
+                                return HTTP_PARSE_ERROR;
+
+                        parser->position = (size_t)(found - data) + 1;
+                        parser->state = HTTP_PARSER_HEADER_LF;
+                        break;
+
+                case HTTP_PARSER_HEAD_END_LF:
+                        if (*current != '\n') {
+                                log_trace("Invalid HTTP request: bare CR");
+                                return HTTP_PARSE_ERROR;
+                        }
+
+                        // with both, a proxy in front may have framed the body
+                        // differently, which is how requests get smuggled
+                        if (parser->is_chunked && parser->has_content_length) {
+                                log_trace("Invalid HTTP request: both Content-Length and "
+                                          "Transfer-Encoding");
+                                return HTTP_PARSE_ERROR;
+                        }
+
+                        parser->position++;
+                        parser->head_length = parser->position;
+
+                        // the end of the body has to be addressable, or the
+                        // request would wrap around into its own head
+                        if (parser->content_length > SIZE_MAX - parser->head_length) {
+                                log_trace("Invalid HTTP request: Content-Length out of range");
+                                return HTTP_PARSE_ERROR;
+                        }
+
+                        parser->state = parser->content_length > 0 || parser->is_chunked
+                                                ? HTTP_PARSER_BODY
+                                                : HTTP_PARSER_DONE;
+                        break;
+
+                case HTTP_PARSER_BODY:
+                case HTTP_PARSER_DONE:
+                        goto body;
+
+                default:
+                        return HTTP_PARSE_ERROR;
+                }
+        }
 
-        if (headers_parsed < 0) {
-                headers_parsed *= -1;
-                goto free_headers;
+body:
+        // a chunked body is never complete as far as the parser is concerned,
+        // it takes a decoder to find its end
+        if (parser->state == HTTP_PARSER_BODY && parser->is_chunked) {
+                parser->position = length;
+                return HTTP_PARSE_NEED_MORE;
         }
 
-        const char *body_start = strstr(raw_request, "\r\n\r\n");
-        if (body_start != NULL) {
-                // skip over the "\r\n\r\n"
-                body_start += 4;
-                if (*body_start != '\0')
-                        request->body = strdup(body_start);
+        if (parser->state == HTTP_PARSER_BODY) {
+                if (length - parser->head_length < parser->content_length) {
+                        parser->position = length;
+                        return HTTP_PARSE_NEED_MORE;
+                }
+
+                parser->position = parser->head_length + parser->content_length;
+                parser->state = HTTP_PARSER_DONE;
         }
 
-        return request;
+        return parser->state == HTTP_PARSER_DONE ? HTTP_PARSE_COMPLETE : HTTP_PARSE_NEED_MORE;
+}
 
-free_headers:
-        for (int i = 0; i < headers_parsed; ++i)
-                free(request->headers[i]);
+void http_parser_finish(const http_parser_t *parser, http_request_t *request, char *data)
+{
+        // every span is followed by its (already consumed) delimiter, so the
+        // fields can be NUL-terminated in place and still used as C strings
+        request->method_str = terminate_span(data, parser->method);
+        request->method_length = parser->method.length;
+        request->path = terminate_span(data, parser->path);
+        request->path_length = parser->path.length;
+        request->version = terminate_span(data, parser->version);
+        request->version_length = parser->version.length;
+        request->method = string_to_http_method(request->method_str);
 
-        free(request->headers);
+        request->header_count = parser->header_count;
+        for (size_t i = 0; i < parser->header_count; ++i) {
+                const http_header_span_t *span = &parser->headers[i];
+                http_header_t *header = &request->headers[i];
 
-free_request_metafields:
-        free(request->method_str);
-        free(request->path);
-        free(request->version);
+                header->name = terminate_span(data, span->name);
+                header->name_length = span->name.length;
+                header->value = terminate_span(data, span->value);
+                header->value_length = span->value.length;
+        }
 
-free_request:
-        free(request);
-        return NULL;
+        request->body_length = parser->content_length;
+        request->body = parser->content_length > 0 ? data + parser->head_length : NULL;
 }
 
-static const char *parse_request_line(http_request_t *request, const char *request_line)
+const char *http_request_get_header(const http_request_t *request, const char *name)
 {
-        const char *request_line_end = strstr(request_line, "\r\n");
-        if (!request_line_end)
+        if (!request || !name)
                 return NULL;
 
-        const char *method_start = request_line;
-        const char *method_end = strchr(method_start, ' ');
-        if (!method_end || method_end >= request_line_end) {
-                log_trace("Invalid HTTP request: missing method");
-                return NULL;
+        size_t name_length = strlen(name);
+        for (size_t i = 0; i < request->header_count; ++i) {
+                const http_header_t *header = &request->headers[i];
+                if (header->name_length == name_length &&
+                    strncasecmp(header->name, name, name_length) == 0)
+                        return header->value;
         }
 
-        const char *path_start = method_end + 1;
-        const char *path_end = strchr(path_start, ' ');
-        if (!path_end || path_end >= request_line_end) {
-                log_trace("Invalid HTTP request: missing path");
-                return NULL;
-        }
+        return NULL;
+}
 
-        const char *version_start = path_end + 1;
-        const char *version_end = request_line_end;
+static int finish_header(http_parser_t *parser, const char *data, size_t value_end)
+{
+        while (value_end > parser->token_start &&
+               (data[value_end - 1] == ' ' || data[value_end - 1] == '\t'))
+                value_end--;
 
-        size_t method_length = (size_t)(method_end - method_start);
-        size_t path_length = (size_t)(path_end - path_start);
-        size_t version_length = (size_t)(version_end - version_start);
+        http_header_span_t *header = &parser->headers[parser->header_count++];
+        header->value = make_span(parser->token_start, value_end);
 
-        request->method_str = strndup(method_start, method_length);
-        request->path = strndup(path_start, path_length);
-        request->version = strndup(version_start, version_length);
+        static const char CONTENT_LENGTH[] = "Content-Length";
+        if (span_equals(data, header->name, CONTENT_LENGTH, sizeof(CONTENT_LENGTH) - 1))
+                return parse_content_length(parser, data, header->value);
 
-        if (!request->method_str || !request->path || !request->version)
-                return NULL;
+        static const char TRANSFER_ENCODING[] = "Transfer-Encoding";
+        if (span_equals(data, header->name, TRANSFER_ENCODING, sizeof(TRANSFER_ENCODING) - 1))
+                return parse_transfer_encoding(parser, data, header->value);
 
-        request->method = string_to_http_method(request->method_str);
-        return request_line_end;
+        static const char EXPECT[] = "Expect";
+        static const char CONTINUE[] = "100-continue";
+        if (span_equals(data, header->name, EXPECT, sizeof(EXPECT) - 1) &&
+            span_equals(data, header->value, CONTINUE, sizeof(CONTINUE) - 1))
+                parser->expects_continue = true;
+
+        return 0;
 }
 
-static long parse_headers(char **headers, const char *headers_start)
+static int parse_content_length(http_parser_t *parser, const char *data, http_span_t value)
 {
-        const char *headers_end = strstr(headers_start, "\r\n\r\n");
-        if (!headers_end)
-                headers_end = headers_start + strlen(headers_start);
-
-        long header_count = count_headers_between(headers_start, headers_end);
-        headers = calloc((size_t)(header_count + 1), sizeof(char *));
-        if (!headers) {
-                log_trace("Failed to allocate HTTP headers");
-                return 0;
+        if (0 == value.length) {
+                log_trace("Invalid HTTP request: empty Content-Length");
+                return -1;
         }
 
-        const char *line = headers_start;
-        long header_idx = 0;
-
-        while (line < headers_end && header_idx < header_count) {
-                const char *header_line_end = strstr(line, "\r\n");
-                if (!header_line_end || header_line_end == line || header_line_end >= headers_end)
-                        break;
+        size_t content_length = 0;
+        for (size_t i = 0; i < value.length; ++i) {
+                char digit = data[value.start + i];
+                if (digit < '0' || digit > '9') {
+                        log_trace("Invalid HTTP request: non-numeric Content-Length");
+                        return -1;
+                }
 
-                headers[header_idx] = strndup(line, (size_t)(header_line_end - line));
-                if (!headers[header_idx]) {
-                        log_trace("Failed to allocate memory for HTTP header");
-                        return -header_idx;
+                if (content_length > (SIZE_MAX - 9) / 10) {
+                        log_trace("Invalid HTTP request: Content-Length out of range");
+                        return -1;
                 }
+                content_length = content_length * 10 + (size_t)(digit - '0');
+        }
 
-                header_idx++;
-                line = header_line_end + 2;
+        // differing duplicates are the classic request smuggling vector
+        if (parser->has_content_length && parser->content_length != content_length) {
+                log_trace("Invalid HTTP request: conflicting Content-Length headers");
+                return -1;
         }
 
-        return header_idx;
+        parser->content_length = content_length;
+        parser->has_content_length = true;
+        return 0;
 }
 
-static unsigned count_headers_between(const char *start, const char *end)
+static int parse_transfer_encoding(http_parser_t *parser, const char *data, http_span_t value)
 {
-        unsigned count = 0;
-        const char *line = start;
-
-        while (line < end) {
-                const char *line_end = strstr(line, "\r\n");
-                if (!line_end || line_end == line || line_end >= end)
-                        break;
+        static const char CHUNKED[] = "chunked";
+        if (!span_equals(data, value, CHUNKED, sizeof(CHUNKED) - 1)) {
+                log_trace("Invalid HTTP request: unsupported Transfer-Encoding %.*s",
+                          (int)value.length, data + value.start);
+                return -1;
+        }
 
-                count++;
-                line = line_end + 2;
+        if (parser->is_chunked) {
+                log_trace("Invalid HTTP request: repeated Transfer-Encoding");
+                return -1;
         }
-        return count;
+
+        parser->is_chunked = true;
+        return 0;
 }
 
-void free_http_request(http_request_t *request)
+static bool span_equals(const char *data, http_span_t span, const char *string, size_t length)
 {
-        if (!request) {
-                log_trace("Received NULL HTTP request to free");
-                return;
-        }
-
-        free(request->method_str);
-        free(request->path);
-        free(request->version);
-        free(request->body);
+        return span.length == length && strncasecmp(data + span.start, string, length) == 0;
+}
 
-        if (request->headers != NULL) {
-                for (int i = 0; request->headers[i]; ++i)
-                        free(request->headers[i]);
-                free(request->headers);
-        }
+static char *terminate_span(char *data, http_span_t span)
+{
+        data[span.start + span.length] = '\0';
+        return data + span.start;
+}
 
-        free(request);
+static http_span_t make_span(size_t start, size_t end)
+{
+        http_span_t span = { .start = (uint32_t)start, .length = (uint32_t)(end - start) };
+        return span;
 }
@@ -4,90 +4,126 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
 
 #include "http.h"
+#include "logger.h"
 
-static const char *get_status_text(size_t);
-
-static ssize_t write_string(int, const char *);
-static ssize_t write_status_line(int, size_t);
-static ssize_t write_headers(int, const http_response_t *);
-static ssize_t write_body(int, const char *);
-
-int write_http_response(int fd, const http_response_t *response)
-{
-        if (!response || fd < 0)
-                return -1;
-
-        if (write_status_line(fd, response->status_code) < 0)
-                return -2;
-
-        if (write_headers(fd, response) < 0)
-                return -3;
-
-        if (write_string(fd, "\r\n") < 0)
-                return -4;
+typedef struct {
+        char *cursor;
+        const char *end;
+} head_writer_t;
 
-        if (write_body(fd, response->body) < 0)
-                return -5;
+/// Heads are serialized into a reusable per-thread buffer instead of being
+/// written piecemeal, so a batch of responses costs a single writev()
+static _Thread_local char head_buffer[RESPONSE_HEAD_BUFFER_SIZE];
 
-        return 0;
-}
+static const char *get_status_text(size_t);
 
-static ssize_t write_string(int fd, const char *str)
+/// Returns the length of the serialized head, or -1 if it does not fit
+static ssize_t serialize_head(char *, size_t, const http_response_t *, http_response_meta_t);
+
+static bool append(head_writer_t *, const char *, size_t);
+static bool append_string(head_writer_t *, const char *);
+static bool append_number(head_writer_t *, size_t);
+static bool append_header(head_writer_t *, const char *);
+
+/// Client sockets are non-blocking, so a single writev() may be short or fail
+/// with EAGAIN. This keeps writing (waiting for POLLOUT when needed, until the
+/// deadline on the monotonic clock in milliseconds, or UINT64_MAX for none)
+/// until every iovec has been sent or a real error occurs.
+/// Returns the following status:
+///  0 - everything has been sent
+/// -1 - a socket error occurred
+/// -2 - the socket did not become writable in time
+static int writev_all(int, struct iovec *, size_t, uint64_t);
+static uint64_t monotonic_ms(void);
+
+int write_http_response(int fd, const http_response_t *response, http_response_meta_t meta,
+                        int timeout_ms)
 {
-        if (!str)
-                return 0;
-
-        return write(fd, str, strlen(str));
+        return write_http_responses(fd, &response, &meta, 1, timeout_ms);
 }
 
-static ssize_t write_status_line(int fd, size_t status_code)
+int write_http_responses(int fd, const http_response_t *const *responses,
+                         const http_response_meta_t *meta, size_t count, int timeout_ms)
 {
-        char status_line[256];
-        const char *status_text = get_status_text(status_code);
-
-        int len = snprintf(status_line, sizeof(status_line), "HTTP/1.1 %lu %s\r\n", status_code,
-                           status_text);
-        if (len < 0)
+        if (!responses || !meta || fd < 0)
                 return -1;
 
-        size_t unsigned_len = (size_t)len;
-        if (unsigned_len >= sizeof(status_line))
-                return -1;
+        // one deadline for the whole batch, so a client reading a byte at a
+        // time cannot stretch it by however many writes that takes
+        uint64_t deadline = timeout_ms < 0 ? UINT64_MAX : monotonic_ms() + (uint64_t)timeout_ms;
 
-        return write(fd, status_line, unsigned_len);
-}
+        struct iovec iov[RESPONSE_MAX_IOVECS];
 
-static ssize_t write_header(int fd, const char *header)
-{
-        if (write_string(fd, header) < 0)
-                return -1;
-        return write_string(fd, "\r\n");
-}
+        // whatever does not fit into the head buffer (or the iovecs) goes out
+        // in the next writev(), with the heads serialized from the front again
+        while (count > 0) {
+                size_t iov_count = 0;
+                ssize_t prepared = http_responses_prepare(head_buffer, iov, &iov_count,
+                                                          responses, meta, count);
+                if (prepared < 0)
+                        return (int)prepared;
 
-static ssize_t write_content_length_header(int fd, size_t content_length)
-{
-        char header[128];
-        int len = snprintf(header, sizeof(header), "Content-Length: %zu", content_length);
+                int res = writev_all(fd, iov, iov_count, deadline);
+                if (res < 0)
+                        return res == -2 ? -4 : -3;
 
-        if (len < 0 || (size_t)len >= sizeof(header))
-                return -1;
+                responses += prepared;
+                meta += prepared;
+                count -= (size_t)prepared;
+        }
 
-        return write_header(fd, header);
+        return 0;
 }
 
-static int write_custom_headers(int fd, char **headers)
+ssize_t http_responses_prepare(char *heads, struct iovec *iov, size_t *iov_count,
+                               const http_response_t *const *responses,
+                               const http_response_meta_t *meta, size_t count)
 {
-        if (!headers)
-                return 0;
+        if (!heads || !iov || !iov_count || !responses || !meta)
+                return -1;
+
+        size_t head_offset = 0;
+        size_t prepared = 0;
+        *iov_count = 0;
 
-        for (int i = 0; headers[i]; i++) {
-                if (write_header(fd, headers[i]) < 0)
+        for (; prepared < count; ++prepared) {
+                const http_response_t *response = responses[prepared];
+                if (!response)
                         return -1;
+
+                ssize_t head_length = -1;
+                if (*iov_count <= RESPONSE_MAX_IOVECS - 2)
+                        head_length = serialize_head(heads + head_offset,
+                                                     RESPONSE_HEAD_BUFFER_SIZE - head_offset,
+                                                     response, meta[prepared]);
+                if (head_length < 0)
+                        break;
+
+                iov[*iov_count].iov_base = heads + head_offset;
+                iov[*iov_count].iov_len = (size_t)head_length;
+                (*iov_count)++;
+                head_offset += (size_t)head_length;
+
+                if (response->body && response->body_length > 0 && !meta[prepared].is_head) {
+                        iov[*iov_count].iov_base = response->body;
+                        iov[*iov_count].iov_len = response->body_length;
+                        (*iov_count)++;
+                }
         }
 
-        return 0;
+        if (0 == prepared && count > 0) {
+                log_error("Response head exceeds %d bytes", RESPONSE_HEAD_BUFFER_SIZE);
+                return -2;
+        }
+
+        return (ssize_t)prepared;
 }
 
 static bool header_exists(char **headers, const char *header_name)
@@ -97,7 +133,8 @@ static bool header_exists(char **headers, const char *header_name)
 
         size_t name_len = strlen(header_name);
 
-        for (const char *header = headers[0]; header; header++) {
+        for (size_t i = 0; headers[i]; i++) {
+                const char *header = headers[i];
                 if (strncasecmp(header, header_name, name_len) == 0 && header[name_len] == ':')
                         return true;
         }
@@ -105,46 +142,150 @@ static bool header_exists(char **headers, const char *header_name)
         return false;
 }
 
-static int write_default_headers(int fd, char **headers)
+static ssize_t serialize_head(char *buffer, size_t capacity, const http_response_t *response,
+                              http_response_meta_t meta)
 {
-        if (!header_exists(headers, "Content-Type")) {
-                if (write_header(fd, "Content-Type: text/html; charset=utf-8") < 0)
-                        return -1;
+        head_writer_t writer = { .cursor = buffer, .end = buffer + capacity };
+        bool fits = true;
+
+        fits = fits && append_string(&writer, "HTTP/1.1 ");
+        fits = fits && append_number(&writer, response->status_code);
+        fits = fits && append(&writer, " ", 1);
+        fits = fits && append_string(&writer, get_status_text(response->status_code));
+        fits = fits && append(&writer, "\r\n", 2);
+
+        if (response->headers) {
+                for (size_t i = 0; fits && response->headers[i]; i++)
+                        fits = append_header(&writer, response->headers[i]);
         }
 
-        if (!header_exists(headers, "Connection")) {
-                if (write_header(fd, "Connection: close") < 0)
-                        return -1;
+        if (!header_exists(response->headers, "Content-Length")) {
+                size_t body_length = response->body ? response->body_length : 0;
+                fits = fits && append_string(&writer, "Content-Length: ");
+                fits = fits && append_number(&writer, body_length);
+                fits = fits && append(&writer, "\r\n", 2);
         }
 
-        return 0;
+        if (!header_exists(response->headers, "Content-Type"))
+                fits = fits && append_header(&writer, "Content-Type: text/html; charset=utf-8");
+
+        if (meta.allow && response->status_code == HTTP_METHOD_NOT_ALLOWED &&
+            !header_exists(response->headers, "Allow")) {
+                fits = fits && append_string(&writer, "Allow: ");
+                fits = fits && append_header(&writer, meta.allow);
+        }
+
+        if (!header_exists(response->headers, "Connection")) {
+                const char *connection = meta.keep_alive ? "Connection: keep-alive"
+                                                         : "Connection: close";
+                fits = fits && append_header(&writer, connection);
+        }
+
+        fits = fits && append(&writer, "\r\n", 2);
+
+        if (!fits)
+                return -1;
+
+        return writer.cursor - buffer;
+}
+
+static bool append(head_writer_t *writer, const char *data, size_t length)
+{
+        if ((size_t)(writer->end - writer->cursor) < length)
+                return false;
+
+        memcpy(writer->cursor, data, length);
+        writer->cursor += length;
+        return true;
+}
+
+static bool append_string(head_writer_t *writer, const char *str)
+{
+        return append(writer, str, strlen(str));
+}
+
+static bool append_number(head_writer_t *writer, size_t number)
+{
+        char digits[20];
+        size_t count = 0;
+
+        do {
+                digits[sizeof(digits) - ++count] = (char)('0' + number % 10);
+                number /= 10;
+        } while (number > 0);
+
+        return append(writer, digits + sizeof(digits) - count, count);
 }
 
-static ssize_t write_headers(int fd, const http_response_t *response)
+static bool append_header(head_writer_t *writer, const char *header)
 {
-        size_t body_len = response->body ? strlen(response->body) : 0;
+        return append_string(writer, header) && append(writer, "\r\n", 2);
+}
 
-        if (write_custom_headers(fd, response->headers) < 0)
+int http_iov_write(int fd, struct iovec **iov, size_t *iov_count)
+{
+        if (!iov || !*iov || !iov_count || fd < 0)
                 return -1;
 
-        if (!header_exists(response->headers, "Content-Length")) {
-                if (write_content_length_header(fd, body_len) < 0) {
+        while (*iov_count > 0) {
+                ssize_t written = writev(fd, *iov, (int)*iov_count);
+                if (written < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                return 0;
                         return -1;
                 }
-        }
 
-        if (write_default_headers(fd, response->headers) < 0)
-                return -1;
+                // skip over whatever has been sent, possibly stopping in the
+                // middle of an iovec
+                size_t remaining = (size_t)written;
+                while (*iov_count > 0 && remaining >= (*iov)->iov_len) {
+                        remaining -= (*iov)->iov_len;
+                        (*iov)++;
+                        (*iov_count)--;
+                }
+
+                if (*iov_count > 0) {
+                        (*iov)->iov_base = (char *)(*iov)->iov_base + remaining;
+                        (*iov)->iov_len -= remaining;
+                }
+        }
 
         return 0;
 }
 
-static ssize_t write_body(int fd, const char *body)
+static int writev_all(int fd, struct iovec *iov, size_t iov_count, uint64_t deadline)
 {
-        if (!body)
-                return 0;
+        while (1) {
+                if (http_iov_write(fd, &iov, &iov_count) < 0)
+                        return -1;
+                if (0 == iov_count)
+                        return 0;
+
+                int timeout_ms = -1;
+                if (deadline != UINT64_MAX) {
+                        uint64_t now = monotonic_ms();
+                        if (now >= deadline)
+                                return -2;
+                        timeout_ms = deadline - now > INT32_MAX ? INT32_MAX
+                                                                : (int)(deadline - now);
+                }
 
-        return write_string(fd, body);
+                struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+                int ready = poll(&pfd, 1, timeout_ms);
+                if (ready < 0 && errno != EINTR)
+                        return -1;
+                if (ready == 0)
+                        return -2;
+        }
+}
+
+static uint64_t monotonic_ms(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
 }
 
 static const char *get_status_text(size_t status_code)
@@ -174,8 +315,12 @@ static const char *get_status_text(size_t status_code)
                 return "Method Not Allowed";
         case 409:
                 return "Conflict";
+        case 413:
+                return "Payload Too Large";
         case 422:
                 return "Unprocessable Entity";
+        case 431:
+                return "Request Header Fields Too Large";
         case 500:
                 return "Internal Server Error";
         case 501:
@@ -6,15 +6,39 @@
 #include <errno.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "logger.h"
 #include "utils.h"
 
-static const size_t DEFAULT_ROUTE_CAPACITY = 8;
-
-static int url_router_init(url_router_t *);
-static void url_router_free(url_router_t *);
-static int url_router_add_entry(url_router_t *, const char *, http_handler_t);
-static http_handler_t *url_router_get_handler(url_router_t *, const char *);
+static http_route_node_t *route_node_new(const char *, size_t);
+static void route_node_free(http_route_node_t *);
+static int route_node_insert(http_route_node_t *, const char *, http_method_t, http_handler_t,
+                             http_body_handler_t, size_t);
+
+/// Walks (and extends where needed) the static part of the tree along the
+/// given label, splitting nodes on partial matches. Returns the node at the
+/// end of the label, or NULL on allocation failure.
+static http_route_node_t *route_node_insert_static(http_route_node_t *, const char *, size_t);
+static http_route_node_t *route_node_insert_param(http_route_node_t *, const char *, size_t);
+static http_route_node_t *route_node_insert_wildcard(http_route_node_t *, const char *);
+static int route_node_set_handler(http_route_node_t *, http_method_t, http_handler_t,
+                                  http_body_handler_t, size_t);
+static int route_node_split(http_route_node_t *, size_t);
+static int route_node_add_child(http_route_node_t *, http_route_node_t *);
+static http_route_node_t *route_node_find_child(const http_route_node_t *, char);
+
+/// Returns the node whose route matches the path and has a handler for the
+/// method. Static children take precedence over a parameter, which takes
+/// precedence over a wildcard. The first node matching the path under other
+/// methods only is stored in the last argument, so a miss can still tell 405
+/// from 404. On a miss the captured parameters are left as they were.
+static const http_route_node_t *route_node_match(const http_route_node_t *, const char *, size_t,
+                                                 http_method_t, http_request_t *,
+                                                 const http_route_node_t **);
+static void capture_param(http_request_t *, const http_route_node_t *, const char *, size_t);
+
+/// Appends "METHOD /pattern" to the router's route names, returning its id
+static int router_add_route_name(http_router_t *, const char *, const char *, size_t *);
 
 static http_response_t *default_404_handler(const http_request_t *);
 static http_response_t *default_405_handler(const http_request_t *);
@@ -29,23 +53,23 @@ http_router_t *http_router_new(void)
 
         router->not_found_handler = default_404_handler;
         router->method_not_allowed_handler = default_405_handler;
+        router->route_names = NULL;
+        router->route_count = 0;
 
-        size_t method = 0;
-        for (; method < HTTP_METHOD_COUNT; ++method) {
-                url_router_t *current_router = &router->methods[method];
-                if (url_router_init(current_router) != 0) {
-                        goto error;
-                }
+        router->root = route_node_new("", 0);
+        if (!router->root) {
+                free(router);
+                return NULL;
         }
 
-        return router;
-
-error:
-        for (size_t i = 0; i < method; i++) {
-                url_router_free(&router->methods[i]);
+        size_t route;
+        if (router_add_route_name(router, "", "(not found)", &route) != 0 ||
+            router_add_route_name(router, "", "(method not allowed)", &route) != 0) {
+                http_router_free(router);
+                return NULL;
         }
-        free(router);
-        return NULL;
+
+        return router;
 }
 
 void http_router_free(http_router_t *router)
@@ -55,25 +79,67 @@ void http_router_free(http_router_t *router)
                 return;
         }
 
-        for (size_t i = 0; i < HTTP_METHOD_COUNT; i++) {
-                url_router_free(&router->methods[i]);
-        }
+        route_node_free(router->root);
+        for (size_t i = 0; i < router->route_count; ++i)
+                free(router->route_names[i]);
+        free(router->route_names);
         free(router);
 }
 
 int http_router_add_route(http_router_t *router, http_method_t method, const char *path,
                           http_handler_t handler)
+{
+        return http_router_add_streaming_route(router, method, path, handler, NULL);
+}
+
+int http_router_add_streaming_route(http_router_t *router, http_method_t method, const char *path,
+                                    http_handler_t handler, http_body_handler_t body_handler)
 {
         if (!router || !path || !handler) {
                 log_trace("Invalid arguments to router_add_route");
                 return -1;
         }
 
-        url_router_t *method_routes = &router->methods[method];
+        if (method < 0 || method >= HTTP_METHOD_COUNT) {
+                log_trace("Invalid HTTP method: %u", method);
+                return -1;
+        }
 
-        if (url_router_add_entry(method_routes, path, handler) != 0)
+        size_t route;
+        if (router_add_route_name(router, http_method_to_string(method), path, &route) != 0)
                 return -1;
 
+        if (route_node_insert(router->root, path, method, handler, body_handler, route) != 0) {
+                // the name was the last one added, so dropping it keeps the
+                // ids dense
+                free(router->route_names[--router->route_count]);
+                return -1;
+        }
+
+        return 0;
+}
+
+static int router_add_route_name(http_router_t *router, const char *method, const char *path,
+                                 size_t *route)
+{
+        char **names = realloc(router->route_names,
+                               (router->route_count + 1) * sizeof(router->route_names[0]));
+        if (!names) {
+                log_trace("Failed allocating route names");
+                return -1;
+        }
+        router->route_names = names;
+
+        size_t length = strlen(method) + strlen(path) + 2;
+        char *name = malloc(length);
+        if (!name) {
+                log_trace("Failed allocating route name");
+                return -1;
+        }
+        snprintf(name, length, "%s%s%s", method, *method ? " " : "", path);
+
+        *route = router->route_count;
+        router->route_names[router->route_count++] = name;
         return 0;
 }
 
@@ -91,43 +157,112 @@ void http_router_set_405_handler(http_router_t *router, http_handler_t handler)
 
 http_response_t *create_response(size_t status_code, const char *body)
 {
-        http_response_t *response = malloc(sizeof(http_response_t));
-        if (!response) {
+        http_arena_t *arena = http_arena_current();
+        if (!arena) {
+                http_response_t *response = malloc(sizeof(http_response_t));
+                if (!response) {
+                        log_trace("Failled allocating HTTP response");
+                        return NULL;
+                }
+
+                response->status_code = status_code;
+                response->body = body ? strdup(body) : NULL;
+                response->body_length = response->body ? strlen(response->body) : 0;
+                response->headers = NULL;
+                response->arena = NULL;
+
+                return response;
+        }
+
+        size_t body_length = body ? strlen(body) : 0;
+        http_response_t *response = http_arena_alloc(arena, sizeof(http_response_t));
+        char *body_copy = body ? http_arena_alloc(arena, body_length + 1) : NULL;
+        if (!response || (body && !body_copy)) {
                 log_trace("Failled allocating HTTP response");
                 return NULL;
         }
 
+        if (body_copy)
+                memcpy(body_copy, body, body_length + 1);
+
         response->status_code = status_code;
-        response->body = body ? strdup(body) : NULL;
+        response->body = body_copy;
+        response->body_length = body_length;
         response->headers = NULL;
+        response->arena = arena;
 
         return response;
 }
 
-http_handler_t http_router_get_handler(http_router_t *router, http_method_t method,
-                                       const char *path)
+void *http_request_alloc(const http_request_t *request, size_t size)
 {
-        if (!router || !path) {
+        if (!request)
+                return NULL;
+
+        return http_arena_alloc(request->arena, size);
+}
+
+http_route_match_t http_router_get_handler(http_router_t *router, http_request_t *request)
+{
+        http_route_match_t match = {
+                .handler = default_404_handler,
+                .body_handler = NULL,
+                .allow = NULL,
+                .route = HTTP_ROUTE_NOT_FOUND,
+        };
+
+        if (!router || !request || !request->path) {
                 log_trace("Invalid arguments to http_router_get_handler");
-                return default_404_handler;
+                return match;
         }
 
-        if (method < 0 || method >= HTTP_METHOD_COUNT) {
-                log_trace("Invalid HTTP method: %u", method);
-                return default_405_handler;
+        // the query string takes no part in routing
+        const char *query = memchr(request->path, '?', request->path_length);
+        size_t path_length = query ? (size_t)(query - request->path) : request->path_length;
+
+        request->param_count = 0;
+
+        const http_route_node_t *other_methods = NULL;
+        const http_route_node_t *node = route_node_match(router->root, request->path, path_length,
+                                                         request->method, request, &other_methods);
+        if (node) {
+                match.handler = node->handlers[request->method];
+                match.body_handler = node->body_handlers[request->method];
+                match.route = node->route_ids[request->method];
+                return match;
         }
 
-        url_router_t *url_router = &router->methods[method];
-        http_handler_t *handler = url_router_get_handler(url_router, path);
-        if (!handler) {
-                // Technically, it is possible to go over all the existing routes in
-                // order to find if such path exists, but under a different HTTP method,
-                // so we can return 405, but with the current design this would be
-                // highly inefficient
+        request->param_count = 0;
 
-                return router->not_found_handler;
+        if (other_methods) {
+                match.handler = router->method_not_allowed_handler;
+                match.allow = other_methods->allow;
+                match.route = HTTP_ROUTE_METHOD_NOT_ALLOWED;
+        } else {
+                match.handler = router->not_found_handler;
         }
-        return *handler;
+
+        return match;
+}
+
+const char *http_request_get_param(const http_request_t *request, const char *name,
+                                   size_t *length)
+{
+        if (!request || !name)
+                return NULL;
+
+        size_t name_length = strlen(name);
+        for (size_t i = 0; i < request->param_count; ++i) {
+                const http_param_t *param = &request->params[i];
+                if (param->name_length == name_length &&
+                    memcmp(param->name, name, name_length) == 0) {
+                        if (length)
+                                *length = param->value_length;
+                        return param->value;
+                }
+        }
+
+        return NULL;
 }
 
 void http_response_free(http_response_t *response)
@@ -135,98 +270,373 @@ void http_response_free(http_response_t *response)
         if (!response)
                 return;
 
-        free(response->body);
+        // whatever lives in the arena goes away with it, but handlers may
+        // still have hung heap memory on an arena response
+        http_arena_t *arena = response->arena;
+
+        if (!http_arena_owns(arena, response->body))
+                free(response->body);
 
         if (response->headers) {
                 for (int i = 0; response->headers[i]; i++) {
-                        free(response->headers[i]);
+                        if (!http_arena_owns(arena, response->headers[i]))
+                                free(response->headers[i]);
                 }
-                free(response->headers);
+                if (!http_arena_owns(arena, response->headers))
+                        free(response->headers);
         }
 
-        free(response);
+        if (!arena)
+                free(response);
 }
-static int url_router_init(url_router_t *router)
+
+static http_route_node_t *route_node_new(const char *label, size_t label_length)
 {
-        if (!router) {
-                log_trace("Initializing a NULL URL router");
-                return -1;
+        http_route_node_t *node = calloc(1, sizeof(http_route_node_t));
+        if (!node) {
+                log_trace("Failed allocating route node");
+                return NULL;
         }
 
-        router->count = 0;
-        router->capacity = DEFAULT_ROUTE_CAPACITY;
-        router->routes = calloc(DEFAULT_ROUTE_CAPACITY, sizeof(url_route_entry_t));
-        if (!router->routes) {
-                log_trace("Failed to allocate URL router routes");
-                return -3;
+        node->label = strndup(label, label_length);
+        if (!node->label) {
+                log_trace("Failed allocating route node label");
+                free(node);
+                return NULL;
         }
-        return 0;
+        node->label_length = label_length;
+
+        return node;
 }
 
-static void url_router_free(url_router_t *router)
+static void route_node_free(http_route_node_t *node)
 {
-        if (!router) {
-                log_trace("Freeing a NULL URL router");
+        if (!node)
                 return;
+
+        for (size_t i = 0; i < node->child_count; ++i)
+                route_node_free(node->children[i]);
+
+        route_node_free(node->param_child);
+        route_node_free(node->wildcard_child);
+
+        free(node->children);
+        free(node->allow);
+        free(node->param_name);
+        free(node->label);
+        free(node);
+}
+
+static int route_node_insert(http_route_node_t *node, const char *pattern, http_method_t method,
+                             http_handler_t handler, http_body_handler_t body_handler,
+                             size_t route)
+{
+        const char *cursor = pattern;
+
+        while (*cursor) {
+                // parameters and wildcards are only recognized at the start of
+                // a path segment
+                bool is_segment_start = cursor > pattern && cursor[-1] == '/';
+
+                if (is_segment_start && *cursor == ':') {
+                        const char *name = cursor + 1;
+                        const char *name_end = strchrnul(name, '/');
+
+                        node = route_node_insert_param(node, name, (size_t)(name_end - name));
+                        if (!node)
+                                return -2;
+
+                        cursor = name_end;
+                        continue;
+                }
+
+                if (is_segment_start && *cursor == '*') {
+                        node = route_node_insert_wildcard(node, cursor + 1);
+                        if (!node)
+                                return -5;
+                        break;
+                }
+
+                const char *run_end = cursor + 1;
+                while (*run_end && !(run_end[-1] == '/' && (*run_end == ':' || *run_end == '*')))
+                        run_end++;
+
+                node = route_node_insert_static(node, cursor, (size_t)(run_end - cursor));
+                if (!node)
+                        return -3;
+
+                cursor = run_end;
         }
 
-        for (size_t i = 0; i < router->count; i++) {
-                free(router->routes[i].path);
+        if (node->methods & (1u << method)) {
+                log_trace("Route %s %s is already registered", http_method_to_string(method),
+                          pattern);
+                return -4;
         }
-        free(router->routes);
 
-        router->routes = NULL;
-        router->count = 0;
-        router->capacity = 0;
+        return route_node_set_handler(node, method, handler, body_handler, route);
 }
 
-static int url_router_add_entry(url_router_t *router, const char *url, http_handler_t handler)
+static http_route_node_t *route_node_insert_static(http_route_node_t *node, const char *label,
+                                                   size_t length)
 {
-        if (!router || !url || !handler) {
-                log_trace("Invalid arguments to url_router_add_entry()");
-                return -1;
+        while (length > 0) {
+                http_route_node_t *child = route_node_find_child(node, label[0]);
+                if (!child) {
+                        child = route_node_new(label, length);
+                        if (!child)
+                                return NULL;
+
+                        if (route_node_add_child(node, child) != 0) {
+                                route_node_free(child);
+                                return NULL;
+                        }
+                        return child;
+                }
+
+                size_t common = 0;
+                while (common < child->label_length && common < length &&
+                       child->label[common] == label[common])
+                        common++;
+
+                if (common < child->label_length && route_node_split(child, common) != 0)
+                        return NULL;
+
+                node = child;
+                label += common;
+                length -= common;
         }
 
-        if (router->count >= router->capacity) {
-                size_t new_capacity = router->capacity * 2;
-                url_route_entry_t *new_routes =
-                        realloc(router->routes, new_capacity * sizeof(url_route_entry_t));
+        return node;
+}
 
-                if (!new_routes) {
-                        log_trace("Failed reallocating URL router");
-                        return -2;
+static http_route_node_t *route_node_insert_param(http_route_node_t *node, const char *name,
+                                                  size_t name_length)
+{
+        if (0 == name_length) {
+                log_trace("Route parameter without a name");
+                return NULL;
+        }
+
+        http_route_node_t *param = node->param_child;
+        if (param) {
+                // a segment can only ever be captured under one name, otherwise
+                // lookups would depend on registration order
+                if (param->param_name_length != name_length ||
+                    memcmp(param->param_name, name, name_length) != 0) {
+                        log_trace("Conflicting route parameter names");
+                        return NULL;
                 }
+                return param;
+        }
 
-                router->routes = new_routes;
-                router->capacity = new_capacity;
+        param = route_node_new("", 0);
+        if (!param)
+                return NULL;
 
-                memset(&router->routes[router->count], 0,
-                       (new_capacity - router->count) * sizeof(url_route_entry_t));
+        param->param_name = strndup(name, name_length);
+        if (!param->param_name) {
+                route_node_free(param);
+                return NULL;
+        }
+        param->param_name_length = name_length;
+
+        node->param_child = param;
+        return param;
+}
+
+static http_route_node_t *route_node_insert_wildcard(http_route_node_t *node, const char *name)
+{
+        if (strchr(name, '/')) {
+                log_trace("Route wildcards are only allowed as the last segment");
+                return NULL;
+        }
+
+        // an unnamed wildcard is captured as "*"
+        if (*name == '\0')
+                name = "*";
+
+        http_route_node_t *wildcard = node->wildcard_child;
+        if (wildcard) {
+                if (strcmp(wildcard->param_name, name) != 0) {
+                        log_trace("Conflicting route wildcard names");
+                        return NULL;
+                }
+                return wildcard;
         }
 
-        url_route_entry_t *entry = &router->routes[router->count++];
-        entry->path = strdup(url);
-        entry->handler = handler;
+        wildcard = route_node_new("", 0);
+        if (!wildcard)
+                return NULL;
 
-        if (!entry->path) {
-                log_trace("Failed allocating URL route entry");
-                return -3;
+        wildcard->param_name = strdup(name);
+        if (!wildcard->param_name) {
+                route_node_free(wildcard);
+                return NULL;
         }
+        wildcard->param_name_length = strlen(name);
 
+        node->wildcard_child = wildcard;
+        return wildcard;
+}
+
+static int route_node_set_handler(http_route_node_t *node, http_method_t method,
+                                  http_handler_t handler, http_body_handler_t body_handler,
+                                  size_t route)
+{
+        unsigned int methods = node->methods | (1u << method);
+
+        // longest possible value: every method name followed by ", "
+        char allow[HTTP_METHOD_COUNT * (sizeof("OPTIONS") + 1)];
+        size_t length = 0;
+        for (size_t i = 0; i < HTTP_METHOD_COUNT; ++i) {
+                if (!(methods & (1u << i)))
+                        continue;
+
+                const char *name = http_method_to_string((http_method_t)i);
+                size_t name_length = strlen(name);
+                if (length > 0) {
+                        memcpy(allow + length, ", ", 2);
+                        length += 2;
+                }
+                memcpy(allow + length, name, name_length);
+                length += name_length;
+        }
+
+        char *value = strndup(allow, length);
+        if (!value) {
+                log_trace("Failed allocating Allow header value");
+                return -6;
+        }
+
+        free(node->allow);
+        node->allow = value;
+        node->methods = methods;
+        node->handlers[method] = handler;
+        node->body_handlers[method] = body_handler;
+        node->route_ids[method] = route;
+        return 0;
+}
+
+static int route_node_split(http_route_node_t *node, size_t at)
+{
+        http_route_node_t *tail = route_node_new(node->label + at, node->label_length - at);
+        if (!tail)
+                return -1;
+
+        http_route_node_t **children = malloc(sizeof(http_route_node_t *));
+        if (!children) {
+                log_trace("Failed allocating route node children");
+                route_node_free(tail);
+                return -1;
+        }
+
+        // the node keeps the common prefix, everything it used to hold moves
+        // into its only child, labelled with the rest
+        char *tail_label = tail->label;
+        size_t tail_label_length = tail->label_length;
+        *tail = *node;
+        tail->label = tail_label;
+        tail->label_length = tail_label_length;
+
+        char *label = node->label;
+        *node = (http_route_node_t){ .label = label, .label_length = at };
+        node->label[at] = '\0';
+
+        children[0] = tail;
+        node->children = children;
+        node->child_count = 1;
+        return 0;
+}
+
+static int route_node_add_child(http_route_node_t *node, http_route_node_t *child)
+{
+        http_route_node_t **children =
+                realloc(node->children, (node->child_count + 1) * sizeof(http_route_node_t *));
+        if (!children) {
+                log_trace("Failed reallocating route node children");
+                return -1;
+        }
+
+        children[node->child_count++] = child;
+        node->children = children;
         return 0;
 }
 
-static http_handler_t *url_router_get_handler(url_router_t *router, const char *url)
+static http_route_node_t *route_node_find_child(const http_route_node_t *node, char first)
 {
-        for (size_t i = 0; i < router->count; ++i) {
-                url_route_entry_t *route = &router->routes[i];
-                if (strcmp(route->path, url) == 0) {
-                        return &route->handler;
+        for (size_t i = 0; i < node->child_count; ++i) {
+                if (node->children[i]->label[0] == first)
+                        return node->children[i];
+        }
+        return NULL;
+}
+
+static const http_route_node_t *route_node_match(const http_route_node_t *node, const char *path,
+                                                 size_t length, http_method_t method,
+                                                 http_request_t *request,
+                                                 const http_route_node_t **other_methods)
+{
+        // an unknown method never matches, but still makes an existing path a 405
+        unsigned int method_bit = method < HTTP_METHOD_COUNT ? 1u << method : 0;
+
+        if (0 == length) {
+                if (node->methods & method_bit)
+                        return node;
+                if (node->methods && !*other_methods)
+                        *other_methods = node;
+        } else {
+                const http_route_node_t *child = route_node_find_child(node, path[0]);
+                if (child && child->label_length <= length &&
+                    memcmp(child->label, path, child->label_length) == 0) {
+                        const http_route_node_t *found = route_node_match(
+                                child, path + child->label_length, length - child->label_length,
+                                method, request, other_methods);
+                        if (found)
+                                return found;
+                }
+
+                const char *segment_end = memchr(path, '/', length);
+                size_t segment_length = segment_end ? (size_t)(segment_end - path) : length;
+
+                if (node->param_child && segment_length > 0 &&
+                    request->param_count < HTTP_MAX_PARAMS) {
+                        capture_param(request, node->param_child, path, segment_length);
+
+                        const http_route_node_t *found = route_node_match(
+                                node->param_child, path + segment_length,
+                                length - segment_length, method, request, other_methods);
+                        if (found)
+                                return found;
+
+                        request->param_count--;
+                }
+        }
+
+        // a trailing wildcard also matches an empty remainder
+        const http_route_node_t *wildcard = node->wildcard_child;
+        if (wildcard && request->param_count < HTTP_MAX_PARAMS) {
+                if (wildcard->methods & method_bit) {
+                        capture_param(request, wildcard, path, length);
+                        return wildcard;
                 }
+                if (!*other_methods)
+                        *other_methods = wildcard;
         }
+
         return NULL;
 }
 
+static void capture_param(http_request_t *request, const http_route_node_t *node,
+                          const char *value, size_t value_length)
+{
+        http_param_t *param = &request->params[request->param_count++];
+        param->name = node->param_name;
+        param->name_length = node->param_name_length;
+        param->value = value;
+        param->value_length = value_length;
+}
+
 static http_response_t *default_404_handler(__unused const http_request_t *request)
 {
         return create_response(404, "Page not Found");
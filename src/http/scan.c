@@ -0,0 +1,123 @@
+#include "parser.h"
+
+#include <stdatomic.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_SCAN_X86 1
+#endif
+
+typedef const char *(*http_scan_fn_t)(const char *, const char *, const char *);
+
+static const char *scan_resolve(const char *, const char *, const char *);
+static const char *scan_scalar(const char *, const char *, const char *);
+
+#ifdef HTTP_SCAN_X86
+static const char *scan_sse42(const char *, const char *, const char *)
+        __attribute__((target("sse4.2")));
+static const char *scan_avx2(const char *, const char *, const char *)
+        __attribute__((target("avx2")));
+#endif
+
+// Starts out pointing at the resolver, which swaps in the best implementation
+// for the running CPU on first use. Racing resolvers all store the same value.
+static _Atomic(http_scan_fn_t) scan_implementation = scan_resolve;
+
+const char *http_scan_find(const char *start, const char *end, const char *set)
+{
+        http_scan_fn_t scan = atomic_load_explicit(&scan_implementation, memory_order_relaxed);
+        return scan(start, end, set);
+}
+
+const char *http_scan_implementation(void)
+{
+        http_scan_fn_t scan = atomic_load_explicit(&scan_implementation, memory_order_relaxed);
+#ifdef HTTP_SCAN_X86
+        if (scan == scan_avx2)
+                return "avx2";
+        if (scan == scan_sse42)
+                return "sse4.2";
+#endif
+        if (scan == scan_scalar)
+                return "scalar";
+        return "unresolved";
+}
+
+static const char *scan_resolve(const char *start, const char *end, const char *set)
+{
+        http_scan_fn_t scan = scan_scalar;
+
+#ifdef HTTP_SCAN_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+                scan = scan_avx2;
+        else if (__builtin_cpu_supports("sse4.2"))
+                scan = scan_sse42;
+#endif
+
+        atomic_store_explicit(&scan_implementation, scan, memory_order_relaxed);
+        return scan(start, end, set);
+}
+
+static const char *scan_scalar(const char *start, const char *end, const char *set)
+{
+        for (const char *current = start; current < end; ++current) {
+                char c = *current;
+                if (c == set[0] || c == set[1] || c == set[2] || c == set[3])
+                        return current;
+        }
+        return NULL;
+}
+
+#ifdef HTTP_SCAN_X86
+
+static const char *scan_sse42(const char *start, const char *end, const char *set)
+{
+        const __m128i needles = _mm_setr_epi8(set[0], set[1], set[2], set[3], 0, 0, 0, 0, 0, 0,
+                                              0, 0, 0, 0, 0, 0);
+
+        const char *current = start;
+        // full 16 byte blocks only, the loads must never run past `end`
+        while (end - current >= 16) {
+                __m128i block = _mm_loadu_si128((const __m128i *)(const void *)current);
+                int index = _mm_cmpestri(needles, HTTP_SCAN_SET_SIZE, block, 16,
+                                         _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+                                                 _SIDD_LEAST_SIGNIFICANT);
+                if (index < 16)
+                        return current + index;
+
+                current += 16;
+        }
+
+        return scan_scalar(current, end, set);
+}
+
+static const char *scan_avx2(const char *start, const char *end, const char *set)
+{
+        const __m256i first = _mm256_set1_epi8(set[0]);
+        const __m256i second = _mm256_set1_epi8(set[1]);
+        const __m256i third = _mm256_set1_epi8(set[2]);
+        const __m256i fourth = _mm256_set1_epi8(set[3]);
+
+        const char *current = start;
+        while (end - current >= 32) {
+                __m256i block = _mm256_loadu_si256((const __m256i *)(const void *)current);
+                __m256i matches = _mm256_or_si256(
+                        _mm256_or_si256(_mm256_cmpeq_epi8(block, first),
+                                        _mm256_cmpeq_epi8(block, second)),
+                        _mm256_or_si256(_mm256_cmpeq_epi8(block, third),
+                                        _mm256_cmpeq_epi8(block, fourth)));
+
+                unsigned mask = (unsigned)_mm256_movemask_epi8(matches);
+                if (mask)
+                        return current + __builtin_ctz(mask);
+
+                current += 32;
+        }
+
+        // the tail is still worth one 16 byte step before going bytewise
+        return scan_sse42(current, end, set);
+}
+
+#endif
@@ -7,89 +7,569 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <arpa/inet.h>
 #include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
 
+#include "arena.h"
+#include "connection.h"
+#include "metrics.h"
 #include "utils.h"
 #include "logger.h"
 #include "threadpool.h"
 
 static const int FAST_RESTART = true;
-#define BUFFER_SIZE 16384
 
-static void handle_client(server_t *, int);
+/// Decides whether the connection should persist after this request, based
+/// on the protocol version and the client's `Connection` header
+static bool request_wants_keep_alive(const http_request_t *);
+
+/// Routes the request finished into the slot and sets the slot up to be
+/// handled. Returns whether the connection persists past the request.
+static bool pipeline_prepare(server_t *, http_connection_t *, http_pipeline_slot_t *);
+
+/// Hands the first `count` slots, taking up `consumed` bytes of the buffer,
+/// to the thread pool (or sheds them)
+static void pipeline_start(server_t *, http_connection_t *, size_t, size_t, bool);
+
+/// Sets up receiving the body of the request at the front of the buffer, or
+/// answers it right away with 413 when it is too large to be worth reading.
+/// Returns -1 if the connection has been dealt with.
+static int body_begin(server_t *, http_connection_t *);
+/// Dispatches the request once its body is in, or has stopped coming in
+/// because it was refused, in which case the connection ends with it
+static void body_finish(server_t *, http_connection_t *, bool, size_t);
+
+/// Sinks for `http_body_decode()`, collecting the body into the slot's heap
+/// buffer (up to `max_body_size`) or passing it to the route's body handler
+static int body_collect(void *, const char *, size_t);
+static int body_stream(void *, const char *, size_t);
+
+/// Stores the response for the given pipeline slot and, unless another
+/// worker is already doing so, writes out every response that is next in line
+static void pipeline_complete(http_connection_t *, size_t, http_response_t *);
+
+/// Writes out every response that is next in line. Runs as the connection's
+/// writer with the pipeline lock held, which it releases. When the loop sends
+/// the responses (or the rest of a batch the socket did not take at once), it
+/// returns as soon as they are handed over, and picks up again in
+/// `server_pipeline_sent()`.
+static void pipeline_flush(http_connection_t *);
+
+/// Frees the responses (and arenas) of the slots in the range once written
+static void pipeline_release(http_connection_t *, size_t, size_t);
+
+/// Answers the request in the given slot with the server's shared 503
+static void pipeline_shed(server_t *, http_connection_t *, size_t);
+
+/// Creates a non-blocking socket listening on the server's port, or returns -1
+static int server_listen(const server_t *, bool);
+static void *server_run_shard(void *);
+
+/// Serves the route configured as `metrics_path`
+static http_response_t *metrics_handler(const http_request_t *);
+/// Answers a request whose body is larger than `max_body_size`
+static http_response_t *payload_too_large_handler(const http_request_t *);
+
+/// The server whose request is being handled on this thread, which is how the
+/// built-in handlers, taking nothing but the request, get to it
+static _Thread_local server_t *current_server = NULL;
+
+static void worker_handle_request(void *raw_slot)
+{
+        http_pipeline_slot_t *slot = (http_pipeline_slot_t *)raw_slot;
+        http_connection_t *connection = slot->connection;
+        server_t *server = connection->loop->server;
+        size_t index = (size_t)(slot - connection->pipeline);
+
+        atomic_fetch_sub_explicit(&server->requests_queued, 1, memory_order_relaxed);
+
+        uint64_t started = event_loop_now_ns();
+        uint64_t queue_wait = started - slot->queued_at;
+        if (server->metrics)
+                http_metrics_record_queue_wait(server->metrics, queue_wait);
+
+        // by now the client may well have given up on the request, so there is
+        // no point spending a handler on it while the backlog keeps growing
+        if (queue_wait > (uint64_t)server->max_queue_wait_ms * 1000000) {
+                atomic_fetch_add_explicit(&server->requests_shed_queue_wait, 1,
+                                          memory_order_relaxed);
+                pipeline_shed(server, connection, index);
+                return;
+        }
 
-typedef struct {
-        http_handler_t handler;
-        http_request_t *request;
-        int client_fd;
-} http_handler_args_t;
+        // without an arena, responses simply come from the heap; a streaming
+        // route has had one since its body started coming in
+        if (!slot->arena)
+                slot->arena = http_arena_acquire();
+        slot->request.arena = slot->arena;
+
+        http_arena_set_current(slot->arena);
+        current_server = server;
+        http_response_t *response = slot->handler(&slot->request);
+        current_server = NULL;
+        http_arena_set_current(NULL);
+
+        if (!response)
+                log_warn("Handler returned NULL response");
 
-static http_handler_args_t *http_handler_args_new(http_handler_t handler, http_request_t *request,
-                                                  int client_fd)
+        if (server->metrics)
+                http_metrics_record_response(server->metrics, slot->route,
+                                             response ? response->status_code
+                                                      : HTTP_INTERNAL_SERVER_ERROR,
+                                             event_loop_now_ns() - started,
+                                             response ? response->body_length : 0);
+
+        pipeline_complete(connection, index, response);
+}
+
+void server_dispatch_requests(server_t *server, http_connection_t *connection)
 {
-        http_handler_args_t *args = malloc(sizeof(http_handler_args_t));
-        if (!args) {
-                log_trace("Failed allocating HTTP handler arguments");
-                return NULL;
+        size_t count = 0;
+        size_t offset = 0;
+        bool keep_alive = true;
+
+        while (keep_alive && count < CONNECTION_PIPELINE_DEPTH) {
+                char *request_start = connection->buffer + offset;
+
+                // the request at the front has already been completed by
+                // `connection_process()`, the parser only resumes on the ones
+                // behind it; an incomplete one stays in the parser until the
+                // batch is answered
+                http_parse_status_t status = http_parser_execute(
+                        &connection->parser, request_start, connection->length - offset);
+                if (status == HTTP_PARSE_NEED_MORE)
+                        break;
+
+                if (status == HTTP_PARSE_ERROR) {
+                        log_error("Failed to parse HTTP request");
+                        if (server->metrics)
+                                http_metrics_record_parse_failure(server->metrics);
+                        keep_alive = false;
+                        break;
+                }
+
+                size_t request_length = connection->parser.position;
+                log_trace("Received request:\n%.*s", (int)request_length, request_start);
+
+                // the body handed out below is a view into the buffer, so it
+                // has to lie within what was actually received
+                size_t head_length = connection->parser.head_length;
+                if (request_length > connection->length - offset || head_length > request_length ||
+                    connection->parser.content_length > request_length - head_length) {
+                        log_error("Request body overruns the buffer, dropping client (fd: %d)",
+                                  connection->fd);
+                        keep_alive = false;
+                        break;
+                }
+
+                // the previous batch has been answered in full before the
+                // connection came back, so every slot is free to reuse
+                http_pipeline_slot_t *slot = &connection->pipeline[count];
+                http_request_t *request = &slot->request;
+                http_parser_finish(&connection->parser, request, request_start);
+                http_parser_init(&connection->parser);
+
+                keep_alive = pipeline_prepare(server, connection, slot);
+
+                // the body is all in the buffer already, so a streaming route
+                // gets it in one piece
+                if (slot->body_handler) {
+                        slot->arena = http_arena_acquire();
+                        request->arena = slot->arena;
+                        if (request->body_length > 0 &&
+                            slot->body_handler(request, request->body, request->body_length) != 0)
+                                keep_alive = false;
+                        request->body = NULL;
+                } else if (request->body_length > server->max_body_size) {
+                        slot->handler = payload_too_large_handler;
+                        keep_alive = false;
+                }
+
+                if (server->metrics)
+                        http_metrics_record_request(server->metrics, slot->route,
+                                                    request_length);
+
+                count++;
+                offset += request_length;
         }
 
-        args->handler = handler;
-        args->request = request;
-        args->client_fd = client_fd;
+        if (0 == count) {
+                connection_close(connection);
+                return;
+        }
 
-        return args;
+        pipeline_start(server, connection, count, offset, keep_alive);
 }
 
-static void worker_handle_request(void *raw_args)
+// A body too large to wait for in the buffer as a whole is decoded out of it
+// as it arrives, while the head stays at the front for the request's fields
+// to point into. The request is dispatched on its own once the body is in;
+// whatever follows it is left for the next batch.
+int server_receive_body(server_t *server, http_connection_t *connection)
 {
-        http_handler_args_t *args = (http_handler_args_t *)raw_args;
-        http_response_t *response = args->handler(args->request);
-        if (!response) {
-                log_warn("Handler returned NULL response");
-                free(args->request);
-                free(args);
-                return;
+        if (!connection->is_receiving_body && body_begin(server, connection) < 0)
+                return 1;
+
+        http_pipeline_slot_t *slot = &connection->pipeline[0];
+        size_t head_length = connection->parser.head_length;
+
+        ssize_t used = http_body_decode(&connection->body, connection->buffer + head_length,
+                                        connection->length - head_length,
+                                        slot->body_handler ? body_stream : body_collect, slot);
+        if (-1 == used) {
+                log_error("Malformed request body, dropping client (fd: %d)", connection->fd);
+                if (server->metrics)
+                        http_metrics_record_parse_failure(server->metrics);
+                connection_close(connection);
+                return 1;
         }
 
-        int res = 0;
-        if ((res = write_http_response(args->client_fd, response)) < 0) {
-                log_error("Failed sending response to client - %d", res);
-                return;
+        if (used < 0) {
+                if (!slot->body_handler)
+                        slot->handler = payload_too_large_handler;
+                body_finish(server, connection, false, connection->length);
+                return 1;
+        }
+
+        if (http_body_decoder_is_done(&connection->body)) {
+                body_finish(server, connection, true, head_length + (size_t)used);
+                return 1;
         }
 
-        log_debug("Sent response with status code: %lu", response->status_code);
-        free(args->request);
-        http_response_free(response);
-        close(args->client_fd);
-        free(args);
+        // everything after the head has been decoded, which leaves the rest of
+        // the buffer free for more of the body
+        connection->length = head_length;
+        connection->buffer[head_length] = '\0';
+        return 0;
+}
+
+static bool pipeline_prepare(server_t *server, http_connection_t *connection,
+                             http_pipeline_slot_t *slot)
+{
+        http_request_t *request = &slot->request;
+
+        connection->requests_served++;
+        bool keep_alive = request_wants_keep_alive(request) &&
+                          connection->requests_served < server->max_keep_alive_requests;
+
+        http_route_match_t match = http_router_get_handler(server->router, request);
+
+        slot->connection = connection;
+        slot->handler = match.handler;
+        slot->body_handler = match.body_handler;
+        slot->route = match.route;
+        slot->response = NULL;
+        slot->meta.keep_alive = keep_alive;
+        slot->meta.allow = match.allow;
+        slot->meta.is_head = request->method == HTTP_HEAD;
+        slot->is_ready = false;
+        slot->is_shed = false;
+        slot->arena = NULL;
+        slot->body = NULL;
+        slot->body_capacity = 0;
+        request->arena = NULL;
+        request->body_state = NULL;
+
+        return keep_alive;
 }
 
-static void handle_client(server_t *server, int client_fd)
+static void pipeline_start(server_t *server, http_connection_t *connection, size_t count,
+                           size_t consumed, bool keep_alive)
 {
-        char buffer[BUFFER_SIZE];
+        // the last response answered on a connection which is about to close
+        // has to say so, even if its request asked for keep-alive
+        connection->pipeline[count - 1].meta.keep_alive = keep_alive;
+
+        connection->keep_alive = keep_alive;
+        connection->consumed = consumed;
+        connection->pipeline_length = count;
+        connection->pipeline_written = 0;
+        connection->is_writing = false;
+        connection->write_failed = false;
+
+        uint64_t now = event_loop_now_ns();
+        for (size_t i = 0; i < count; ++i) {
+                http_pipeline_slot_t *slot = &connection->pipeline[i];
+
+                size_t queued = atomic_fetch_add_explicit(&server->requests_queued, 1,
+                                                          memory_order_relaxed);
+                if (queued >= server->max_queued_requests) {
+                        atomic_fetch_sub_explicit(&server->requests_queued, 1,
+                                                  memory_order_relaxed);
+                        atomic_fetch_add_explicit(&server->requests_shed_queue_full, 1,
+                                                  memory_order_relaxed);
+                        pipeline_shed(server, connection, i);
+                        continue;
+                }
 
-        ssize_t bytes_read = read(client_fd, buffer, BUFFER_SIZE - 1);
-        if (bytes_read < 0) {
-                log_error("Failed to read client request from socket");
-                return;
+                atomic_fetch_add_explicit(&server->requests_accepted, 1, memory_order_relaxed);
+                slot->queued_at = now;
+
+                // the batch was parsed on a worker, so under work stealing
+                // its requests start out on that worker's warm caches; with
+                // the queue full, the parsing thread handles the request itself
+                if (threadpool_execute_local(server->threadpool, worker_handle_request, slot) !=
+                    0)
+                        worker_handle_request(slot);
+        }
+}
+
+static int body_begin(server_t *server, http_connection_t *connection)
+{
+        http_parser_t *parser = &connection->parser;
+        http_pipeline_slot_t *slot = &connection->pipeline[0];
+
+        http_parser_finish(parser, &slot->request, connection->buffer);
+        pipeline_prepare(server, connection, slot);
+        http_body_decoder_init(&connection->body, parser);
+
+        // rejected before a byte of the body is read, which leaves the
+        // connection nowhere to carry on from
+        if (!slot->body_handler && !parser->is_chunked &&
+            parser->content_length > server->max_body_size) {
+                slot->handler = payload_too_large_handler;
+                body_finish(server, connection, false, connection->length);
+                return -1;
         }
 
-        buffer[bytes_read] = '\0';
-        printf("Received request:\n%s\n", buffer);
+        if (slot->body_handler) {
+                slot->arena = http_arena_acquire();
+                slot->request.arena = slot->arena;
+        } else {
+                // a chunked body grows as it comes in, starting out no larger
+                // than one which would have fit into the buffer
+                size_t capacity = parser->is_chunked ? CONNECTION_BUFFER_SIZE
+                                                     : parser->content_length;
+                if (capacity > server->max_body_size)
+                        capacity = server->max_body_size;
+
+                slot->body = malloc(capacity ? capacity : 1);
+                if (!slot->body) {
+                        log_error("Failed allocating request body");
+                        connection_close(connection);
+                        return -1;
+                }
+                slot->body_capacity = capacity;
+        }
 
-        http_request_t *request = parse_http_request(buffer);
-        if (!request) {
-                log_error("Failed to parse HTTP request");
+        connection->is_receiving_body = true;
+        return 0;
+}
+
+static void body_finish(server_t *server, http_connection_t *connection, bool is_complete,
+                        size_t consumed)
+{
+        http_pipeline_slot_t *slot = &connection->pipeline[0];
+
+        connection->is_receiving_body = false;
+        slot->request.body = slot->body_handler ? NULL : slot->body;
+        slot->request.body_length = connection->body.length;
+        http_parser_init(&connection->parser);
+
+        log_debug("Received a %lu byte request body (fd: %d)", slot->request.body_length,
+                  connection->fd);
+        if (server->metrics)
+                http_metrics_record_request(server->metrics, slot->route, consumed);
+
+        pipeline_start(server, connection, 1, consumed, slot->meta.keep_alive && is_complete);
+}
+
+static int body_collect(void *raw_slot, const char *data, size_t length)
+{
+        http_pipeline_slot_t *slot = (http_pipeline_slot_t *)raw_slot;
+        http_connection_t *connection = slot->connection;
+        size_t max_body_size = connection->loop->server->max_body_size;
+
+        size_t used = connection->body.length;
+        if (length > max_body_size - used) {
+                log_debug("Request body exceeds %lu bytes (fd: %d)", max_body_size,
+                          connection->fd);
+                return -1;
+        }
+
+        if (used + length > slot->body_capacity) {
+                size_t capacity = slot->body_capacity;
+                while (capacity < used + length)
+                        capacity = capacity > max_body_size / 2 ? max_body_size : capacity * 2;
+
+                char *body = realloc(slot->body, capacity);
+                if (!body) {
+                        log_error("Failed growing request body");
+                        return -1;
+                }
+                slot->body = body;
+                slot->body_capacity = capacity;
+        }
+
+        memcpy(slot->body + used, data, length);
+        return 0;
+}
+
+static int body_stream(void *raw_slot, const char *data, size_t length)
+{
+        http_pipeline_slot_t *slot = (http_pipeline_slot_t *)raw_slot;
+
+        if (slot->body_handler(&slot->request, data, length) != 0) {
+                log_debug("Body handler stopped the upload (fd: %d)", slot->connection->fd);
+                return -1;
+        }
+        return 0;
+}
+
+static bool request_wants_keep_alive(const http_request_t *request)
+{
+        const char *connection = http_request_get_header(request, "Connection");
+
+        // HTTP/1.1 connections are persistent unless the client opts out,
+        // HTTP/1.0 ones only when the client explicitly asks for it
+        if (strcmp(request->version, "HTTP/1.1") == 0)
+                return !connection || !strcasestr(connection, "close");
+
+        return connection && strcasestr(connection, "keep-alive");
+}
+
+static void pipeline_complete(http_connection_t *connection, size_t index,
+                              http_response_t *response)
+{
+        pthread_mutex_lock(&connection->pipeline_lock);
+
+        connection->pipeline[index].response = response;
+        connection->pipeline[index].is_ready = true;
+
+        if (connection->is_writing) {
+                pthread_mutex_unlock(&connection->pipeline_lock);
                 return;
         }
+        connection->is_writing = true;
+
+        pipeline_flush(connection);
+}
+
+void server_pipeline_sent(http_connection_t *connection)
+{
+        // the writer is still marked as busy, so nobody else touches the
+        // position while the batch was away
+        size_t first = connection->pipeline_written;
+        size_t last = first + connection->send->count;
+
+        if (connection->send->failed) {
+                log_error("Failed sending response to client");
+                connection->write_failed = true;
+        } else {
+                log_debug("Sent %lu responses", last - first);
+        }
+
+        pipeline_release(connection, first, last);
+
+        pthread_mutex_lock(&connection->pipeline_lock);
+        connection->pipeline_written = last;
+        pipeline_flush(connection);
+}
+
+static void pipeline_flush(http_connection_t *connection)
+{
+        while (connection->pipeline_written < connection->pipeline_length &&
+               connection->pipeline[connection->pipeline_written].is_ready) {
+                const http_response_t *responses[CONNECTION_PIPELINE_DEPTH];
+                http_response_meta_t meta[CONNECTION_PIPELINE_DEPTH];
+
+                size_t first = connection->pipeline_written;
+                size_t last = first;
+                for (; last < connection->pipeline_length; ++last) {
+                        http_pipeline_slot_t *slot = &connection->pipeline[last];
+                        if (!slot->is_ready)
+                                break;
+
+                        // once a response is missing, nothing behind it can be
+                        // delivered in order anymore, but everything before it
+                        // is still sent
+                        if (!slot->response) {
+                                if (last == first) {
+                                        connection->write_failed = true;
+                                        last++;
+                                }
+                                break;
+                        }
+
+                        responses[last - first] = slot->response;
+                        meta[last - first] = slot->meta;
+                }
+
+                // responses are written outside the lock, so the workers still
+                // handling later requests are never blocked on the socket, and
+                // everything that is ready goes out in a single writev()
+                pthread_mutex_unlock(&connection->pipeline_lock);
+
+                bool is_sent_by_loop = connection->loop->backend == SERVER_IO_BACKEND_IO_URING;
+                if (!connection->write_failed && is_sent_by_loop) {
+                        bool closes = last == connection->pipeline_length &&
+                                      !connection->keep_alive;
+                        if (event_loop_send(connection, responses, meta, last - first, closes) >=
+                            0)
+                                return;
+
+                        log_error("Failed preparing responses for client");
+                        connection->write_failed = true;
+                } else if (!connection->write_failed) {
+                        // a socket which fills up is waited on by the loop,
+                        // never by a worker
+                        ssize_t written = event_loop_write(connection, responses, meta,
+                                                           last - first);
+                        if (0 == written)
+                                return;
+
+                        if (written < 0) {
+                                log_error("Failed sending response to client - %ld", written);
+                                connection->write_failed = true;
+                        } else {
+                                last = first + (size_t)written;
+                                log_debug("Sent %lu responses", last - first);
+                        }
+                }
+
+                pipeline_release(connection, first, last);
+
+                pthread_mutex_lock(&connection->pipeline_lock);
+                connection->pipeline_written = last;
+        }
 
-        http_handler_t handler =
-                http_router_get_handler(server->router, request->method, request->path);
+        connection->is_writing = false;
+        bool is_finished = connection->pipeline_written == connection->pipeline_length;
 
-        threadpool_execute(server->threadpool, worker_handle_request,
-                           http_handler_args_new(handler, request, client_fd));
+        pthread_mutex_unlock(&connection->pipeline_lock);
+
+        if (!is_finished)
+                return;
+
+        // requests pipelined behind the batch are parsed right here, so they
+        // never wait for a round trip through the loop
+        if (connection->keep_alive && !connection->write_failed)
+                connection_process(connection);
+        else
+                connection_close(connection);
+}
+
+static void pipeline_release(http_connection_t *connection, size_t first, size_t last)
+{
+        for (size_t i = first; i < last; ++i) {
+                http_pipeline_slot_t *slot = &connection->pipeline[i];
+                if (!slot->is_shed)
+                        http_response_free(slot->response);
+                slot->response = NULL;
+
+                http_arena_release(slot->arena);
+                slot->arena = NULL;
+
+                free(slot->body);
+                slot->body = NULL;
+        }
+}
+
+static void pipeline_shed(server_t *server, http_connection_t *connection, size_t index)
+{
+        connection->pipeline[index].is_shed = true;
+        pipeline_complete(connection, index, &server->shed_response);
 }
 
 server_t *server_new(server_config_t config)
@@ -101,27 +581,95 @@ server_t *server_new(server_config_t config)
         }
 
         server->port = config.port;
+        server->io_threads = config.io_threads ? config.io_threads : 1;
+        server->io_backend = config.io_backend;
+        server->io_affinity = config.io_affinity;
         server->max_pending_requests = config.max_pending_requests;
 
+        server->keep_alive_timeout_ms = config.keep_alive_timeout_ms
+                                                ? config.keep_alive_timeout_ms
+                                                : SERVER_DEFAULT_KEEP_ALIVE_TIMEOUT_MS;
+        server->header_timeout_ms = config.header_timeout_ms ? config.header_timeout_ms
+                                                             : SERVER_DEFAULT_HEADER_TIMEOUT_MS;
+        server->body_timeout_ms = config.body_timeout_ms ? config.body_timeout_ms
+                                                         : SERVER_DEFAULT_BODY_TIMEOUT_MS;
+        server->write_timeout_ms = config.write_timeout_ms ? config.write_timeout_ms
+                                                           : SERVER_DEFAULT_WRITE_TIMEOUT_MS;
+        server->max_keep_alive_requests = config.max_keep_alive_requests
+                                                  ? config.max_keep_alive_requests
+                                                  : SERVER_DEFAULT_MAX_KEEP_ALIVE_REQUESTS;
+        server->max_queued_requests = config.max_queued_requests
+                                              ? config.max_queued_requests
+                                              : SERVER_DEFAULT_MAX_QUEUED_REQUESTS;
+        server->max_queue_wait_ms = config.max_queue_wait_ms ? config.max_queue_wait_ms
+                                                             : SERVER_DEFAULT_MAX_QUEUE_WAIT_MS;
+        server->max_body_size = config.max_body_size ? config.max_body_size
+                                                     : SERVER_DEFAULT_MAX_BODY_SIZE;
+
+        atomic_init(&server->requests_queued, 0);
+        atomic_init(&server->requests_accepted, 0);
+        atomic_init(&server->requests_shed_queue_full, 0);
+        atomic_init(&server->requests_shed_queue_wait, 0);
+
+        // built once, so shedding a request costs no more than writing it out
+        const size_t MAX_RETRY_AFTER_LENGTH = 32;
+        server->shed_headers[0] = malloc(MAX_RETRY_AFTER_LENGTH);
+        if (!server->shed_headers[0]) {
+                log_trace("Failed allocating Retry-After header");
+                goto error_shed_response;
+        }
+        snprintf(server->shed_headers[0], MAX_RETRY_AFTER_LENGTH, "Retry-After: %u",
+                 config.retry_after_s ? config.retry_after_s : SERVER_DEFAULT_RETRY_AFTER_S);
+        server->shed_headers[1] = NULL;
+
+        static char SHED_BODY[] = "Service Unavailable";
+        server->shed_response.status_code = HTTP_SERVICE_UNAVAILABLE;
+        server->shed_response.body = SHED_BODY;
+        server->shed_response.body_length = sizeof(SHED_BODY) - 1;
+        server->shed_response.headers = server->shed_headers;
+
         server->router = http_router_new();
         if (!server->router) {
                 log_trace("Failed creating HTTP router");
                 goto error_router;
         }
 
-        server->threadpool = threadpool_create(config.threads);
+        server->threadpool = threadpool_create(config.threads, config.scheduling_policy,
+                                               &config.worker_affinity);
         if (!server->threadpool) {
                 log_trace("Failed creating thread pool for request handling");
                 goto error_threadpool;
         }
 
+        server->metrics = NULL;
+        if (config.metrics_path) {
+                server->metrics = http_metrics_new(server->router);
+                if (!server->metrics)
+                        goto error_metrics;
+
+                if (http_router_add_route(server->router, HTTP_GET, config.metrics_path,
+                                          metrics_handler) != 0) {
+                        log_trace("Failed adding the metrics route %s", config.metrics_path);
+                        goto error_metrics_route;
+                }
+        }
+
         return server;
 
+error_metrics_route:
+        http_metrics_free(server->metrics);
+
+error_metrics:
+        threadpool_free(server->threadpool);
+
 error_threadpool:
         http_router_free(server->router);
 
 error_router:
-        free(server->router);
+        free(server->shed_headers[0]);
+
+error_shed_response:
+        free(server);
         return NULL;
 }
 
@@ -140,22 +688,95 @@ int server_add_route(server_t *server, http_method_t method, const char *url,
         return 0;
 }
 
+int server_add_streaming_route(server_t *server, http_method_t method, const char *url,
+                               http_body_handler_t body_handler, http_handler_t handler)
+{
+        if (!server || !url || !body_handler || !handler) {
+                log_trace("Invalid arguments to server_add_streaming_route");
+                return -1;
+        }
+
+        if (http_router_add_streaming_route(server->router, method, url, handler, body_handler) !=
+            0) {
+                log_trace("Failed adding route for %s %s", http_method_to_string(method), url);
+                return -2;
+        }
+        return 0;
+}
+
 void server_start(server_t *server)
 {
-        const int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+        // peers routinely hang up before their response is written; that must
+        // surface as EPIPE from write() rather than terminate the process
+        signal(SIGPIPE, SIG_IGN);
+
+        size_t shard_count = server->io_threads;
+        bool is_sharded = shard_count > 1;
+
+        event_loop_t *loops = calloc(shard_count, sizeof(event_loop_t));
+        pthread_t *threads = calloc(shard_count, sizeof(pthread_t));
+        if (!loops || !threads)
+                log_fatal(EXIT_FAILURE, "Failed to allocate event loops");
+
+        // every shard has a listener and a loop of its own, nothing on the
+        // accept or read path is shared between them
+        for (size_t i = 0; i < shard_count; ++i) {
+                int listen_fd = server_listen(server, is_sharded);
+                if (listen_fd < 0)
+                        log_fatal(EXIT_FAILURE, "Failed to listen on port %d", server->port);
+
+                if (event_loop_init(&loops[i], server, listen_fd) < 0) {
+                        close(listen_fd);
+                        log_fatal(EXIT_FAILURE, "Failed to initialize event loop");
+                }
+                loops[i].shard = i;
+        }
+        log_info("Server listening on port %d (backlog: %lu, event loops: %lu, I/O: %s)",
+                 server->port, server->max_pending_requests, shard_count,
+                 loops[0].backend == SERVER_IO_BACKEND_IO_URING ? "io_uring" : "epoll");
+
+        // the calling thread runs the first loop itself, and is only pinned
+        // once the others have been started, so they do not inherit its mask
+        for (size_t i = 1; i < shard_count; ++i) {
+                if (pthread_create(&threads[i], NULL, server_run_shard, &loops[i]) != 0)
+                        log_fatal(EXIT_FAILURE, "Failed to start event loop thread %lu", i);
+        }
+
+        server_run_shard(&loops[0]);
+
+        for (size_t i = 1; i < shard_count; ++i)
+                pthread_join(threads[i], NULL);
+
+        for (size_t i = 0; i < shard_count; ++i) {
+                close(loops[i].listen_fd);
+                event_loop_free(&loops[i]);
+        }
+
+        free(threads);
+        free(loops);
+}
+
+static int server_listen(const server_t *server, bool is_sharded)
+{
+        const int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
         if (server_fd < 0) {
-                log_fatal(EXIT_FAILURE, "Failed to create socket");
+                log_error("Failed to create socket: %s", strerror(errno));
+                return -1;
         }
-        log_info("Created server socket");
 
-        int result;
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &FAST_RESTART,
+                       sizeof(FAST_RESTART)) < 0) {
+                log_error("Failed to set SO_REUSEADDR: %s", strerror(errno));
+                goto error;
+        }
 
-        result = setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &FAST_RESTART,
-                            sizeof(FAST_RESTART));
-        if (result < 0) {
-                perror("setsockopt");
-                close(server_fd);
-                exit(EXIT_FAILURE);
+        // each shard binds the same port, and the kernel balances incoming
+        // connections over all listeners in the group
+        const int REUSE_PORT = true;
+        if (is_sharded &&
+            setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &REUSE_PORT, sizeof(REUSE_PORT)) < 0) {
+                log_error("Failed to set SO_REUSEPORT: %s", strerror(errno));
+                goto error;
         }
 
         struct sockaddr_in server_address = { .sin_family = AF_INET,
@@ -164,41 +785,36 @@ void server_start(server_t *server)
 
         };
 
-        result = bind(server_fd, (struct sockaddr *)&server_address, sizeof(server_address));
-        if (result < 0) {
-                close(server_fd);
-                log_fatal(EXIT_FAILURE, "Failed to bind socket");
+        if (bind(server_fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
+                log_error("Failed to bind socket: %s", strerror(errno));
+                goto error;
         }
-        log_info("Socket bound to port %d", server->port);
 
         if (listen(server_fd, (int)server->max_pending_requests) < 0) {
-                close(server_fd);
-                log_fatal(EXIT_FAILURE, "Failed to listen on socket");
+                log_error("Failed to listen on socket: %s", strerror(errno));
+                goto error;
         }
-        log_info("Server listening on port %d (backlog: %lu)", server->port,
-                 server->max_pending_requests);
 
-        int client_fd;
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        while (1) {
-                log_debug("Waiting for connections...");
+        return server_fd;
 
-                client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-                if (client_fd < 0) {
-                        log_error("Failed to accept client connection");
-                        continue;
-                }
-
-                printf("Client connected from %s:%d (fd: %d)\n", inet_ntoa(client_addr.sin_addr),
-                       ntohs(client_addr.sin_port), client_fd);
+error:
+        close(server_fd);
+        return -1;
+}
 
-                handle_client(server, client_fd);
+static void *server_run_shard(void *raw_loop)
+{
+        event_loop_t *loop = (event_loop_t *)raw_loop;
+        server_t *server = loop->server;
 
-                log_debug("Client connection closed");
-        }
+        // connections are allocated on the loop's thread once accepted, so
+        // their buffers end up on the NUMA node the loop is pinned to
+        if (cpu_affinity_apply(&server->io_affinity, loop->shard,
+                               server->threadpool->thread_count) != 0)
+                log_warn("Event loop %lu is running unpinned", loop->shard);
 
-        close(server_fd);
+        event_loop_run(loop);
+        return NULL;
 }
 
 void server_free(server_t *server)
@@ -209,6 +825,65 @@ void server_free(server_t *server)
         }
 
         threadpool_free(server->threadpool);
+        http_metrics_free(server->metrics);
         http_router_free(server->router);
+        free(server->shed_headers[0]);
         free(server);
 }
+
+server_stats_t server_get_stats(server_t *server)
+{
+        server_stats_t stats = { 0 };
+        if (!server) {
+                log_trace("Trying to get stats of a NULL http server");
+                return stats;
+        }
+
+        stats.requests_accepted =
+                atomic_load_explicit(&server->requests_accepted, memory_order_relaxed);
+        stats.requests_shed_queue_full =
+                atomic_load_explicit(&server->requests_shed_queue_full, memory_order_relaxed);
+        stats.requests_shed_queue_wait =
+                atomic_load_explicit(&server->requests_shed_queue_wait, memory_order_relaxed);
+        stats.requests_queued =
+                atomic_load_explicit(&server->requests_queued, memory_order_relaxed);
+        return stats;
+}
+
+static http_response_t *metrics_handler(const http_request_t *request)
+{
+        server_t *server = current_server;
+        if (!server || !server->metrics)
+                return create_response(HTTP_NOT_FOUND, "Not Found");
+
+        server_stats_t stats = server_get_stats(server);
+        size_t length = 0;
+        char *body = http_metrics_render(server->metrics, &stats, &length);
+        if (!body)
+                return create_response(HTTP_INTERNAL_SERVER_ERROR, "Internal Server Error");
+
+        static const char CONTENT_TYPE[] = "Content-Type: text/plain; version=0.0.4";
+        char **headers = http_request_alloc(request, 2 * sizeof(char *));
+        char *content_type = http_request_alloc(request, sizeof(CONTENT_TYPE));
+        http_response_t *response = create_response(HTTP_OK, NULL);
+        if (!response || !headers || !content_type) {
+                free(body);
+                http_response_free(response);
+                return NULL;
+        }
+
+        memcpy(content_type, CONTENT_TYPE, sizeof(CONTENT_TYPE));
+        headers[0] = content_type;
+        headers[1] = NULL;
+
+        // the body is rendered on the heap, and freed along with the response
+        response->body = body;
+        response->body_length = length;
+        response->headers = headers;
+        return response;
+}
+
+static http_response_t *payload_too_large_handler(__unused const http_request_t *request)
+{
+        return create_response(HTTP_PAYLOAD_TOO_LARGE, "Payload Too Large");
+}
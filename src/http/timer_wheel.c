@@ -0,0 +1,227 @@
+#include "timer_wheel.h"
+
+#include <string.h>
+
+#include "logger.h"
+
+#define TIMER_WHEEL_SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+static timer_wheel_timer_t **timer_wheel_list(timer_wheel_t *, uint8_t, uint8_t);
+static void timer_wheel_link(timer_wheel_t *, timer_wheel_timer_t *, uint8_t, uint8_t);
+static void timer_wheel_unlink(timer_wheel_t *, timer_wheel_timer_t *);
+
+/// Links the timer into the slot its deadline falls into, seen from the
+/// wheel's current tick
+static void timer_wheel_place(timer_wheel_t *, timer_wheel_timer_t *);
+
+/// Moves the timers of every slot reached at the current tick one level down,
+/// and those due at it onto the expired list
+static void timer_wheel_turn(timer_wheel_t *);
+
+/// Next tick at which a slot with timers in it is reached, or UINT64_MAX
+static uint64_t timer_wheel_next_turn(const timer_wheel_t *);
+
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now)
+{
+        memset(wheel, 0, sizeof(timer_wheel_t));
+        wheel->now = now;
+}
+
+void timer_wheel_timer_init(timer_wheel_timer_t *timer)
+{
+        timer->next = NULL;
+        timer->prev = NULL;
+        timer->expires = 0;
+        timer->level = 0;
+        timer->slot = 0;
+        timer->is_pending = false;
+}
+
+void timer_wheel_schedule(timer_wheel_t *wheel, timer_wheel_timer_t *timer, uint64_t expires)
+{
+        if (!wheel || !timer) {
+                log_trace("Invalid arguments to timer_wheel_schedule");
+                return;
+        }
+
+        if (timer->is_pending)
+                timer_wheel_unlink(wheel, timer);
+
+        if (expires > wheel->now && expires - wheel->now > TIMER_WHEEL_MAX_DELAY)
+                expires = wheel->now + TIMER_WHEEL_MAX_DELAY;
+
+        timer->expires = expires;
+        timer->is_pending = true;
+
+        if (expires <= wheel->now)
+                timer_wheel_link(wheel, timer, TIMER_WHEEL_LEVELS, 0);
+        else
+                timer_wheel_place(wheel, timer);
+}
+
+void timer_wheel_cancel(timer_wheel_t *wheel, timer_wheel_timer_t *timer)
+{
+        if (!wheel || !timer || !timer->is_pending)
+                return;
+
+        timer_wheel_unlink(wheel, timer);
+        timer->is_pending = false;
+}
+
+uint64_t timer_wheel_next_tick(const timer_wheel_t *wheel)
+{
+        if (wheel->expired)
+                return wheel->now;
+
+        return timer_wheel_next_turn(wheel);
+}
+
+void timer_wheel_advance(timer_wheel_t *wheel, uint64_t now)
+{
+        uint64_t next;
+        while ((next = timer_wheel_next_turn(wheel)) != UINT64_MAX && next <= now) {
+                wheel->now = next;
+                timer_wheel_turn(wheel);
+        }
+
+        // nothing is left to turn before `now`, however far off it is, so an
+        // idle wheel catches up in one step
+        if (now > wheel->now)
+                wheel->now = now;
+}
+
+timer_wheel_timer_t *timer_wheel_pop_expired(timer_wheel_t *wheel, uint64_t now)
+{
+        if (!wheel->expired)
+                timer_wheel_advance(wheel, now);
+        if (!wheel->expired)
+                return NULL;
+
+        timer_wheel_timer_t *timer = wheel->expired;
+        timer_wheel_unlink(wheel, timer);
+        timer->is_pending = false;
+        return timer;
+}
+
+static uint64_t timer_wheel_next_turn(const timer_wheel_t *wheel)
+{
+        uint64_t next = UINT64_MAX;
+
+        for (unsigned int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+                uint64_t occupied = wheel->occupied[level];
+                if (!occupied)
+                        continue;
+
+                // a slot is reached when the level's block counter comes round
+                // to it; the slot after the current one is the nearest
+                unsigned int shift = level * TIMER_WHEEL_SLOT_BITS;
+                uint64_t block = wheel->now >> shift;
+                unsigned int start = (unsigned int)(block + 1) & TIMER_WHEEL_SLOT_MASK;
+                uint64_t rotated =
+                        start ? (occupied >> start) | (occupied << (TIMER_WHEEL_SLOTS - start))
+                              : occupied;
+                uint64_t distance = (uint64_t)__builtin_ctzll(rotated) + 1;
+
+                uint64_t tick = (block + distance) << shift;
+                if (tick < next)
+                        next = tick;
+        }
+
+        return next;
+}
+
+static timer_wheel_timer_t **timer_wheel_list(timer_wheel_t *wheel, uint8_t level, uint8_t slot)
+{
+        if (level == TIMER_WHEEL_LEVELS)
+                return &wheel->expired;
+
+        return &wheel->slots[level][slot];
+}
+
+static void timer_wheel_link(timer_wheel_t *wheel, timer_wheel_timer_t *timer, uint8_t level,
+                             uint8_t slot)
+{
+        timer_wheel_timer_t **list = timer_wheel_list(wheel, level, slot);
+
+        timer->prev = NULL;
+        timer->next = *list;
+        if (*list)
+                (*list)->prev = timer;
+        *list = timer;
+
+        timer->level = level;
+        timer->slot = slot;
+        if (level < TIMER_WHEEL_LEVELS)
+                wheel->occupied[level] |= UINT64_C(1) << slot;
+}
+
+static void timer_wheel_unlink(timer_wheel_t *wheel, timer_wheel_timer_t *timer)
+{
+        timer_wheel_timer_t **list = timer_wheel_list(wheel, timer->level, timer->slot);
+
+        if (timer->prev)
+                timer->prev->next = timer->next;
+        else
+                *list = timer->next;
+
+        if (timer->next)
+                timer->next->prev = timer->prev;
+
+        timer->prev = NULL;
+        timer->next = NULL;
+
+        if (timer->level < TIMER_WHEEL_LEVELS && !*list)
+                wheel->occupied[timer->level] &= ~(UINT64_C(1) << timer->slot);
+}
+
+// A timer goes into the lowest level at which its deadline is fewer than
+// TIMER_WHEEL_SLOTS blocks ahead, so its slot is only reached once, when
+// the block holding the deadline begins. The top level takes a full turn at
+// most, as TIMER_WHEEL_MAX_DELAY keeps deadlines within it.
+static void timer_wheel_place(timer_wheel_t *wheel, timer_wheel_timer_t *timer)
+{
+        uint8_t level = 0;
+        while (level < TIMER_WHEEL_LEVELS - 1) {
+                unsigned int shift = level * TIMER_WHEEL_SLOT_BITS;
+                if ((timer->expires >> shift) - (wheel->now >> shift) < TIMER_WHEEL_SLOTS)
+                        break;
+                level++;
+        }
+
+        unsigned int shift = level * TIMER_WHEEL_SLOT_BITS;
+        uint8_t slot = (uint8_t)((timer->expires >> shift) & TIMER_WHEEL_SLOT_MASK);
+        timer_wheel_link(wheel, timer, level, slot);
+}
+
+static void timer_wheel_turn(timer_wheel_t *wheel)
+{
+        // higher levels first, so their timers drop into slots which are
+        // handled right after, down to the ones due at this very tick
+        for (uint8_t level = TIMER_WHEEL_LEVELS - 1; level > 0; --level) {
+                unsigned int shift = level * TIMER_WHEEL_SLOT_BITS;
+                if (wheel->now & ((UINT64_C(1) << shift) - 1))
+                        continue;
+
+                uint8_t slot = (uint8_t)((wheel->now >> shift) & TIMER_WHEEL_SLOT_MASK);
+                timer_wheel_timer_t *timer = wheel->slots[level][slot];
+                wheel->slots[level][slot] = NULL;
+                wheel->occupied[level] &= ~(UINT64_C(1) << slot);
+
+                while (timer) {
+                        timer_wheel_timer_t *next = timer->next;
+                        timer_wheel_place(wheel, timer);
+                        timer = next;
+                }
+        }
+
+        uint8_t slot = (uint8_t)(wheel->now & TIMER_WHEEL_SLOT_MASK);
+        timer_wheel_timer_t *timer = wheel->slots[0][slot];
+        wheel->slots[0][slot] = NULL;
+        wheel->occupied[0] &= ~(UINT64_C(1) << slot);
+
+        while (timer) {
+                timer_wheel_timer_t *next = timer->next;
+                timer_wheel_link(wheel, timer, TIMER_WHEEL_LEVELS, 0);
+                timer = next;
+        }
+}
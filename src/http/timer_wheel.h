@@ -0,0 +1,64 @@
+#ifndef STARCALLER_HTTP_TIMER_WHEEL_H
+#define STARCALLER_HTTP_TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+/// Deadlines further out than this many ticks are brought in to it, which
+/// with millisecond ticks is a little over four and a half hours
+#define TIMER_WHEEL_MAX_DELAY ((UINT64_C(1) << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS)) - 1)
+
+/// Embedded in whatever it times, so scheduling never allocates
+typedef struct _TimerWheelTimer {
+        struct _TimerWheelTimer *next;
+        struct _TimerWheelTimer *prev;
+        uint64_t expires;
+        /// Where the timer is linked, TIMER_WHEEL_LEVELS standing for the list
+        /// of expired ones
+        uint8_t level;
+        uint8_t slot;
+        bool is_pending;
+} timer_wheel_timer_t;
+
+/// Hierarchical hashed timer wheel. Each level has TIMER_WHEEL_SLOTS slots
+/// spanning TIMER_WHEEL_SLOTS times as many ticks as the level below, and a
+/// timer sits in the lowest level whose span reaches its deadline, cascading
+/// down as the wheel turns. Scheduling and cancelling are O(1). Per-level
+/// bitmaps of occupied slots let the wheel jump straight to the next tick
+/// with anything in it, so empty ticks cost nothing.
+typedef struct {
+        /// Last tick processed
+        uint64_t now;
+        timer_wheel_timer_t *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+        uint64_t occupied[TIMER_WHEEL_LEVELS];
+        timer_wheel_timer_t *expired;
+} timer_wheel_t;
+
+void timer_wheel_init(timer_wheel_t *, uint64_t);
+void timer_wheel_timer_init(timer_wheel_timer_t *);
+
+/// Schedules the timer to expire at the given tick, moving it if it is
+/// already pending. A deadline which has passed expires on the next pop. The
+/// deadline is measured against the last tick the wheel was advanced to, so
+/// advance it first if it may have been left idle.
+void timer_wheel_schedule(timer_wheel_t *, timer_wheel_timer_t *, uint64_t);
+/// Does nothing if the timer is not pending
+void timer_wheel_cancel(timer_wheel_t *, timer_wheel_timer_t *);
+
+/// Tick at which the wheel next has to be advanced (on which a timer may or
+/// may not expire), or UINT64_MAX if nothing is scheduled
+uint64_t timer_wheel_next_tick(const timer_wheel_t *);
+
+/// Turns the wheel up to the given tick, collecting the timers which have
+/// expired by then for `timer_wheel_pop_expired()`
+void timer_wheel_advance(timer_wheel_t *, uint64_t);
+
+/// Advances the wheel up to the given tick and unlinks one timer which has
+/// expired by then, or returns NULL once there are none left
+timer_wheel_timer_t *timer_wheel_pop_expired(timer_wheel_t *, uint64_t);
+
+#endif
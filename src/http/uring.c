@@ -0,0 +1,294 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "logger.h"
+
+static int uring_map(uring_t *, const struct io_uring_params *);
+static int uring_buffers_init(uring_t *);
+
+/// Hands every pending entry to the kernel, waiting for `min_complete`
+/// completions (for at most `timeout`, unless it is NULL) when non-zero
+static int uring_enter(uring_t *, unsigned int, const struct __kernel_timespec *);
+
+int uring_init(uring_t *ring)
+{
+        if (!ring) {
+                log_trace("Invalid arguments to uring_init");
+                return -1;
+        }
+
+        memset(ring, 0, sizeof(uring_t));
+        ring->fd = -1;
+
+        // task work only needs to run once the loop enters the kernel, which
+        // it does on every iteration anyway; older kernels reject the flags
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SUBMIT_ALL;
+
+        long fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+        if (fd < 0 && errno == EINVAL) {
+                memset(&params, 0, sizeof(params));
+                fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+        }
+        if (fd < 0) {
+                log_trace("io_uring_setup failed: %s", strerror(errno));
+                return -1;
+        }
+        ring->fd = (int)fd;
+
+        // waiting with a timeout needs the extended argument (5.11), and the
+        // provided buffer ring (5.19) came along with multishot accept
+        if (!(params.features & IORING_FEAT_EXT_ARG)) {
+                log_trace("io_uring lacks IORING_FEAT_EXT_ARG");
+                close(ring->fd);
+                return -1;
+        }
+
+        int res = uring_map(ring, &params);
+        if (res < 0)
+                goto error;
+
+        res = uring_buffers_init(ring);
+        if (res < 0)
+                goto error;
+
+        return 0;
+
+error:
+        uring_free(ring);
+        return res;
+}
+
+void uring_free(uring_t *ring)
+{
+        if (!ring) {
+                log_trace("Trying to free a NULL io_uring");
+                return;
+        }
+
+        if (ring->buffer_ring)
+                munmap(ring->buffer_ring, ring->buffer_ring_size);
+        free(ring->buffers);
+
+        if (ring->sqes)
+                munmap(ring->sqes, ring->sqes_size);
+        if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+                munmap(ring->cq_ring, ring->cq_ring_size);
+        if (ring->sq_ring)
+                munmap(ring->sq_ring, ring->sq_ring_size);
+
+        if (ring->fd >= 0)
+                close(ring->fd);
+
+        memset(ring, 0, sizeof(uring_t));
+        ring->fd = -1;
+}
+
+int uring_reserve(uring_t *ring, unsigned int count)
+{
+        unsigned int head = atomic_load_explicit(ring->sq_head, memory_order_acquire);
+        if (ring->sq_entries - (ring->sq_local_tail - head) >= count)
+                return 0;
+
+        if (uring_enter(ring, 0, NULL) < 0)
+                return -1;
+
+        head = atomic_load_explicit(ring->sq_head, memory_order_acquire);
+        return ring->sq_entries - (ring->sq_local_tail - head) >= count ? 0 : -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring)
+{
+        if (uring_reserve(ring, 1) < 0) {
+                log_error("io_uring submission queue is full");
+                return NULL;
+        }
+
+        struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+        ring->sq_local_tail++;
+
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        return sqe;
+}
+
+int uring_submit_and_wait(uring_t *ring, int timeout_ms)
+{
+        if (timeout_ms < 0)
+                return uring_enter(ring, 1, NULL);
+
+        struct __kernel_timespec timeout = {
+                .tv_sec = timeout_ms / 1000,
+                .tv_nsec = (long long)(timeout_ms % 1000) * 1000000,
+        };
+        return uring_enter(ring, 1, &timeout);
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring)
+{
+        unsigned int head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+        if (head == atomic_load_explicit(ring->cq_tail, memory_order_acquire))
+                return NULL;
+
+        return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring)
+{
+        unsigned int head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+        atomic_store_explicit(ring->cq_head, head + 1, memory_order_release);
+}
+
+char *uring_buffer(uring_t *ring, uint16_t id)
+{
+        return ring->buffers + (size_t)id * URING_BUFFER_SIZE;
+}
+
+void uring_buffer_recycle(uring_t *ring, uint16_t id)
+{
+        char *data = uring_buffer(ring, id);
+        struct io_uring_buf *buffer =
+                &ring->buffer_ring->bufs[ring->buffer_tail & (URING_BUFFER_COUNT - 1)];
+        buffer->addr = (uintptr_t)data;
+        buffer->len = URING_BUFFER_SIZE;
+        buffer->bid = id;
+
+        ring->buffer_tail++;
+        atomic_store_explicit((_Atomic uint16_t *)&ring->buffer_ring->tail, ring->buffer_tail,
+                              memory_order_release);
+}
+
+static int uring_map(uring_t *ring, const struct io_uring_params *params)
+{
+        ring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned int);
+        ring->cq_ring_size =
+                params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+
+        // since 5.4 both rings live in a single mapping
+        bool is_single_mmap = params->features & IORING_FEAT_SINGLE_MMAP;
+        if (is_single_mmap) {
+                if (ring->cq_ring_size > ring->sq_ring_size)
+                        ring->sq_ring_size = ring->cq_ring_size;
+                ring->cq_ring_size = ring->sq_ring_size;
+        }
+
+        ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+        if (ring->sq_ring == MAP_FAILED) {
+                ring->sq_ring = NULL;
+                log_error("Failed to map io_uring submission queue: %s", strerror(errno));
+                return -2;
+        }
+
+        ring->cq_ring = ring->sq_ring;
+        if (!is_single_mmap) {
+                ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+                if (ring->cq_ring == MAP_FAILED) {
+                        ring->cq_ring = NULL;
+                        log_error("Failed to map io_uring completion queue: %s", strerror(errno));
+                        return -2;
+                }
+        }
+
+        ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+        ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring->fd, IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED) {
+                ring->sqes = NULL;
+                log_error("Failed to map io_uring submission entries: %s", strerror(errno));
+                return -2;
+        }
+
+        char *sq = ring->sq_ring;
+        ring->sq_head = (_Atomic unsigned int *)(sq + params->sq_off.head);
+        ring->sq_tail = (_Atomic unsigned int *)(sq + params->sq_off.tail);
+        ring->sq_mask = *(unsigned int *)(sq + params->sq_off.ring_mask);
+        ring->sq_entries = *(unsigned int *)(sq + params->sq_off.ring_entries);
+        ring->sq_local_tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+
+        // entries are always submitted in order, so the indirection array
+        // maps every slot onto itself once and for all
+        unsigned int *array = (unsigned int *)(sq + params->sq_off.array);
+        for (unsigned int i = 0; i < ring->sq_entries; ++i)
+                array[i] = i;
+
+        char *cq = ring->cq_ring;
+        ring->cq_head = (_Atomic unsigned int *)(cq + params->cq_off.head);
+        ring->cq_tail = (_Atomic unsigned int *)(cq + params->cq_off.tail);
+        ring->cq_mask = *(unsigned int *)(cq + params->cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe *)(cq + params->cq_off.cqes);
+
+        return 0;
+}
+
+static int uring_buffers_init(uring_t *ring)
+{
+        ring->buffer_ring_size = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+        ring->buffer_ring = mmap(NULL, ring->buffer_ring_size, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring->buffer_ring == MAP_FAILED) {
+                ring->buffer_ring = NULL;
+                log_error("Failed to map io_uring buffer ring: %s", strerror(errno));
+                return -2;
+        }
+
+        ring->buffers = malloc((size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+        if (!ring->buffers) {
+                log_trace("Failed allocating io_uring receive buffers");
+                return -2;
+        }
+
+        struct io_uring_buf_reg registration;
+        memset(&registration, 0, sizeof(registration));
+        registration.ring_addr = (uintptr_t)ring->buffer_ring;
+        registration.ring_entries = URING_BUFFER_COUNT;
+        registration.bgid = URING_BUFFER_GROUP;
+
+        if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &registration,
+                    1) < 0) {
+                log_trace("Failed registering io_uring buffer ring: %s", strerror(errno));
+                return -1;
+        }
+
+        ring->buffer_tail = 0;
+        for (uint16_t i = 0; i < URING_BUFFER_COUNT; ++i)
+                uring_buffer_recycle(ring, i);
+
+        return 0;
+}
+
+static int uring_enter(uring_t *ring, unsigned int min_complete,
+                       const struct __kernel_timespec *timeout)
+{
+        atomic_store_explicit(ring->sq_tail, ring->sq_local_tail, memory_order_release);
+        unsigned int to_submit =
+                ring->sq_local_tail - atomic_load_explicit(ring->sq_head, memory_order_acquire);
+
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uintptr_t)timeout;
+
+        unsigned int flags = min_complete > 0 ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+
+        long res = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags,
+                           flags ? &arg : NULL, flags ? sizeof(arg) : 0);
+        if (res >= 0)
+                return 0;
+
+        // a timeout or a signal just ends the wait early, and with the
+        // completion queue overflowing, the caller reaps before submitting
+        // anything more
+        if (errno == ETIME || errno == EINTR || errno == EBUSY || errno == EAGAIN)
+                return 0;
+
+        log_error("io_uring_enter failed: %s", strerror(errno));
+        return -1;
+}
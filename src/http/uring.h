@@ -0,0 +1,78 @@
+#ifndef STARCALLER_HTTP_URING_H
+#define STARCALLER_HTTP_URING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/// Must be a power of two
+#define URING_ENTRIES 1024
+
+/// Buffers the kernel picks from for every recv, so a connection holds none
+/// of the ring's memory while it waits for data. Must be a power of two.
+#define URING_BUFFER_COUNT 512
+#define URING_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+
+/// An io_uring instance driven through the raw syscalls, with its
+/// submission and completion queues mapped into the process
+typedef struct {
+        int fd;
+
+        _Atomic unsigned int *sq_head;
+        _Atomic unsigned int *sq_tail;
+        unsigned int sq_mask;
+        unsigned int sq_entries;
+        struct io_uring_sqe *sqes;
+        /// Entries filled in, but not yet handed to the kernel
+        unsigned int sq_local_tail;
+
+        _Atomic unsigned int *cq_head;
+        _Atomic unsigned int *cq_tail;
+        unsigned int cq_mask;
+        struct io_uring_cqe *cqes;
+
+        void *sq_ring;
+        size_t sq_ring_size;
+        void *cq_ring;
+        size_t cq_ring_size;
+        size_t sqes_size;
+
+        /// Provided buffer ring registered as URING_BUFFER_GROUP
+        struct io_uring_buf_ring *buffer_ring;
+        size_t buffer_ring_size;
+        char *buffers;
+        uint16_t buffer_tail;
+} uring_t;
+
+/// Returns the following status:
+///  0 - the ring is ready
+/// -1 - the kernel has no io_uring, or lacks one of the features used
+/// -2 - out of memory
+int uring_init(uring_t *);
+void uring_free(uring_t *);
+
+/// Makes sure the next `count` entries can be taken without a submission in
+/// between, which linked entries rely on. Returns -1 if the kernel will not
+/// take the pending ones.
+int uring_reserve(uring_t *, unsigned int);
+/// Returns a zeroed submission entry, submitting the pending ones first if
+/// the queue is full, or NULL if even that fails
+struct io_uring_sqe *uring_get_sqe(uring_t *);
+
+/// Submits the pending entries and waits up to `timeout_ms` (-1 for no limit)
+/// for at least one completion. Returns -1 on failure other than a timeout
+/// or an interruption.
+int uring_submit_and_wait(uring_t *, int);
+
+/// Returns the oldest unseen completion, or NULL if there are none
+struct io_uring_cqe *uring_peek_cqe(uring_t *);
+void uring_cqe_seen(uring_t *);
+
+char *uring_buffer(uring_t *, uint16_t);
+/// Gives a buffer picked by a recv back to the kernel
+void uring_buffer_recycle(uring_t *, uint16_t);
+
+#endif
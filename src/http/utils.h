@@ -1,10 +1,11 @@
 #ifndef STARCALLER_HTTP_UTILS_H
 #define STARCALLER_HTTP_UTILS_H
 
-#include "http.h"
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
-http_request_t *parse_http_request(const char *);
-void free_http_request(http_request_t *);
+#include "http.h"
 
 http_method_t string_to_http_method(const char *);
 const char *http_method_to_string(http_method_t);
@@ -12,14 +13,72 @@ const char *http_method_to_string(http_method_t);
 http_router_t *http_router_new(void);
 void http_router_free(http_router_t *);
 int http_router_add_route(http_router_t *, http_method_t, const char *, http_handler_t);
+/// Adds a route whose request bodies are streamed to the body handler
+int http_router_add_streaming_route(http_router_t *, http_method_t, const char *,
+                                    http_handler_t, http_body_handler_t);
+
+/// Route ids of requests answered by the 404 and 405 handlers
+#define HTTP_ROUTE_NOT_FOUND 0
+#define HTTP_ROUTE_METHOD_NOT_ALLOWED 1
 
-http_handler_t http_router_get_handler(http_router_t *, http_method_t, const char *);
+typedef struct {
+        http_handler_t handler;
+        /// Set only for a streaming route
+        http_body_handler_t body_handler;
+        /// Set only when the path exists, but not for the request's method
+        const char *allow;
+        /// Id of the matched route, see `http_router_t.route_names`
+        size_t route;
+} http_route_match_t;
+
+/// Looks up the handler for the request's method and path in a single pass,
+/// capturing any path parameters into the request. Falls back to the 405
+/// handler (along with the path's `Allow` value) or the 404 one.
+http_route_match_t http_router_get_handler(http_router_t *, http_request_t *);
 http_response_t *route_http_request(http_router_t *, const http_request_t *);
 
 void http_router_set_404_handler(http_router_t *, http_handler_t);
 void http_router_set_405_handler(http_router_t *, http_handler_t);
 
-int write_http_response(int, const http_response_t *);
+/// Connection level details which go into a response's head, but are not up
+/// to the handler
+typedef struct {
+        bool keep_alive;
+        /// Value of the `Allow` header added to a 405 response, if any
+        const char *allow;
+        /// Answers a HEAD request, so the body is left out while its
+        /// Content-Length still goes into the head
+        bool is_head;
+} http_response_meta_t;
+
+/// Room for the serialized heads of one batch of responses
+#define RESPONSE_HEAD_BUFFER_SIZE 16384
+
+/// Two iovecs (head and body) per response
+#define RESPONSE_MAX_IOVECS (2 * 32)
+
+int write_http_response(int, const http_response_t *, http_response_meta_t, int);
+
+/// Writes several responses back to back with as few syscalls as possible,
+/// each with its own head details, blocking until they are out. The last
+/// argument is how long (in milliseconds, -1 for no limit) writing all of them
+/// may take before giving up. Returns 0, or -1 and -2 as `http_responses_prepare()` does, -3
+/// on a socket error or -4 on a timeout.
+int write_http_responses(int, const http_response_t *const *, const http_response_meta_t *,
+                         size_t, int);
+
+/// Serializes the heads of as many of the responses as fit into a buffer of
+/// RESPONSE_HEAD_BUFFER_SIZE, and points up to RESPONSE_MAX_IOVECS iovecs at
+/// them and their bodies, for a caller which sends them on its own. Returns
+/// the number of responses prepared (and sets the iovec count), -1 for invalid
+/// arguments or -2 if not even the first head fits.
+ssize_t http_responses_prepare(char *, struct iovec *, size_t *, const http_response_t *const *,
+                               const http_response_meta_t *, size_t);
+
+/// Writes as much of the iovecs as a non-blocking socket takes without
+/// waiting, advancing them past whatever went out; `*iov_count` is left at 0
+/// once all of it has. Returns 0, or -1 on a socket error.
+int http_iov_write(int, struct iovec **, size_t *);
 void http_response_free(http_response_t *);
 
 #endif
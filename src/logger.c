@@ -1,105 +1,416 @@
-
 #include "logger.h"
 
 #include <time.h>
 #include <stdlib.h>
 #include <err.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 
 #include <pthread.h>
 
-typedef enum { TRACE, DEBUG, INFO, WARN, ERROR, FATAL } LogLevel;
+/// Lines longer than this are cut short
+#define LOG_RECORD_SIZE 512
+/// Lines each thread can have waiting for the writer, must be a power of two
+#define LOG_RING_CAPACITY 512
+/// Lines the writer sends out with a single writev()
+#define LOG_MAX_IOVECS 64
+
+#define LOG_CACHE_LINE_SIZE 64
+
+typedef struct {
+        size_t length;
+        char text[LOG_RECORD_SIZE];
+} log_record_t;
+
+/// Single-producer single-consumer ring of formatted lines. The owning thread
+/// is the only one advancing `head`, the writer thread the only one advancing
+/// `tail`, so neither needs more than a load and a store.
+typedef struct _LogRing {
+        _Alignas(LOG_CACHE_LINE_SIZE) _Atomic size_t head;
+        /// Lines which did not fit, counted by the owning thread
+        _Atomic uint64_t dropped;
+
+        _Alignas(LOG_CACHE_LINE_SIZE) _Atomic size_t tail;
+        /// Writer-only: where `tail` moves once the current batch is written,
+        /// and how many drops have been reported so far
+        size_t pending_tail;
+        uint64_t reported_dropped;
+
+        size_t id;
+        struct _LogRing *next;
+        log_record_t records[LOG_RING_CAPACITY];
+} log_ring_t;
+
+typedef struct {
+        time_t second;
+        char text[32];
+        size_t length;
+} log_timestamp_t;
 
-static void log_message(LogLevel, const char *, va_list) __attribute__((format(printf, 2, 0)));
-static const char *log_level_to_string(LogLevel);
+static void log_message_v(log_level_t, const char *, va_list) __attribute__((format(printf, 2, 0)));
+static const char *log_level_to_string(log_level_t);
+
+/// Formats a complete line, always ending in a newline, and returns its length
+static size_t format_line(char *, size_t, log_level_t, const char *, va_list)
+        __attribute__((format(printf, 4, 0)));
+static const log_timestamp_t *cached_timestamp(void);
+
+/// Returns the calling thread's ring, registering one on first use, or NULL
+/// if lines have to be written synchronously
+static log_ring_t *thread_ring(void);
+
+static void start_writer(void);
+static void *writer_function(void *);
+
+/// Gathers whatever the rings hold into one batch and writes it out. Returns
+/// false if there was nothing to write.
+static bool write_batch(void);
+static void writev_all(struct iovec *, size_t);
+static void wake_writer(void);
+
+static void futex_wait(_Atomic uint32_t *, uint32_t);
+static void futex_wake(_Atomic uint32_t *);
 
 static const char *TIME_FORMAT = "%Y-%m-%d %H:%M:%S";
 
-void log_trace(const char *message, ...)
+_Atomic int log_runtime_level = LOG_COMPILE_LEVEL;
+
+static _Atomic(log_ring_t *) rings = NULL;
+static _Atomic size_t ring_count = 0;
+static _Atomic uint64_t total_dropped = 0;
+
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+static _Atomic bool is_writer_running = false;
+/// Futex word the idle writer sleeps on, and whether it is (about to be)
+/// asleep, so producers only make the wake syscall when it is needed
+static _Atomic uint32_t writer_epoch = 0;
+static _Atomic bool is_writer_sleeping = false;
+
+static _Thread_local log_ring_t *current_ring = NULL;
+static _Thread_local log_timestamp_t current_timestamp = { .second = -1 };
+
+void log_set_level(log_level_t level)
 {
-        va_list args;
-        va_start(args, message);
-        log_message(TRACE, message, args);
-        va_end(args);
+        atomic_store_explicit(&log_runtime_level, (int)level, memory_order_relaxed);
 }
 
-void log_debug(const char *message, ...)
+log_level_t log_get_level(void)
 {
-        va_list args;
-        va_start(args, message);
-        log_message(DEBUG, message, args);
-        va_end(args);
+        return (log_level_t)atomic_load_explicit(&log_runtime_level, memory_order_relaxed);
 }
 
-void log_info(const char *message, ...)
+void log_message(log_level_t level, const char *message, ...)
 {
         va_list args;
         va_start(args, message);
-        log_message(INFO, message, args);
+        log_message_v(level, message, args);
         va_end(args);
 }
 
-void log_warn(const char *message, ...)
+void log_fatal(int exit_code, const char *message, ...)
 {
         va_list args;
         va_start(args, message);
-        log_message(DEBUG, message, args);
+        log_message_v(LOG_LEVEL_FATAL, message, args);
         va_end(args);
+        log_flush();
+        exit(exit_code);
 }
 
-void log_error(const char *message, ...)
+void log_flush(void)
 {
-        va_list args;
-        va_start(args, message);
-        log_message(DEBUG, message, args);
-        va_end(args);
+        if (!atomic_load(&is_writer_running))
+                return;
+
+        // wait for everything logged up to now, from any thread, to be written,
+        // but never hang the caller on a writer which cannot make progress
+        const struct timespec PAUSE = { .tv_sec = 0, .tv_nsec = 1000000 };
+        for (int attempt = 0; attempt < 1000; ++attempt) {
+                bool is_drained = true;
+                for (log_ring_t *ring = atomic_load(&rings); ring; ring = ring->next) {
+                        if (atomic_load(&ring->tail) != atomic_load(&ring->head)) {
+                                is_drained = false;
+                                break;
+                        }
+                }
+
+                if (is_drained)
+                        return;
+
+                wake_writer();
+                nanosleep(&PAUSE, NULL);
+        }
 }
 
-void log_fatal(int exit_code, const char *message, ...)
+uint64_t log_dropped(void)
 {
-        va_list args;
-        va_start(args, message);
-        log_message(DEBUG, message, args);
-        va_end(args);
-        exit(exit_code);
+        return atomic_load_explicit(&total_dropped, memory_order_relaxed);
 }
 
-static const char *log_level_to_string(LogLevel level)
+static const char *log_level_to_string(log_level_t level)
 {
         switch (level) {
-        case TRACE:
+        case LOG_LEVEL_TRACE:
                 return "TRACE";
-        case DEBUG:
+        case LOG_LEVEL_DEBUG:
                 return "DEBUG";
-        case INFO:
+        case LOG_LEVEL_INFO:
                 return "INFO";
-        case WARN:
+        case LOG_LEVEL_WARN:
                 return "WARN";
-        case ERROR:
+        case LOG_LEVEL_ERROR:
                 return "ERROR";
-        case FATAL:
+        case LOG_LEVEL_FATAL:
                 return "FATAL";
         default:
                 return "UNKNOWN";
         }
 }
 
-static void log_message(LogLevel level, const char *message, va_list args)
+static void log_message_v(log_level_t level, const char *message, va_list args)
 {
-        static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+        log_ring_t *ring = thread_ring();
+        if (!ring) {
+                // no writer thread, so the line goes out right away; a single
+                // write() keeps lines from different threads from interleaving
+                char line[LOG_RECORD_SIZE];
+                size_t length = format_line(line, sizeof(line), level, message, args);
+                if (write(STDERR_FILENO, line, length) < 0)
+                        return;
+                return;
+        }
 
-        const time_t now = time(NULL);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - tail >= LOG_RING_CAPACITY) {
+                atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+                return;
+        }
+
+        log_record_t *record = &ring->records[head & (LOG_RING_CAPACITY - 1)];
+        record->length = format_line(record->text, sizeof(record->text), level, message, args);
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+        wake_writer();
+}
+
+static size_t format_line(char *line, size_t capacity, log_level_t level, const char *message,
+                          va_list args)
+{
+        const log_timestamp_t *timestamp = cached_timestamp();
         const char *log_level = log_level_to_string(level);
 
-        pthread_mutex_lock(&log_mutex);
-        char serialized_time[64];
-        strftime(serialized_time, sizeof(serialized_time), TIME_FORMAT, localtime(&now));
+        int prefix = snprintf(line, capacity, "%.*s [%s] ", (int)timestamp->length,
+                              timestamp->text, log_level);
+        size_t length = prefix > 0 ? (size_t)prefix : 0;
+        if (length >= capacity - 1)
+                length = capacity - 2;
+
+        int written = vsnprintf(line + length, capacity - length, message, args);
+        if (written > 0)
+                length += (size_t)written;
 
-        fprintf(stderr, "%s [%s] ", serialized_time, log_level);
-        vfprintf(stderr, message, args);
-        fprintf(stderr, "\n");
+        // a cut short line still ends where it should
+        if (length > capacity - 2)
+                length = capacity - 2;
 
-        fflush(stderr);
-        pthread_mutex_unlock(&log_mutex);
+        line[length++] = '\n';
+        return length;
+}
+
+static const log_timestamp_t *cached_timestamp(void)
+{
+        // formatting the time is by far the most expensive part of a line, and
+        // it only changes once a second
+        const time_t now = time(NULL);
+        if (now == current_timestamp.second)
+                return &current_timestamp;
+
+        struct tm local;
+        localtime_r(&now, &local);
+        current_timestamp.length = strftime(current_timestamp.text,
+                                            sizeof(current_timestamp.text), TIME_FORMAT,
+                                            &local);
+        current_timestamp.second = now;
+        return &current_timestamp;
+}
+
+static log_ring_t *thread_ring(void)
+{
+        if (current_ring)
+                return current_ring;
+
+        pthread_once(&writer_once, start_writer);
+        if (!atomic_load(&is_writer_running))
+                return NULL;
+
+        log_ring_t *ring = aligned_alloc(LOG_CACHE_LINE_SIZE, sizeof(log_ring_t));
+        if (!ring)
+                return NULL;
+
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->dropped, 0);
+        atomic_init(&ring->tail, 0);
+        ring->pending_tail = 0;
+        ring->reported_dropped = 0;
+        ring->id = atomic_fetch_add(&ring_count, 1);
+
+        // rings are only ever added, and live as long as the process, so the
+        // writer can walk the list without any further coordination
+        log_ring_t *head = atomic_load_explicit(&rings, memory_order_relaxed);
+        do {
+                ring->next = head;
+        } while (!atomic_compare_exchange_weak_explicit(&rings, &head, ring, memory_order_release,
+                                                        memory_order_relaxed));
+
+        current_ring = ring;
+        return ring;
+}
+
+static void start_writer(void)
+{
+        pthread_t writer;
+        if (pthread_create(&writer, NULL, writer_function, NULL) != 0)
+                return;
+
+        pthread_detach(writer);
+        atomic_store(&is_writer_running, true);
+
+        // lines still in the rings when the process exits normally get written
+        atexit(log_flush);
+}
+
+static void *writer_function(__attribute__((unused)) void *arg)
+{
+        while (true) {
+                if (write_batch())
+                        continue;
+
+                // the epoch is read before announcing the sleep and the rings
+                // are looked at once more after it, so a line pushed in between
+                // either gets picked up or bumps the epoch and cancels the wait
+                uint32_t epoch = atomic_load(&writer_epoch);
+                atomic_store(&is_writer_sleeping, true);
+
+                if (!write_batch())
+                        futex_wait(&writer_epoch, epoch);
+
+                atomic_store(&is_writer_sleeping, false);
+        }
+
+        return NULL;
+}
+
+static bool write_batch(void)
+{
+        struct iovec iov[LOG_MAX_IOVECS];
+        size_t iov_count = 0;
+
+        // drop reports are formatted here, as the writer has no ring of its own
+        char reports[LOG_MAX_IOVECS][128];
+        size_t report_count = 0;
+
+        log_ring_t *first = atomic_load_explicit(&rings, memory_order_acquire);
+        for (log_ring_t *ring = first; ring && iov_count < LOG_MAX_IOVECS; ring = ring->next) {
+                uint64_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+                if (dropped != ring->reported_dropped) {
+                        const log_timestamp_t *timestamp = cached_timestamp();
+                        int length = snprintf(reports[report_count], sizeof(reports[0]),
+                                              "%.*s [WARN] Dropped %lu log lines from thread "
+                                              "%lu, its buffer was full\n",
+                                              (int)timestamp->length, timestamp->text,
+                                              dropped - ring->reported_dropped, ring->id);
+
+                        atomic_fetch_add_explicit(&total_dropped, dropped - ring->reported_dropped,
+                                                  memory_order_relaxed);
+                        ring->reported_dropped = dropped;
+
+                        if (length > 0) {
+                                iov[iov_count].iov_base = reports[report_count];
+                                iov[iov_count].iov_len = (size_t)length < sizeof(reports[0])
+                                                                 ? (size_t)length
+                                                                 : sizeof(reports[0]) - 1;
+                                iov_count++;
+                                report_count++;
+                        }
+                }
+
+                size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+                size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+                for (; tail != head && iov_count < LOG_MAX_IOVECS; ++tail) {
+                        log_record_t *record = &ring->records[tail & (LOG_RING_CAPACITY - 1)];
+                        iov[iov_count].iov_base = record->text;
+                        iov[iov_count].iov_len = record->length;
+                        iov_count++;
+                }
+                ring->pending_tail = tail;
+        }
+
+        if (0 == iov_count)
+                return false;
+
+        writev_all(iov, iov_count);
+
+        // the records can only be reused once they have been written
+        for (log_ring_t *ring = first; ring; ring = ring->next)
+                atomic_store_explicit(&ring->tail, ring->pending_tail, memory_order_release);
+
+        return true;
+}
+
+static void writev_all(struct iovec *iov, size_t iov_count)
+{
+        while (iov_count > 0) {
+                ssize_t written = writev(STDERR_FILENO, iov, (int)iov_count);
+                if (written < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        // nowhere left to report this, the lines are lost
+                        return;
+                }
+
+                size_t remaining = (size_t)written;
+                while (iov_count > 0 && remaining >= iov->iov_len) {
+                        remaining -= iov->iov_len;
+                        iov++;
+                        iov_count--;
+                }
+
+                if (iov_count > 0) {
+                        iov->iov_base = (char *)iov->iov_base + remaining;
+                        iov->iov_len -= remaining;
+                }
+        }
+}
+
+static void wake_writer(void)
+{
+        // pairs with the writer announcing its sleep before its last look at
+        // the rings, see writer_function()
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!atomic_load_explicit(&is_writer_sleeping, memory_order_relaxed))
+                return;
+
+        atomic_fetch_add(&writer_epoch, 1);
+        futex_wake(&writer_epoch);
+}
+
+static void futex_wait(_Atomic uint32_t *word, uint32_t expected)
+{
+        syscall(SYS_futex, (uintptr_t)word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *word)
+{
+        syscall(SYS_futex, (uintptr_t)word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
 }
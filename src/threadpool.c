@@ -2,31 +2,73 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #include "logger.h"
 
 #include "threadpool.h"
 
+/// Dequeue attempts an idle worker makes before going to sleep, since a task
+/// tends to arrive right behind the last one under load
+#define THREADPOOL_SPIN_COUNT 64
+
 typedef struct {
-        threadpool_scheduler_t *scheduler;
-        const char *thread_name;
+        threadpool_worker_t *worker;
+        char *thread_name;
 } thread_creation_args_t;
 
-static threadpool_task_t *threadpool_task_alloc(void (*)(void *), void *);
+/// The worker running on this thread, if it belongs to a pool
+static _Thread_local threadpool_worker_t *current_worker = NULL;
 
-static threadpool_queue_t threadpool_queue_create(void);
+static int threadpool_queue_init(threadpool_queue_t *, size_t);
 static void threadpool_queue_free(threadpool_queue_t *);
-static const threadpool_task_t *threadpool_queue_peek(const threadpool_queue_t *);
-static threadpool_task_t *threadpool_queue_pop_front(threadpool_queue_t *);
-static void threadpool_queue_push_back(threadpool_queue_t *, threadpool_task_t *);
-
-static threadpool_scheduler_t *threadpool_scheduler_create(void);
+static bool threadpool_queue_push(threadpool_queue_t *, threadpool_task_t);
+static bool threadpool_queue_pop(threadpool_queue_t *, threadpool_task_t *);
+
+/// Until this is called, by the owning worker once it has been pinned, the
+/// deque has no room and every push onto it fails
+static int threadpool_deque_init(threadpool_deque_t *, size_t);
+static void threadpool_deque_free(threadpool_deque_t *);
+static bool threadpool_deque_push(threadpool_deque_t *, threadpool_task_t);
+static bool threadpool_deque_pop(threadpool_deque_t *, threadpool_task_t *);
+
+/// Returns the following status:
+///  1 - a task was stolen
+///  0 - the deque is empty
+/// -1 - lost a race for the top task, the deque may still hold others
+static int threadpool_deque_steal(threadpool_deque_t *, threadpool_task_t *);
+
+/// Tries every other worker's deque once, starting from a random one
+static bool threadpool_worker_steal(threadpool_worker_t *, threadpool_task_t *);
+static uint32_t threadpool_worker_random(threadpool_worker_t *);
+
+static threadpool_scheduler_t *threadpool_scheduler_create(threadpool_policy_t, size_t,
+                                                           const cpu_affinity_t *);
 static void threadpool_scheduler_free(threadpool_scheduler_t *);
+static void threadpool_scheduler_terminate(threadpool_scheduler_t *);
+
+/// Blocks until a task is available and returns true, or returns false once
+/// the scheduler has been terminated
+static bool threadpool_scheduler_take(threadpool_worker_t *, threadpool_task_t *);
+
+/// Looks for a task once, without blocking: the worker's own deque first,
+/// then the shared queue, then the other workers' deques
+static bool threadpool_scheduler_find(threadpool_worker_t *, threadpool_task_t *);
+static void threadpool_scheduler_wake(threadpool_scheduler_t *, int);
+
+static void futex_wait(_Atomic uint32_t *, uint32_t);
+static void futex_wake(_Atomic uint32_t *, int);
+static void cpu_relax(void);
 
 static void *threadpool_worker_function(void *);
 static void free_threads(pthread_t *, size_t);
 
-threadpool_t *threadpool_create(size_t threads_count)
+threadpool_t *threadpool_create(size_t threads_count, threadpool_policy_t policy,
+                                const cpu_affinity_t *affinity)
 {
         pthread_t *threads = malloc(threads_count * sizeof(pthread_t));
         if (!threads) {
@@ -34,34 +76,53 @@ threadpool_t *threadpool_create(size_t threads_count)
                 return NULL;
         }
 
-        threadpool_scheduler_t *scheduler = threadpool_scheduler_create();
+        threadpool_scheduler_t *scheduler =
+                threadpool_scheduler_create(policy, threads_count, affinity);
         if (!scheduler) {
                 log_error("Failed to create thread pool scheduler");
                 free(threads);
                 return NULL;
         }
 
-        for (size_t i = 0; i < threads_count; ++i) {
-                pthread_t *thread = &threads[i];
+        threadpool_t *pool = malloc(sizeof(threadpool_t));
+        if (!pool) {
+                log_warn("Failed to allocate thread pool structure");
+                threadpool_scheduler_free(scheduler);
+                free(threads);
+                return NULL;
+        }
+
+        size_t created = 0;
+        for (; created < threads_count; ++created) {
+                pthread_t *thread = &threads[created];
 
                 const size_t MAX_THREAD_NAME_LENGTH = 32;
                 char *thread_name = malloc(MAX_THREAD_NAME_LENGTH);
-                snprintf(thread_name, MAX_THREAD_NAME_LENGTH, "worker-thread-%lu", i);
-
                 thread_creation_args_t *args = malloc(sizeof(thread_creation_args_t));
-                args->scheduler = scheduler;
+                if (!thread_name || !args) {
+                        log_error("Failed to allocate arguments for thread %lu", created);
+                        free(thread_name);
+                        free(args);
+                        break;
+                }
+
+                snprintf(thread_name, MAX_THREAD_NAME_LENGTH, "worker-thread-%lu", created);
+                args->worker = &scheduler->workers[created];
                 args->thread_name = thread_name;
 
                 if (pthread_create(thread, NULL, threadpool_worker_function, args) != 0) {
-                        log_error("Failed to create thread %lu", i);
-                        free_threads(threads, i);
-                        return NULL;
+                        log_error("Failed to create thread %lu", created);
+                        free(thread_name);
+                        free(args);
+                        break;
                 }
         }
 
-        threadpool_t *pool = malloc(sizeof(threadpool_t));
-        if (!pool) {
-                log_warn("Failed to allocate thread pool structure");
+        if (created < threads_count) {
+                threadpool_scheduler_terminate(scheduler);
+                free_threads(threads, created);
+                threadpool_scheduler_free(scheduler);
+                free(pool);
                 return NULL;
         }
 
@@ -79,62 +140,70 @@ void threadpool_free(threadpool_t *pool)
                 return;
         }
 
-        pthread_mutex_lock(&pool->scheduler->mutex);
-        pool->scheduler->is_terminated = true;
-        pthread_cond_broadcast(&pool->scheduler->notify);
-        pthread_mutex_unlock(&pool->scheduler->mutex);
-
-        threadpool_queue_free(&pool->scheduler->task_queue);
-
-        pthread_mutex_destroy(&pool->scheduler->mutex);
-        pthread_cond_destroy(&pool->scheduler->notify);
+        // workers finish the task at hand and exit, only then is the scheduler
+        // they are reading from released
+        threadpool_scheduler_terminate(pool->scheduler);
+        free_threads(pool->threads, pool->thread_count);
 
         threadpool_scheduler_free(pool->scheduler);
-        free_threads(pool->threads, pool->thread_count);
         free(pool);
         pool = NULL;
 }
 
-void threadpool_execute(threadpool_t *pool, void (*function)(void *), void *arg)
+int threadpool_execute(threadpool_t *pool, threadpool_function_t function, void *arg)
 {
         if (!pool || !function) {
                 log_trace("Trying to add a NULL task to a NULL thread pool");
-                return;
+                return -1;
         }
 
-        threadpool_task_t *task = threadpool_task_alloc(function, arg);
-        if (!task) {
-                log_error("Failed to allocate task for thread pool");
-                return;
+        threadpool_task_t task = { .function = function, .arg = arg };
+        if (!threadpool_queue_push(&pool->scheduler->task_queue, task)) {
+                log_trace("Thread pool queue is full");
+                return -2;
         }
 
-        pthread_mutex_lock(&pool->scheduler->mutex);
-        threadpool_queue_push_back(&pool->scheduler->task_queue, task);
-        pthread_cond_signal(&pool->scheduler->notify);
-        pthread_mutex_unlock(&pool->scheduler->mutex);
+        threadpool_scheduler_wake(pool->scheduler, 1);
+        return 0;
 }
 
-static threadpool_task_t *threadpool_task_alloc(void (*function)(void *), void *arg)
+int threadpool_execute_local(threadpool_t *pool, threadpool_function_t function, void *arg)
 {
-        threadpool_task_t *task = malloc(sizeof(threadpool_task_t));
-        if (!task) {
-                log_trace("Failed to allocate thread pool task");
-                return NULL;
+        if (!pool || !function) {
+                log_trace("Trying to add a NULL task to a NULL thread pool");
+                return -1;
         }
 
-        task->function = function;
-        task->arg = arg;
-        task->next = NULL;
+        threadpool_worker_t *worker = current_worker;
+        if (pool->scheduler->policy != THREADPOOL_POLICY_WORK_STEALING || !worker ||
+            worker->scheduler != pool->scheduler)
+                return threadpool_execute(pool, function, arg);
+
+        threadpool_task_t task = { .function = function, .arg = arg };
+        if (!threadpool_deque_push(&worker->deque, task))
+                return threadpool_execute(pool, function, arg);
 
-        return task;
+        // this worker picks the task up once done with the current one, but an
+        // idle one may get to it sooner
+        threadpool_scheduler_wake(pool->scheduler, 1);
+        return 0;
 }
 
-static threadpool_queue_t threadpool_queue_create(void)
+static int threadpool_queue_init(threadpool_queue_t *queue, size_t capacity)
 {
-        threadpool_queue_t queue;
-        queue.head = NULL;
-        queue.tail = NULL;
-        return queue;
+        queue->cells = malloc(capacity * sizeof(threadpool_cell_t));
+        if (!queue->cells) {
+                log_trace("Failed to allocate task queue cells");
+                return -1;
+        }
+
+        for (size_t i = 0; i < capacity; ++i)
+                atomic_init(&queue->cells[i].sequence, i);
+
+        queue->mask = capacity - 1;
+        atomic_init(&queue->enqueue_position, 0);
+        atomic_init(&queue->dequeue_position, 0);
+        return 0;
 }
 
 static void threadpool_queue_free(threadpool_queue_t *queue)
@@ -144,81 +213,249 @@ static void threadpool_queue_free(threadpool_queue_t *queue)
                 return;
         }
 
-        for (threadpool_task_t *task = queue->head; task != NULL;) {
-                threadpool_task_t *next_task = task->next;
-                free(task);
-                task = next_task;
-        }
-
-        queue->head = NULL;
-        queue->tail = NULL;
+        free(queue->cells);
+        queue->cells = NULL;
 }
 
-static const threadpool_task_t *threadpool_queue_peek(const threadpool_queue_t *queue)
+static bool threadpool_queue_push(threadpool_queue_t *queue, threadpool_task_t task)
 {
-        if (!queue) {
-                log_trace("Trying to peek into a NULL task queue");
-                return NULL;
+        size_t position = atomic_load_explicit(&queue->enqueue_position, memory_order_relaxed);
+
+        while (true) {
+                threadpool_cell_t *cell = &queue->cells[position & queue->mask];
+                size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+                intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+                if (0 == difference) {
+                        // on failure the CAS reloads the position for the next try
+                        if (atomic_compare_exchange_weak_explicit(&queue->enqueue_position,
+                                                                  &position, position + 1,
+                                                                  memory_order_relaxed,
+                                                                  memory_order_relaxed)) {
+                                cell->task = task;
+                                atomic_store_explicit(&cell->sequence, position + 1,
+                                                      memory_order_release);
+                                return true;
+                        }
+                } else if (difference < 0) {
+                        // the cell still holds the task from one lap ago
+                        return false;
+                } else {
+                        position = atomic_load_explicit(&queue->enqueue_position,
+                                                        memory_order_relaxed);
+                }
         }
-        return queue->head;
 }
 
-static threadpool_task_t *threadpool_queue_pop_front(threadpool_queue_t *queue)
+static bool threadpool_queue_pop(threadpool_queue_t *queue, threadpool_task_t *task)
 {
-        if (!queue || !queue->head) {
-                log_trace("Trying to pop from an empty or NULL task queue");
-                return NULL;
+        size_t position = atomic_load_explicit(&queue->dequeue_position, memory_order_relaxed);
+
+        while (true) {
+                threadpool_cell_t *cell = &queue->cells[position & queue->mask];
+                size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+                intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+
+                if (0 == difference) {
+                        if (atomic_compare_exchange_weak_explicit(&queue->dequeue_position,
+                                                                  &position, position + 1,
+                                                                  memory_order_relaxed,
+                                                                  memory_order_relaxed)) {
+                                *task = cell->task;
+                                // hand the cell to the producer of the next lap
+                                atomic_store_explicit(&cell->sequence,
+                                                      position + queue->mask + 1,
+                                                      memory_order_release);
+                                return true;
+                        }
+                } else if (difference < 0) {
+                        // nothing has been published in this cell yet
+                        return false;
+                } else {
+                        position = atomic_load_explicit(&queue->dequeue_position,
+                                                        memory_order_relaxed);
+                }
         }
+}
 
-        threadpool_task_t *popped_task = queue->head;
-        queue->head = popped_task->next;
+static int threadpool_deque_init(threadpool_deque_t *deque, size_t capacity)
+{
+        deque->cells = malloc(capacity * sizeof(threadpool_deque_cell_t));
+        if (!deque->cells) {
+                log_trace("Failed to allocate worker deque cells");
+                return -1;
+        }
 
-        if (!queue->head) {
-                queue->tail = NULL;
+        for (size_t i = 0; i < capacity; ++i) {
+                atomic_init(&deque->cells[i].function, NULL);
+                atomic_init(&deque->cells[i].arg, NULL);
         }
 
-        return popped_task;
+        deque->mask = (int64_t)capacity - 1;
+        return 0;
 }
 
-static void threadpool_queue_push_back(threadpool_queue_t *queue, threadpool_task_t *task)
+static void threadpool_deque_free(threadpool_deque_t *deque)
 {
-        if (!queue || !task) {
-                log_trace("Trying to push a NULL task or into a NULL queue");
-                return;
+        free(deque->cells);
+        deque->cells = NULL;
+}
+
+static bool threadpool_deque_push(threadpool_deque_t *deque, threadpool_task_t task)
+{
+        int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+        int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+        if (bottom - top > deque->mask)
+                return false;
+
+        threadpool_deque_cell_t *cell = &deque->cells[bottom & deque->mask];
+        atomic_store_explicit(&cell->function, task.function, memory_order_relaxed);
+        atomic_store_explicit(&cell->arg, task.arg, memory_order_relaxed);
+
+        atomic_thread_fence(memory_order_release);
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return true;
+}
+
+static bool threadpool_deque_pop(threadpool_deque_t *deque, threadpool_task_t *task)
+{
+        int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+        atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+        if (top > bottom) {
+                atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+                return false;
         }
 
-        if (!queue->tail) {
-                queue->head = task;
-                queue->tail = task;
-        } else {
-                queue->tail->next = task;
-                queue->tail = task;
+        threadpool_deque_cell_t *cell = &deque->cells[bottom & deque->mask];
+        task->function = atomic_load_explicit(&cell->function, memory_order_relaxed);
+        task->arg = atomic_load_explicit(&cell->arg, memory_order_relaxed);
+
+        if (top < bottom)
+                return true;
+
+        // the last task, which a thief may be taking at the same time
+        bool is_taken = atomic_compare_exchange_strong_explicit(
+                &deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return is_taken;
+}
+
+static int threadpool_deque_steal(threadpool_deque_t *deque, threadpool_task_t *task)
+{
+        int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+        if (top >= bottom)
+                return 0;
+
+        threadpool_deque_cell_t *cell = &deque->cells[top & deque->mask];
+        threadpool_task_t stolen = {
+                .function = atomic_load_explicit(&cell->function, memory_order_relaxed),
+                .arg = atomic_load_explicit(&cell->arg, memory_order_relaxed),
+        };
+
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed))
+                return -1;
+
+        *task = stolen;
+        return 1;
+}
+
+static bool threadpool_worker_steal(threadpool_worker_t *worker, threadpool_task_t *task)
+{
+        threadpool_scheduler_t *scheduler = worker->scheduler;
+        size_t count = scheduler->worker_count;
+        if (count < 2)
+                return false;
+
+        size_t start = threadpool_worker_random(worker) % count;
+        bool is_contended = true;
+
+        // a lost race means the victim still had tasks, so keep going around
+        // until every deque has been seen empty
+        while (is_contended) {
+                is_contended = false;
+
+                for (size_t i = 0; i < count; ++i) {
+                        threadpool_worker_t *victim = &scheduler->workers[(start + i) % count];
+                        if (victim == worker)
+                                continue;
+
+                        int status = threadpool_deque_steal(&victim->deque, task);
+                        if (status > 0)
+                                return true;
+                        if (status < 0)
+                                is_contended = true;
+                }
         }
+
+        return false;
 }
 
-static threadpool_scheduler_t *threadpool_scheduler_create(void)
+static uint32_t threadpool_worker_random(threadpool_worker_t *worker)
 {
-        threadpool_scheduler_t *scheduler = malloc(sizeof(threadpool_scheduler_t));
+        // xorshift32, plenty for spreading thieves over victims
+        uint32_t x = worker->random_state;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        worker->random_state = x;
+        return x;
+}
+
+static threadpool_scheduler_t *threadpool_scheduler_create(threadpool_policy_t policy,
+                                                           size_t worker_count,
+                                                           const cpu_affinity_t *affinity)
+{
+        threadpool_scheduler_t *scheduler =
+                aligned_alloc(THREADPOOL_CACHE_LINE_SIZE, sizeof(threadpool_scheduler_t));
         if (!scheduler) {
                 log_trace("Failed to allocate thread pool scheduler");
                 return NULL;
         }
 
-        scheduler->task_queue = threadpool_queue_create();
-        if (pthread_mutex_init(&scheduler->mutex, NULL) != 0) {
-                log_error("Failed to initialize task mutex");
+        if (threadpool_queue_init(&scheduler->task_queue, THREADPOOL_QUEUE_CAPACITY) != 0) {
+                log_error("Failed to initialize task queue");
                 free(scheduler);
                 return NULL;
         }
 
-        if (pthread_cond_init(&scheduler->notify, NULL) != 0) {
-                log_error("Failed to initialize terminate condition variable");
-                pthread_mutex_destroy(&scheduler->mutex);
+        scheduler->policy = policy;
+        scheduler->affinity = affinity ? *affinity : (cpu_affinity_t){ .mode = CPU_AFFINITY_NONE };
+        scheduler->worker_count = worker_count;
+        scheduler->workers = aligned_alloc(THREADPOOL_CACHE_LINE_SIZE,
+                                           worker_count * sizeof(threadpool_worker_t));
+        if (!scheduler->workers) {
+                log_error("Failed to allocate thread pool workers");
+                threadpool_queue_free(&scheduler->task_queue);
                 free(scheduler);
                 return NULL;
         }
 
-        scheduler->is_terminated = false;
+        for (size_t i = 0; i < worker_count; ++i) {
+                threadpool_worker_t *worker = &scheduler->workers[i];
+                worker->scheduler = scheduler;
+                worker->index = i;
+                // xorshift must never be seeded with 0
+                worker->random_state = (uint32_t)i * 2654435761u + 1;
+
+                // the cells are allocated by the worker itself, see
+                // threadpool_worker_function()
+                worker->deque.cells = NULL;
+                worker->deque.mask = -1;
+                atomic_init(&worker->deque.top, 0);
+                atomic_init(&worker->deque.bottom, 0);
+        }
+
+        atomic_init(&scheduler->wake_epoch, 0);
+        atomic_init(&scheduler->sleeper_count, 0);
+        atomic_init(&scheduler->is_terminated, false);
         return scheduler;
 }
 
@@ -229,30 +466,106 @@ static void threadpool_scheduler_free(threadpool_scheduler_t *scheduler)
                 return;
         }
 
-        pthread_mutex_lock(&scheduler->mutex);
-        scheduler->is_terminated = true;
-        pthread_cond_broadcast(&scheduler->notify);
-        pthread_mutex_unlock(&scheduler->mutex);
+        for (size_t i = 0; i < scheduler->worker_count; ++i)
+                threadpool_deque_free(&scheduler->workers[i].deque);
+        free(scheduler->workers);
 
         threadpool_queue_free(&scheduler->task_queue);
+        free(scheduler);
+}
+
+static void threadpool_scheduler_terminate(threadpool_scheduler_t *scheduler)
+{
+        atomic_store(&scheduler->is_terminated, true);
+        threadpool_scheduler_wake(scheduler, INT_MAX);
+}
+
+static bool threadpool_scheduler_take(threadpool_worker_t *worker, threadpool_task_t *task)
+{
+        threadpool_scheduler_t *scheduler = worker->scheduler;
+
+        while (true) {
+                for (size_t i = 0; i < THREADPOOL_SPIN_COUNT; ++i) {
+                        if (atomic_load_explicit(&scheduler->is_terminated, memory_order_relaxed))
+                                return false;
+
+                        if (threadpool_scheduler_find(worker, task))
+                                return true;
+
+                        cpu_relax();
+                }
+
+                // The epoch is read before announcing the sleep and the queue is
+                // checked once more after it. A producer either sees the sleeper
+                // and bumps the epoch, making the wait return at once, or pushed
+                // early enough for the last pop to find its task.
+                uint32_t epoch = atomic_load(&scheduler->wake_epoch);
+                atomic_fetch_add(&scheduler->sleeper_count, 1);
+
+                bool has_task = threadpool_scheduler_find(worker, task);
+                if (!has_task && !atomic_load(&scheduler->is_terminated))
+                        futex_wait(&scheduler->wake_epoch, epoch);
+
+                atomic_fetch_sub(&scheduler->sleeper_count, 1);
 
-        pthread_mutex_destroy(&scheduler->mutex);
-        pthread_cond_destroy(&scheduler->notify);
+                if (has_task)
+                        return true;
+        }
+}
+
+static bool threadpool_scheduler_find(threadpool_worker_t *worker, threadpool_task_t *task)
+{
+        threadpool_scheduler_t *scheduler = worker->scheduler;
+
+        if (scheduler->policy != THREADPOOL_POLICY_WORK_STEALING)
+                return threadpool_queue_pop(&scheduler->task_queue, task);
+
+        return threadpool_deque_pop(&worker->deque, task) ||
+               threadpool_queue_pop(&scheduler->task_queue, task) ||
+               threadpool_worker_steal(worker, task);
+}
+
+static void threadpool_scheduler_wake(threadpool_scheduler_t *scheduler, int count)
+{
+        // pairs with the sleeper announcing itself before its last look at the
+        // queue, see threadpool_scheduler_take()
+        atomic_thread_fence(memory_order_seq_cst);
+        if (0 == atomic_load_explicit(&scheduler->sleeper_count, memory_order_relaxed))
+                return;
+
+        atomic_fetch_add(&scheduler->wake_epoch, 1);
+        futex_wake(&scheduler->wake_epoch, count);
+}
+
+static void futex_wait(_Atomic uint32_t *word, uint32_t expected)
+{
+        // returns early on a changed word, a wake or a signal, all of which the
+        // caller handles by looking at the queue again; the kernel only needs
+        // the address, an _Atomic uint32_t has the same representation
+        syscall(SYS_futex, (uintptr_t)word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *word, int count)
+{
+        syscall(SYS_futex, (uintptr_t)word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        __asm__ __volatile__("yield");
+#endif
 }
 
 static void free_threads(pthread_t *threads, size_t threads_count)
 {
         if (!threads) {
-                log_trace("Calling `clear_failed_threadpool()` with no threads");
+                log_trace("Calling `free_threads()` with no threads");
                 return;
         }
 
-        for (size_t i = 0; i < threads_count; ++i) {
-                pthread_t *thread = &threads[i];
-                if (pthread_cancel(*thread) != 0)
-                        log_trace("Failed canceling threadpool thread %lu", i);
-        }
-
         for (size_t i = 0; i < threads_count; ++i) {
                 pthread_t *thread = &threads[i];
                 if (pthread_join(*thread, NULL) != 0)
@@ -272,37 +585,36 @@ static void *threadpool_worker_function(void *arg)
 
         thread_creation_args_t *args = (thread_creation_args_t *)arg;
 
-        threadpool_scheduler_t *scheduler = args->scheduler;
-        threadpool_queue_t *queue = &args->scheduler->task_queue;
-        const char *thread_name = args->thread_name;
-
-        log_info("[%s] Started thread", thread_name);
+        threadpool_worker_t *worker = args->worker;
+        char *thread_name = args->thread_name;
+        free(args);
 
-        while (true) {
-                pthread_mutex_lock(&scheduler->mutex);
+        current_worker = worker;
+        threadpool_scheduler_t *scheduler = worker->scheduler;
 
-                while (!threadpool_queue_peek(queue) && !scheduler->is_terminated)
-                        pthread_cond_wait(&scheduler->notify, &scheduler->mutex);
+        // pinned first, so that everything this worker allocates from here on
+        // lands on its own NUMA node
+        if (cpu_affinity_apply(&scheduler->affinity, worker->index, 0) != 0)
+                log_warn("[%s] Running unpinned", thread_name);
 
-                if (scheduler->is_terminated) {
-                        log_info("[%s] Thread is terminating", thread_name);
-                        pthread_mutex_unlock(&scheduler->mutex);
-                        pthread_exit(NULL);
-                }
+        if (scheduler->policy == THREADPOOL_POLICY_WORK_STEALING &&
+            threadpool_deque_init(&worker->deque, THREADPOOL_DEQUE_CAPACITY) != 0)
+                log_warn("[%s] Running without a local deque", thread_name);
 
-                threadpool_task_t *task = threadpool_queue_pop_front(queue);
-
-                pthread_mutex_unlock(&scheduler->mutex);
-
-                if (!task) {
-                        log_warn("[%s] Received NULL task for execution", thread_name);
-                        continue;
-                }
+        unsigned int cpu = 0;
+        unsigned int node = 0;
+        if (getcpu(&cpu, &node) == 0)
+                log_info("[%s] Started thread on CPU %u (node %u)", thread_name, cpu, node);
+        else
+                log_info("[%s] Started thread", thread_name);
 
+        threadpool_task_t task;
+        while (threadpool_scheduler_take(worker, &task)) {
                 log_trace("[%s] Executing task", thread_name);
-                task->function(task->arg);
-                free(task);
+                task.function(task.arg);
         }
 
+        log_info("[%s] Thread is terminating", thread_name);
+        free(thread_name);
         return NULL;
 }
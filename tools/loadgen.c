@@ -0,0 +1,814 @@
+// Closed-loop HTTP load generator for end to end runs against starcaller.
+//
+// Every thread drives its share of the connections from its own epoll
+// instance, keeping up to `depth` requests in flight on each. Latencies are
+// recorded into log-linear histograms and corrected for coordinated omission:
+// with a target rate (-r) every request is timed from when it was due to be
+// sent rather than when it actually was, and in closed loop the histogram is
+// back-filled with the samples a stalled connection failed to take.
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#define LOADGEN_MAX_DEPTH 64
+#define LOADGEN_BUFFER_SIZE 65536
+#define LOADGEN_MAX_EVENTS 256
+
+/// Every power of two is split into 2^SUB_BITS buckets, for about 3% precision
+#define HISTOGRAM_SUB_BITS 5
+/// Latencies of 2^MAX_SHIFT nanoseconds (about 18 minutes) and above share the
+/// last bucket
+#define HISTOGRAM_MAX_SHIFT 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_SHIFT - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+typedef struct {
+        const char *address;
+        unsigned short port;
+        const char *path;
+        size_t connections;
+        size_t threads;
+        double duration_s;
+        double warmup_s;
+        size_t depth;
+        /// Requests per second over all connections, 0 for as many as possible
+        double rate;
+        bool keep_alive;
+} loadgen_options_t;
+
+typedef struct {
+        uint64_t counts[HISTOGRAM_BUCKETS];
+        uint64_t total;
+        uint64_t max;
+} histogram_t;
+
+struct _Worker;
+
+typedef struct {
+        int fd;
+        struct _Worker *worker;
+        bool is_connected;
+
+        /// When each request in flight was sent (or due, with a target rate),
+        /// oldest first
+        uint64_t sent_at[LOADGEN_MAX_DEPTH];
+        size_t sent_head;
+        size_t in_flight;
+        uint64_t next_send_at;
+
+        /// Requests queued but not yet fully written, as a window into the
+        /// worker's buffer of repeated requests
+        size_t pending_offset;
+        size_t pending_length;
+
+        char buffer[LOADGEN_BUFFER_SIZE];
+        size_t length;
+        bool in_body;
+        size_t body_remaining;
+        int status;
+        bool closes;
+} connection_t;
+
+typedef struct _Worker {
+        const loadgen_options_t *options;
+        pthread_t thread;
+        int epoll_fd;
+        /// With a target rate, fires when the next request is due, much more
+        /// precisely than an epoll timeout could
+        int timer_fd;
+
+        connection_t *connections;
+        size_t connection_count;
+        /// Time between two requests on one connection with a target rate
+        uint64_t interval_ns;
+
+        histogram_t histogram;
+        uint64_t completed;
+        uint64_t non_2xx;
+        uint64_t errors;
+        uint64_t reconnects;
+} worker_t;
+
+static void usage(const char *);
+static int parse_options(int, char **, loadgen_options_t *);
+
+static void *worker_function(void *);
+/// Arms the timer for the earliest request due on a connection with room for it
+static void worker_schedule(worker_t *);
+static int connection_open(connection_t *);
+static void connection_reset(connection_t *);
+/// Queues whatever requests are due and writes out as much as the socket takes
+static int connection_send(connection_t *, uint64_t);
+static int connection_flush(connection_t *);
+static int connection_receive(connection_t *);
+/// Consumes every complete response in the buffer, returning -1 on garbage
+static int connection_parse(connection_t *);
+static void connection_complete(connection_t *);
+
+static void histogram_record(histogram_t *, uint64_t);
+static size_t histogram_bucket(uint64_t);
+static uint64_t histogram_value(size_t);
+static void histogram_merge(histogram_t *, const histogram_t *);
+/// Adds the samples a connection blocked on a slow response would have taken
+/// had it kept sending every `interval` nanoseconds, after HdrHistogram
+static void histogram_correct(histogram_t *, const histogram_t *, uint64_t);
+/// In nanoseconds
+static double histogram_percentile(const histogram_t *, double);
+
+static uint64_t now_ns(void);
+static void sleep_s(double);
+
+static struct sockaddr_in target;
+/// `depth + 1` back to back copies of the request, so any window of up to
+/// `depth` requests starting within the first one is contiguous
+static char *requests;
+static size_t request_length;
+
+static _Atomic bool is_running = true;
+static _Atomic bool is_recording = false;
+
+int main(int argc, char **argv)
+{
+        loadgen_options_t options = {
+                .address = "127.0.0.1",
+                .port = 8080,
+                .path = "/",
+                .connections = 64,
+                .threads = 2,
+                .duration_s = 10,
+                .warmup_s = 1,
+                .depth = 1,
+                .rate = 0,
+                .keep_alive = true,
+        };
+        if (parse_options(argc, argv, &options) != 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        target.sin_family = AF_INET;
+        target.sin_port = htons(options.port);
+        if (inet_pton(AF_INET, options.address, &target.sin_addr) != 1) {
+                fprintf(stderr, "Invalid address: %s\n", options.address);
+                return EXIT_FAILURE;
+        }
+
+        char request[1024];
+        int length = snprintf(request, sizeof(request),
+                              "GET %s HTTP/1.1\r\n"
+                              "Host: %s:%u\r\n"
+                              "User-Agent: starcaller-loadgen\r\n"
+                              "%s"
+                              "\r\n",
+                              options.path, options.address, options.port,
+                              options.keep_alive ? "" : "Connection: close\r\n");
+        if (length < 0 || (size_t)length >= sizeof(request)) {
+                fprintf(stderr, "Path too long\n");
+                return EXIT_FAILURE;
+        }
+
+        request_length = (size_t)length;
+        requests = malloc((options.depth + 1) * request_length);
+        worker_t *workers = calloc(options.threads, sizeof(worker_t));
+        connection_t *connections = calloc(options.connections, sizeof(connection_t));
+        if (!requests || !workers || !connections) {
+                fprintf(stderr, "Out of memory\n");
+                return EXIT_FAILURE;
+        }
+        for (size_t i = 0; i <= options.depth; ++i)
+                memcpy(requests + i * request_length, request, request_length);
+
+        size_t first = 0;
+        for (size_t i = 0; i < options.threads; ++i) {
+                worker_t *worker = &workers[i];
+                size_t count = options.connections / options.threads +
+                               (i < options.connections % options.threads ? 1 : 0);
+
+                worker->options = &options;
+                worker->connections = connections + first;
+                worker->connection_count = count;
+                worker->interval_ns = options.rate > 0
+                                              ? (uint64_t)((double)options.connections /
+                                                           options.rate * 1e9)
+                                              : 0;
+                first += count;
+
+                if (pthread_create(&worker->thread, NULL, worker_function, worker) != 0) {
+                        fprintf(stderr, "Failed to start thread %zu\n", i);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        sleep_s(options.warmup_s);
+        atomic_store(&is_recording, true);
+        uint64_t started = now_ns();
+
+        sleep_s(options.duration_s);
+        atomic_store(&is_recording, false);
+        double elapsed_s = (double)(now_ns() - started) / 1e9;
+
+        atomic_store(&is_running, false);
+
+        histogram_t *raw = calloc(1, sizeof(histogram_t));
+        histogram_t *corrected = calloc(1, sizeof(histogram_t));
+        if (!raw || !corrected) {
+                fprintf(stderr, "Out of memory\n");
+                return EXIT_FAILURE;
+        }
+
+        uint64_t completed = 0;
+        uint64_t non_2xx = 0;
+        uint64_t errors = 0;
+        uint64_t reconnects = 0;
+        for (size_t i = 0; i < options.threads; ++i) {
+                pthread_join(workers[i].thread, NULL);
+                histogram_merge(raw, &workers[i].histogram);
+                completed += workers[i].completed;
+                non_2xx += workers[i].non_2xx;
+                errors += workers[i].errors;
+                reconnects += workers[i].reconnects;
+        }
+
+        double throughput = (double)completed / elapsed_s;
+
+        // with a target rate, samples were timed from when they were due and
+        // need no further correction; in closed loop, every connection would
+        // have sent its next request one mean service time after the last
+        uint64_t interval = 0;
+        if (options.rate <= 0 && throughput > 0)
+                interval = (uint64_t)((double)(options.connections * options.depth) /
+                                      throughput * 1e9);
+        histogram_correct(corrected, raw, interval);
+
+        printf("%zu connections, %zu threads, depth %zu, %.1fs, %s\n", options.connections,
+               options.threads, options.depth, elapsed_s,
+               options.rate > 0 ? "open loop" : "closed loop");
+        printf("  requests    %lu (%.1f req/s)\n", completed, throughput);
+        printf("  non-2xx     %lu\n", non_2xx);
+        printf("  errors      %lu (reconnects: %lu)\n", errors, reconnects);
+        printf("  latency     p50 %.1fus  p99 %.1fus  p99.9 %.1fus  max %.1fus\n",
+               histogram_percentile(corrected, 0.5) / 1e3,
+               histogram_percentile(corrected, 0.99) / 1e3,
+               histogram_percentile(corrected, 0.999) / 1e3,
+               (double)corrected->max / 1e3);
+        printf("  uncorrected p50 %.1fus  p99 %.1fus  p99.9 %.1fus\n",
+               histogram_percentile(raw, 0.5) / 1e3,
+               histogram_percentile(raw, 0.99) / 1e3,
+               histogram_percentile(raw, 0.999) / 1e3);
+
+        printf("{\"connections\": %zu, \"threads\": %zu, \"depth\": %zu, \"rate\": %.1f, "
+               "\"duration_s\": %.3f, \"requests\": %lu, \"rps\": %.1f, \"non_2xx\": %lu, "
+               "\"errors\": %lu, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, "
+               "\"max_us\": %.1f}\n",
+               options.connections, options.threads, options.depth, options.rate, elapsed_s,
+               completed, throughput, non_2xx, errors,
+               histogram_percentile(corrected, 0.5) / 1e3,
+               histogram_percentile(corrected, 0.99) / 1e3,
+               histogram_percentile(corrected, 0.999) / 1e3,
+               (double)corrected->max / 1e3);
+
+        free(raw);
+        free(corrected);
+        free(connections);
+        free(workers);
+        free(requests);
+        return completed > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void usage(const char *name)
+{
+        fprintf(stderr,
+                "Usage: %s [options]\n"
+                "  -a ADDRESS   IPv4 address of the server (127.0.0.1)\n"
+                "  -p PORT      port of the server (8080)\n"
+                "  -u PATH      path to request (/)\n"
+                "  -c COUNT     connections (64)\n"
+                "  -t COUNT     threads (2)\n"
+                "  -d SECONDS   duration of the measured run (10)\n"
+                "  -w SECONDS   warm-up before measuring (1)\n"
+                "  -D DEPTH     requests pipelined on each connection (1, at most %d)\n"
+                "  -r RATE      requests per second over all connections, closed loop when 0\n"
+                "  -k           close the connection after every request\n",
+                name, LOADGEN_MAX_DEPTH);
+}
+
+static int parse_options(int argc, char **argv, loadgen_options_t *options)
+{
+        int option;
+        while ((option = getopt(argc, argv, "a:p:u:c:t:d:w:D:r:kh")) != -1) {
+                switch (option) {
+                case 'a':
+                        options->address = optarg;
+                        break;
+                case 'p':
+                        options->port = (unsigned short)strtoul(optarg, NULL, 10);
+                        break;
+                case 'u':
+                        options->path = optarg;
+                        break;
+                case 'c':
+                        options->connections = strtoul(optarg, NULL, 10);
+                        break;
+                case 't':
+                        options->threads = strtoul(optarg, NULL, 10);
+                        break;
+                case 'd':
+                        options->duration_s = strtod(optarg, NULL);
+                        break;
+                case 'w':
+                        options->warmup_s = strtod(optarg, NULL);
+                        break;
+                case 'D':
+                        options->depth = strtoul(optarg, NULL, 10);
+                        break;
+                case 'r':
+                        options->rate = strtod(optarg, NULL);
+                        break;
+                case 'k':
+                        options->keep_alive = false;
+                        break;
+                default:
+                        return -1;
+                }
+        }
+
+        if (0 == options->threads || options->connections < options->threads)
+                return -1;
+        if (0 == options->depth || options->depth > LOADGEN_MAX_DEPTH)
+                return -1;
+        if (options->duration_s <= 0 || options->warmup_s < 0 || options->rate < 0)
+                return -1;
+
+        // a connection about to close cannot have anything queued behind
+        if (!options->keep_alive)
+                options->depth = 1;
+
+        return 0;
+}
+
+static void *worker_function(void *raw_worker)
+{
+        worker_t *worker = raw_worker;
+
+        worker->epoll_fd = epoll_create1(0);
+        if (worker->epoll_fd < 0) {
+                perror("epoll_create1");
+                return NULL;
+        }
+
+        // spread the first requests over one interval, so connections do not
+        // fire in lockstep
+        uint64_t start = now_ns();
+        for (size_t i = 0; i < worker->connection_count; ++i) {
+                connection_t *connection = &worker->connections[i];
+                connection->worker = worker;
+                connection->fd = -1;
+                connection->next_send_at =
+                        start + worker->interval_ns * i / worker->connection_count;
+
+                if (connection_open(connection) != 0)
+                        worker->errors++;
+        }
+
+        worker->timer_fd = -1;
+        if (worker->interval_ns > 0) {
+                worker->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+                struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+                if (worker->timer_fd < 0 ||
+                    epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->timer_fd, &event) != 0) {
+                        perror("timerfd");
+                        return NULL;
+                }
+        }
+
+        struct epoll_event events[LOADGEN_MAX_EVENTS];
+
+        while (atomic_load_explicit(&is_running, memory_order_relaxed)) {
+                // the timeout only serves to notice the end of the run
+                int count = epoll_wait(worker->epoll_fd, events, LOADGEN_MAX_EVENTS, 100);
+                if (count < 0 && errno != EINTR) {
+                        perror("epoll_wait");
+                        break;
+                }
+
+                for (int i = 0; i < count; ++i) {
+                        connection_t *connection = events[i].data.ptr;
+                        uint32_t flags = events[i].events;
+
+                        // the timer only wakes the loop, due requests are sent below
+                        if (!connection) {
+                                uint64_t expirations;
+                                ssize_t cleared =
+                                        read(worker->timer_fd, &expirations, sizeof(expirations));
+                                (void)cleared;
+                                continue;
+                        }
+
+                        if (connection->fd < 0)
+                                continue;
+
+                        // errors and hang-ups are left to recv(), which still
+                        // delivers whatever arrived before them, such as the
+                        // response announcing the close
+                        bool failed = false;
+                        if (flags & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                                failed = connection_receive(connection) != 0;
+                        if (!failed && connection->fd >= 0 && (flags & EPOLLOUT)) {
+                                connection->is_connected = true;
+                                failed = connection_flush(connection) != 0;
+                        }
+
+                        if (failed) {
+                                worker->errors++;
+                                connection_reset(connection);
+                        }
+                }
+
+                uint64_t now = now_ns();
+                for (size_t i = 0; i < worker->connection_count; ++i) {
+                        connection_t *connection = &worker->connections[i];
+                        if (connection->fd < 0) {
+                                if (connection_open(connection) != 0)
+                                        continue;
+                        }
+
+                        if (connection->is_connected && connection_send(connection, now) != 0) {
+                                worker->errors++;
+                                connection_reset(connection);
+                        }
+                }
+
+                if (worker->timer_fd >= 0)
+                        worker_schedule(worker);
+        }
+
+        for (size_t i = 0; i < worker->connection_count; ++i) {
+                if (worker->connections[i].fd >= 0)
+                        close(worker->connections[i].fd);
+        }
+        if (worker->timer_fd >= 0)
+                close(worker->timer_fd);
+        close(worker->epoll_fd);
+        return NULL;
+}
+
+static void worker_schedule(worker_t *worker)
+{
+        uint64_t earliest = UINT64_MAX;
+        for (size_t i = 0; i < worker->connection_count; ++i) {
+                const connection_t *connection = &worker->connections[i];
+                bool can_send = connection->fd >= 0 && connection->is_connected &&
+                                !connection->closes &&
+                                connection->in_flight < worker->options->depth;
+                if (can_send && connection->next_send_at < earliest)
+                        earliest = connection->next_send_at;
+        }
+
+        // anything else gets sent as responses free up room
+        if (UINT64_MAX == earliest)
+                return;
+
+        struct itimerspec due = {
+                .it_interval = { 0, 0 },
+                .it_value = {
+                        .tv_sec = (time_t)(earliest / 1000000000),
+                        .tv_nsec = (long)(earliest % 1000000000),
+                },
+        };
+        // an absolute time of 0 would disarm the timer instead
+        if (0 == due.it_value.tv_sec && 0 == due.it_value.tv_nsec)
+                due.it_value.tv_nsec = 1;
+
+        timerfd_settime(worker->timer_fd, TFD_TIMER_ABSTIME, &due, NULL);
+}
+
+static int connection_open(connection_t *connection)
+{
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0)
+                return -1;
+
+        int enable = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+        if (connect(fd, (struct sockaddr *)&target, sizeof(target)) != 0 &&
+            errno != EINPROGRESS) {
+                close(fd);
+                return -1;
+        }
+
+        struct epoll_event event = {
+                .events = EPOLLIN | EPOLLOUT | EPOLLET,
+                .data.ptr = connection,
+        };
+        if (epoll_ctl(connection->worker->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+                close(fd);
+                return -1;
+        }
+
+        connection->fd = fd;
+        connection->is_connected = false;
+        connection->sent_head = 0;
+        connection->in_flight = 0;
+        connection->pending_offset = 0;
+        connection->pending_length = 0;
+        connection->length = 0;
+        connection->in_body = false;
+        connection->body_remaining = 0;
+        connection->closes = false;
+        return 0;
+}
+
+static void connection_reset(connection_t *connection)
+{
+        if (connection->fd >= 0)
+                close(connection->fd);
+        connection->fd = -1;
+        connection->worker->reconnects++;
+
+        // whatever was in flight is lost, and counted as such by the caller;
+        // with a target rate, the schedule carries on regardless
+}
+
+static int connection_send(connection_t *connection, uint64_t now)
+{
+        const worker_t *worker = connection->worker;
+        size_t depth = worker->options->depth;
+        size_t queued = 0;
+
+        // nothing more is answered once the server said it closes
+        if (connection->closes)
+                return 0;
+
+        while (connection->in_flight < depth) {
+                uint64_t sent_at = now;
+                if (worker->interval_ns > 0) {
+                        if (connection->next_send_at > now)
+                                break;
+
+                        sent_at = connection->next_send_at;
+                        connection->next_send_at += worker->interval_ns;
+                }
+
+                size_t slot = (connection->sent_head + connection->in_flight) % LOADGEN_MAX_DEPTH;
+                connection->sent_at[slot] = sent_at;
+                connection->in_flight++;
+                queued++;
+        }
+
+        if (0 == queued)
+                return 0;
+
+        // the buffer repeats the same request, so the window can always be
+        // moved back into the first copy
+        connection->pending_offset %= request_length;
+        connection->pending_length += queued * request_length;
+        return connection_flush(connection);
+}
+
+static int connection_flush(connection_t *connection)
+{
+        while (connection->pending_length > 0) {
+                ssize_t written = send(connection->fd, requests + connection->pending_offset,
+                                       connection->pending_length, MSG_NOSIGNAL);
+                if (written < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                return 0;
+                        return -1;
+                }
+
+                connection->pending_offset += (size_t)written;
+                connection->pending_length -= (size_t)written;
+        }
+
+        return 0;
+}
+
+static int connection_receive(connection_t *connection)
+{
+        while (true) {
+                if (connection->length == LOADGEN_BUFFER_SIZE)
+                        return -1;
+
+                ssize_t received = recv(connection->fd, connection->buffer + connection->length,
+                                        LOADGEN_BUFFER_SIZE - connection->length, 0);
+                if (received < 0 && errno == EINTR)
+                        continue;
+                if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        return 0;
+
+                if (received <= 0) {
+                        // an announced close is not an error, even when the
+                        // server resets the connection over pipelined requests
+                        // it left unread; reconnecting is up to the main loop
+                        if (!connection->closes)
+                                return -1;
+
+                        close(connection->fd);
+                        connection->fd = -1;
+                        connection->worker->reconnects++;
+                        return 0;
+                }
+
+                connection->length += (size_t)received;
+                if (connection_parse(connection) != 0)
+                        return -1;
+        }
+}
+
+static int connection_parse(connection_t *connection)
+{
+        size_t offset = 0;
+
+        while (offset < connection->length) {
+                if (connection->in_body) {
+                        size_t available = connection->length - offset;
+                        size_t taken = available < connection->body_remaining
+                                               ? available
+                                               : connection->body_remaining;
+                        offset += taken;
+                        connection->body_remaining -= taken;
+
+                        if (connection->body_remaining > 0)
+                                break;
+
+                        connection->in_body = false;
+                        connection_complete(connection);
+                        continue;
+                }
+
+                const char *head = connection->buffer + offset;
+                size_t available = connection->length - offset;
+                const char *head_end = memmem(head, available, "\r\n\r\n", 4);
+                if (!head_end)
+                        break;
+
+                if (available < 12 || strncmp(head, "HTTP/1.", 7) != 0)
+                        return -1;
+
+                connection->status = atoi(head + 9);
+                connection->body_remaining = 0;
+                connection->closes = connection->closes || !connection->worker->options->keep_alive;
+
+                // headers are matched case-insensitively at the start of a line
+                for (const char *line = memchr(head, '\n', (size_t)(head_end - head));
+                     line && line < head_end;
+                     line = memchr(line + 1, '\n', (size_t)(head_end - line - 1))) {
+                        const char *name = line + 1;
+                        if (strncasecmp(name, "Content-Length:", 15) == 0)
+                                connection->body_remaining = strtoul(name + 15, NULL, 10);
+                        else if (strncasecmp(name, "Connection: close", 17) == 0)
+                                connection->closes = true;
+                }
+
+                offset = (size_t)(head_end - connection->buffer) + 4;
+                connection->in_body = true;
+                if (0 == connection->body_remaining) {
+                        connection->in_body = false;
+                        connection_complete(connection);
+                }
+        }
+
+        memmove(connection->buffer, connection->buffer + offset, connection->length - offset);
+        connection->length -= offset;
+        return 0;
+}
+
+static void connection_complete(connection_t *connection)
+{
+        worker_t *worker = connection->worker;
+        if (0 == connection->in_flight)
+                return;
+
+        uint64_t sent_at = connection->sent_at[connection->sent_head];
+        connection->sent_head = (connection->sent_head + 1) % LOADGEN_MAX_DEPTH;
+        connection->in_flight--;
+
+        if (!atomic_load_explicit(&is_recording, memory_order_relaxed))
+                return;
+
+        uint64_t now = now_ns();
+        histogram_record(&worker->histogram, now > sent_at ? now - sent_at : 0);
+        worker->completed++;
+        if (connection->status < 200 || connection->status >= 300)
+                worker->non_2xx++;
+}
+
+static void histogram_record(histogram_t *histogram, uint64_t value)
+{
+        histogram->counts[histogram_bucket(value)]++;
+        histogram->total++;
+        if (value > histogram->max)
+                histogram->max = value;
+}
+
+static size_t histogram_bucket(uint64_t value)
+{
+        if (value < (UINT64_C(1) << HISTOGRAM_SUB_BITS))
+                return (size_t)value;
+
+        unsigned int exponent = 63 - (unsigned int)__builtin_clzll(value);
+        if (exponent >= HISTOGRAM_MAX_SHIFT)
+                return HISTOGRAM_BUCKETS - 1;
+
+        size_t group = exponent - HISTOGRAM_SUB_BITS + 1;
+        size_t sub_bucket = (size_t)(value >> (exponent - HISTOGRAM_SUB_BITS)) -
+                            ((size_t)1 << HISTOGRAM_SUB_BITS);
+        return (group << HISTOGRAM_SUB_BITS) + sub_bucket;
+}
+
+static uint64_t histogram_value(size_t bucket)
+{
+        if (bucket < ((size_t)1 << HISTOGRAM_SUB_BITS))
+                return bucket;
+
+        // the middle of the bucket
+        size_t group = bucket >> HISTOGRAM_SUB_BITS;
+        size_t sub_bucket = bucket & (((size_t)1 << HISTOGRAM_SUB_BITS) - 1);
+        uint64_t lowest = (((uint64_t)1 << HISTOGRAM_SUB_BITS) + sub_bucket) << (group - 1);
+        return lowest + (((uint64_t)1 << (group - 1)) >> 1);
+}
+
+static void histogram_merge(histogram_t *into, const histogram_t *from)
+{
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+                into->counts[i] += from->counts[i];
+        into->total += from->total;
+        if (from->max > into->max)
+                into->max = from->max;
+}
+
+static void histogram_correct(histogram_t *corrected, const histogram_t *raw, uint64_t interval)
+{
+        *corrected = *raw;
+        if (0 == interval)
+                return;
+
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+                uint64_t count = raw->counts[i];
+                uint64_t value = histogram_value(i);
+                if (0 == count || value <= interval)
+                        continue;
+
+                for (uint64_t missing = value - interval; missing >= interval;
+                     missing -= interval) {
+                        corrected->counts[histogram_bucket(missing)] += count;
+                        corrected->total += count;
+                }
+        }
+}
+
+static double histogram_percentile(const histogram_t *histogram, double percentile)
+{
+        if (0 == histogram->total)
+                return 0;
+
+        uint64_t wanted = (uint64_t)(percentile * (double)histogram->total);
+        if (wanted < 1)
+                wanted = 1;
+
+        uint64_t seen = 0;
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+                seen += histogram->counts[i];
+                if (seen >= wanted) {
+                        uint64_t value = histogram_value(i);
+                        return (double)(value < histogram->max ? value : histogram->max);
+                }
+        }
+
+        return (double)histogram->max;
+}
+
+static uint64_t now_ns(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static void sleep_s(double seconds)
+{
+        struct timespec duration = {
+                .tv_sec = (time_t)seconds,
+                .tv_nsec = (long)((seconds - (double)(time_t)seconds) * 1e9),
+        };
+        while (nanosleep(&duration, &duration) != 0 && errno == EINTR)
+                ;
+}